@@ -0,0 +1,281 @@
+// Throughput benchmark for fpwrap backends.
+//
+//   g++ -O3 -std=c++17 -I.. fpbench.cpp -o fpbench -lz -lpthread
+//       [-DFP_USE_ZSTD -lzstd] [-DFP_USE_XZ -llzma] [-DFP_USE_BZ2 -lbz2] [-DFP_USE_URING]
+//       [-DFP_USE_LIBDEFLATE -ldeflate] [-DFP_USE_ISAL -lisal]
+//   ./fpbench [-s MiB] [-d dir] [-q] [filter]
+//
+// Each row times one operation (write, fprintf, read, bulk_read, getc, next_line) on one backend, data set and
+// setting (buffer size when reading, level and threads when writing) and prints uncompressed MB/s, the compression
+// ratio and how many read/write system calls per GB the operation took, taken from /proc/self/io. io_uring
+// submissions and mmap page faults do not show up there. Only rows whose "backend/op/data" contains filter run.
+// Files are read back from the page cache; drop it first to measure the disk. Exits nonzero if any write, close
+// or read back fails.
+
+#include "fpwrap.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <unistd.h>
+
+namespace {
+
+using clk = std::chrono::steady_clock;
+
+struct IoCounts {
+    std::uint64_t syscr = 0, syscw = 0;
+};
+
+IoCounts io_counts() {
+    IoCounts ret;
+    if(std::FILE *fp = std::fopen("/proc/self/io", "r")) {
+        char key[64];
+        unsigned long long v;
+        while(std::fscanf(fp, "%63[^:]: %llu\n", key, &v) == 2) {
+            if(!std::strcmp(key, "syscr")) ret.syscr = v;
+            else if(!std::strcmp(key, "syscw")) ret.syscw = v;
+        }
+        std::fclose(fp);
+    }
+    return ret;
+}
+
+// Incompressible bytes, tab-separated numeric text and FASTQ records.
+std::string make_random(size_t n) {
+    std::string ret(n, '\0');
+    std::mt19937_64 rng(13);
+    for(size_t i = 0; i + 8 <= n; i += 8) {
+        const std::uint64_t v = rng();
+        std::memcpy(&ret[i], &v, 8);
+    }
+    return ret;
+}
+std::string make_text(size_t n) {
+    std::string ret;
+    ret.reserve(n + 128);
+    std::mt19937_64 rng(17);
+    char line[128];
+    for(std::uint64_t row = 0; ret.size() < n; ++row) {
+        const int len = std::snprintf(line, sizeof(line), "chr%u\t%llu\t%u\t%.4f\n", unsigned(rng() % 22 + 1),
+                                      (unsigned long long)(row * 37), unsigned(rng() % 1000), (rng() % 100000) / 1e4);
+        ret.append(line, len);
+    }
+    ret.resize(n);
+    ret.back() = '\n';
+    return ret;
+}
+std::string make_fastq(size_t n) {
+    static const char bases[] = "ACGT";
+    std::string ret;
+    ret.reserve(n + 512);
+    std::mt19937_64 rng(19);
+    char header[64];
+    for(std::uint64_t rec = 0; ret.size() < n; ++rec) {
+        ret.append(header, std::snprintf(header, sizeof(header), "@read.%llu length=150\n", (unsigned long long)rec));
+        for(int i = 0; i < 150; ++i) ret.push_back(bases[rng() & 3]);
+        ret.append("\n+\n");
+        for(int i = 0; i < 150; ++i) ret.push_back(char('!' + 20 + rng() % 21));
+        ret.push_back('\n');
+    }
+    ret.resize(n);
+    ret.back() = '\n';
+    return ret;
+}
+
+struct DataSet {
+    const char *name;
+    std::string bytes;
+};
+
+struct Bench {
+    std::string dir = "/tmp";
+    std::string filter;
+    std::vector<DataSet> data;
+    bool header = true;
+    int failures = 0;
+
+    void fail(const std::string &name, const char *what) {
+        std::fprintf(stderr, "%s: %s\n", name.data(), what);
+        ++failures;
+    }
+
+    bool wanted(const std::string &name) const {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    }
+    void report(const std::string &name, const std::string &setting, size_t nbytes, size_t stored,
+                clk::duration t, const IoCounts &before) {
+        const IoCounts after = io_counts();
+        const double secs = std::chrono::duration<double>(t).count();
+        const double gb = nbytes / 1e9;
+        if(header) {
+            std::printf("%-36s %-14s %10s %8s %12s %12s\n", "backend/op/data", "setting", "MB/s", "ratio",
+                        "reads/GB", "writes/GB");
+            header = false;
+        }
+        std::printf("%-36s %-14s %10.1f %8.2f %12.0f %12.0f\n", name.data(), setting.data(),
+                    nbytes / 1e6 / secs, stored ? double(nbytes) / stored: 0.,
+                    (after.syscr - before.syscr) / gb, (after.syscw - before.syscw) / gb);
+        std::fflush(stdout);
+    }
+};
+
+size_t file_size(const std::string &path) {
+    struct stat s;
+    return ::stat(path.data(), &s) ? 0: s.st_size;
+}
+
+// Backend descriptions: the handle type, a name and file suffix, and the settings worth sweeping.
+// Read-only backends read files written through W; write-only ones are not read back.
+template<typename P, typename W=P>
+struct Backend {
+    const char *name;
+    const char *suffix;
+    std::vector<int> levels;
+    std::vector<int> threads;
+    bool readable = true;
+};
+
+template<typename P, typename W>
+void write_file(Bench &b, const Backend<P, W> &be, const DataSet &ds, const std::string &path,
+                const char *op, int level, int threads) {
+    const std::string name = std::string(be.name) + '/' + op + '/' + ds.name;
+    const bool timed = std::is_same<P, W>::value && b.wanted(name);
+    fp::Options opts;
+    opts.level = level;
+    opts.threads = threads;
+    const IoCounts before = io_counts();
+    const auto start = clk::now();
+    bool ok = true;
+    {
+        fp::FpWrapper<W> out(path.data(), "wb", opts);
+        const std::string &s = ds.bytes;
+        if(!std::strcmp(op, "fprintf")) {
+            // One call per line, as a text writer would make.
+            for(size_t pos = 0; pos < s.size();) {
+                const char *nl = static_cast<const char *>(std::memchr(s.data() + pos, '\n', s.size() - pos));
+                const size_t len = nl ? nl - s.data() - pos + 1: s.size() - pos;
+                ok &= out.fprintf("%.*s", int(len), s.data() + pos) == int(len);
+                pos += len;
+            }
+        } else {
+            static constexpr size_t CHUNK = 1 << 16;
+            for(size_t pos = 0; pos < s.size(); pos += CHUNK) {
+                const size_t len = std::min(CHUNK, s.size() - pos);
+                ok &= std::int64_t(out.write(s.data() + pos, len)) == std::int64_t(len);
+            }
+        }
+        ok &= out.close() == 0;
+    }
+    if(!ok) b.fail(name + " (" + std::to_string(level) + ", " + std::to_string(threads) + ")", "write failed");
+    if(!timed) return;
+    std::string setting = level < 0 ? "default": "level=" + std::to_string(level);
+    if(threads >= 0) setting += " T" + std::to_string(threads);
+    b.report(name, setting, ds.bytes.size(), file_size(path), clk::now() - start, before);
+}
+
+template<typename P, typename W>
+void read_file(Bench &b, const Backend<P, W> &be, const DataSet &ds, const std::string &path,
+               const char *op, size_t bufsize) {
+    const std::string name = std::string(be.name) + '/' + op + '/' + ds.name;
+    if(!b.wanted(name)) return;
+    std::vector<char> chunk(bufsize);
+    size_t total = 0;
+    const IoCounts before = io_counts();
+    const auto start = clk::now();
+    {
+        fp::FpWrapper<P> in(path.data(), "rb");
+        in.resize_buffer(bufsize);
+        if(!std::strcmp(op, "getc")) {
+            for(int c; (c = in.getc()) != EOF; ++total);
+        } else if(!std::strcmp(op, "next_line")) {
+            std::string_view line;
+            while(in.next_line(line)) total += line.size() + 1;
+        } else if(!std::strcmp(op, "bulk_read")) {
+            for(std::int64_t n; (n = in.bulk_read(chunk.data(), chunk.size())) > 0; total += n);
+        } else {
+            for(std::int64_t n; (n = in.read(chunk.data(), chunk.size())) > 0; total += n);
+        }
+    }
+    const auto t = clk::now() - start;
+    if(total != ds.bytes.size())
+        b.fail(name, ("read " + std::to_string(total) + " of " + std::to_string(ds.bytes.size()) + " bytes").data());
+    b.report(name, "buffer=" + std::to_string(bufsize >> 10) + "K", total, file_size(path), t, before);
+}
+
+template<typename P, typename W>
+void run(Bench &b, const Backend<P, W> &be) {
+    static const size_t bufsizes[] = {1 << 13, 1 << 16, 1 << 20};
+    static const char *const ops[] = {"write", "fprintf", "read", "bulk_read", "getc", "next_line"};
+    for(const DataSet &ds: b.data) {
+        if(std::none_of(std::begin(ops), std::end(ops), [&](const char *op) {
+            return b.wanted(std::string(be.name) + '/' + op + '/' + ds.name);
+        })) continue;
+        const std::string path = b.dir + "/fpbench." + ds.name + be.suffix;
+        const std::vector<int> threads = be.threads.empty() ? std::vector<int>{-1}: be.threads;
+        for(int nt: threads)
+            for(int level: be.levels)
+                write_file(b, be, ds, path, "write", level, nt);
+        const bool text = std::strcmp(ds.name, "random");
+        if(text) write_file(b, be, ds, path, "fprintf", -1, -1);
+        // The last write leaves the file at the default settings for the reads below.
+        write_file(b, be, ds, path, "write", -1, -1);
+        if(be.readable) {
+            for(size_t bufsize: bufsizes) {
+                read_file(b, be, ds, path, "read", bufsize);
+                read_file(b, be, ds, path, "bulk_read", bufsize);
+            }
+            read_file(b, be, ds, path, "getc", 1 << 16);
+            if(text) read_file(b, be, ds, path, "next_line", 1 << 16);
+        }
+        std::remove(path.data());
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    Bench b;
+    size_t mib = 64;
+    for(int c; (c = ::getopt(argc, argv, "s:d:qh")) >= 0;) {
+        switch(c) {
+            case 's': mib = std::strtoull(optarg, nullptr, 10); break;
+            case 'd': b.dir = optarg; break;
+            case 'q': b.header = false; break;
+            default:
+                std::fprintf(stderr, "usage: %s [-s MiB] [-d dir] [-q] [filter]\n", argv[0]);
+                return c != 'h';
+        }
+    }
+    if(optind < argc) b.filter = argv[optind];
+    const size_t n = mib << 20;
+    b.data.push_back({"random", make_random(n)});
+    b.data.push_back({"text", make_text(n)});
+    b.data.push_back({"fastq", make_fastq(n)});
+
+    run(b, Backend<std::FILE *>{"FILE", ".txt", {}, {}});
+    run(b, Backend<gzFile>{"gzFile", ".gz", {1, 6, 9}, {}});
+    run(b, Backend<fp::GzipFile *>{"GzipFile", ".gz", {1, 6, 9}, {}});
+    run(b, Backend<fp::BgzfFile *>{"BgzfFile", ".bgz", {1, 6}, {1, 4}});
+    run(b, Backend<fp::IndexedGzFile *, gzFile>{"IndexedGzFile", ".igz", {}, {}});
+    run(b, Backend<fp::MmapFile *, std::FILE *>{"MmapFile", ".mm", {}, {}});
+    run(b, Backend<fp::DirectFile *>{"DirectFile", ".dio", {}, {}});
+    run(b, Backend<fp::ReadAheadFile<std::FILE *> *, std::FILE *>{"ReadAhead<FILE>", ".ra", {}, {}});
+    run(b, Backend<fp::WriteBehindFile<std::FILE *> *>{"WriteBehind<FILE>", ".wb", {}, {}, false});
+#if FP_USE_ISAL
+    run(b, Backend<fp::IgzipFile *>{"IgzipFile", ".igzip.gz", {1, 3}, {}});
+#endif
+#if FP_USE_ZSTD
+    run(b, Backend<fp::ZstdFile *>{"ZstdFile", ".zst", {1, 3, 19}, {0, 4}});
+    run(b, Backend<fp::SeekableZstdFile *>{"SeekableZstdFile", ".szst", {1, 3}, {}});
+#endif
+#if FP_USE_XZ
+    run(b, Backend<fp::XzFile *>{"XzFile", ".xz", {1, 6}, {1, 4}});
+#endif
+#if FP_USE_BZ2
+    run(b, Backend<fp::Bz2File *>{"Bz2File", ".bz2", {1, 9}, {}});
+#endif
+#if FP_USE_URING
+    run(b, Backend<fp::UringFile *, std::FILE *>{"UringFile", ".uring", {}, {}});
+#endif
+    return b.failures != 0;
+}
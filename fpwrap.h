@@ -5,13 +5,65 @@
 #else
 #  include <zlib.h>
 #endif
+#if FP_USE_ZSTD
+#  include <zstd.h>
+#  include <zdict.h>
+#endif
+#if FP_USE_XZ
+#  include <lzma.h>
+#endif
+#if FP_USE_BZ2
+#  include <bzlib.h>
+#endif
+#if FP_USE_LIBDEFLATE
+#  include <libdeflate.h>
+#endif
+#if FP_USE_ISAL
+#  include <isa-l/igzip_lib.h>
+#endif
+#if FP_USE_URING
+#  include <linux/io_uring.h>
+#  undef BLOCK_SIZE // From <linux/fs.h>; clashes with BgzfFile::BLOCK_SIZE
+#  include <sys/syscall.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
 #include <vector>
+#if __cplusplus > 201703L && __has_include(<span>)
+#  include <span>
+#endif
+#if __SSSE3__
+#  include <tmmintrin.h>
+#endif
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #ifndef CONST_IF
 #  if __cpp_if_constexpr
@@ -21,16 +73,23 @@
 #  endif
 #endif
 
-// This could certainly be extended to other compression/reading schemes, but it's not bad for now.
+// std::FILE * and gzFile are handled directly.
+// Native zstd, xz and bzip2 backends are enabled with FP_USE_ZSTD, FP_USE_XZ and FP_USE_BZ2.
 
 namespace fp {
 
+enum class FszMode: int {
+    exact,    // Decompresses unless the format records exact sizes (BGZF blocks, zstd frame headers, the xz index)
+    fast,     // Also trusts the gzip ISIZE trailer, which only covers the last member and wraps at 4 GiB
+    estimate  // Compressed size times a typical ratio, without reading the file
+};
+
 template<typename PointerType>
-inline std::uint64_t get_fsz(const char *path);
+inline std::uint64_t get_fsz(const char *path, FszMode mode=FszMode::exact);
 
 // Returns UINT64_MAX on failure, the filesize otherwise.
 
-template<> inline std::uint64_t get_fsz<std::FILE *>(const char *path) {
+template<> inline std::uint64_t get_fsz<std::FILE *>(const char *path, FszMode) {
     if(auto p = std::fopen(path, "rb"); p) {
         struct stat fs;
         ::fstat(::fileno(p), &fs);
@@ -40,134 +99,4942 @@ template<> inline std::uint64_t get_fsz<std::FILE *>(const char *path) {
     return -1;
 }
 
-template<> inline std::uint64_t get_fsz<gzFile>(const char *path) {
-    if(auto p = gzopen(path, "rb"); p) {
-        size_t tot_read = 0;
-        ssize_t i;
-        char buf[1 << 15];
-        while((i = gzread(p, buf, sizeof(buf))) == sizeof(buf))
-            tot_read += sizeof(buf);
-        if(i < 0) std::fprintf(stderr, "Warning: Error code %ld when reading from gzFile\n", (long int)i);
-        else tot_read += i;
-        gzclose(p);
-        return tot_read;
+class Dictionary;
+
+// Backend settings. Fields left at their defaults defer to the mode string, then to the backend.
+struct Options {
+    int level = -1;             // -1 selects the codec's default
+    int threads = -1;           // Worker threads; -1 if unspecified, 0 for one per core
+    int window_log = 0;         // log2 of the match window (zstd); when reading, the largest window accepted
+    bool long_distance = false; // zstd long-distance matching
+    int buffers = 0;            // Queue depth for background I/O (ReadAheadFile, WriteBehindFile, UringFile); 0 for the default
+    size_t buffer_size = 0;     // Size of each queued buffer, or of DirectFile's transfer buffer; 0 for the default
+    std::uint64_t index_span = 0; // Decompressed bytes between IndexedGzFile access points or SeekableZstdFile frames; 0 for the default
+    bool nonblocking = false;   // Sets O_NONBLOCK: CodecFile reads return what has arrived, or fail with EAGAIN
+    bool auto_buffer = false;   // Sizes buffers from the file at open; CodecFile and BgzfFile grow them during long transfers
+    std::shared_ptr<const Dictionary> dictionary; // zstd dictionary or zlib preset dictionary (ZstdFile, SeekableZstdFile, GzipFile)
+};
+
+// Counters kept by FpWrapper and the backends when FP_STATS is defined; otherwise they stay zero.
+// "Raw" bytes are those read from or written to the file (or memory buffer), compressed where the backend compresses.
+struct IoStats {
+    std::uint64_t bytes_read = 0, bytes_written = 0; // Uncompressed bytes returned to or accepted from the caller
+    std::uint64_t raw_read = 0, raw_written = 0;
+    std::uint64_t calls = 0;      // Calls FpWrapper made into the backend
+    std::uint64_t syscalls = 0;   // read/write system calls made by backends implemented here
+    std::uint64_t backend_ns = 0; // Time spent in backend calls, of which
+    std::uint64_t codec_ns = 0;   // compressing or decompressing (summed over worker threads, so it may exceed backend_ns)
+    std::uint64_t io_ns = 0;      // and in read/write system calls
+    IoStats &operator+=(const IoStats &o) {
+        bytes_read += o.bytes_read; bytes_written += o.bytes_written;
+        raw_read += o.raw_read; raw_written += o.raw_written;
+        calls += o.calls; syscalls += o.syscalls;
+        backend_ns += o.backend_ns; codec_ns += o.codec_ns; io_ns += o.io_ns;
+        return *this;
+    }
+    // One line of key=value pairs, for logs and metrics exporters.
+    std::string to_string() const {
+        char buf[512];
+        std::snprintf(buf, sizeof(buf), "bytes_read=%llu bytes_written=%llu raw_read=%llu raw_written=%llu calls=%llu "
+                      "syscalls=%llu backend_ns=%llu codec_ns=%llu io_ns=%llu",
+                      (unsigned long long)bytes_read, (unsigned long long)bytes_written, (unsigned long long)raw_read,
+                      (unsigned long long)raw_written, (unsigned long long)calls, (unsigned long long)syscalls,
+                      (unsigned long long)backend_ns, (unsigned long long)codec_ns, (unsigned long long)io_ns);
+        return buf;
+    }
+};
+
+// Process-wide totals: every FpWrapper adds its counters when it closes.
+class GlobalStats {
+    std::mutex mut_;
+    IoStats total_;
+public:
+    static GlobalStats &global() {
+        static GlobalStats ret;
+        return ret;
+    }
+    void add(const IoStats &s) {
+        std::lock_guard<std::mutex> lock(mut_);
+        total_ += s;
+    }
+    IoStats snapshot() {
+        std::lock_guard<std::mutex> lock(mut_);
+        return total_;
+    }
+    // Returns the totals so far and starts again from zero.
+    IoStats reset() {
+        std::lock_guard<std::mutex> lock(mut_);
+        return std::exchange(total_, IoStats());
+    }
+};
+
+namespace detail {
+
+#if FP_STATS
+static constexpr bool STATS = true;
+#else
+static constexpr bool STATS = false;
+#endif
+
+inline void count(std::uint64_t &counter, std::uint64_t n=1) {
+    CONST_IF(STATS) counter += n;
+}
+
+// Adds the time until it goes out of scope to counter, when FP_STATS is defined.
+class StatTimer {
+    std::uint64_t *counter_ = nullptr;
+    std::chrono::steady_clock::time_point start_;
+public:
+    explicit StatTimer(std::uint64_t &counter) {
+        CONST_IF(STATS) {
+            counter_ = &counter;
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+    StatTimer(const StatTimer &) = delete;
+    StatTimer &operator=(const StatTimer &) = delete;
+    ~StatTimer() {
+        CONST_IF(STATS)
+            *counter_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+    }
+};
+
+} // namespace detail
+
+// Byte order of data passed to read_array/write_array.
+enum class ByteOrder {
+    native,
+    little,
+    big
+};
+
+// Allocator whose value-less construct() default-initializes, so resizing leaves trivial types uninitialized.
+template<typename T, typename Alloc=std::allocator<T>>
+class DefaultInitAllocator: public Alloc {
+    using traits = std::allocator_traits<Alloc>;
+public:
+    template<typename U>
+    struct rebind {
+        using other = DefaultInitAllocator<U, typename traits::template rebind_alloc<U>>;
+    };
+    using Alloc::Alloc;
+    DefaultInitAllocator() = default;
+    DefaultInitAllocator(const Alloc &a) noexcept: Alloc(a) {}
+    template<typename U, typename A>
+    DefaultInitAllocator(const DefaultInitAllocator<U, A> &o) noexcept: Alloc(o) {}
+    template<typename U>
+    void construct(U *p) noexcept(std::is_nothrow_default_constructible<U>::value) {
+        ::new(static_cast<void *>(p)) U;
+    }
+    template<typename U, typename... Args>
+    void construct(U *p, Args &&... args) {
+        traits::construct(static_cast<Alloc &>(*this), p, std::forward<Args>(args)...);
+    }
+};
+
+template<typename T>
+using uninit_vector = std::vector<T, DefaultInitAllocator<T>>;
+
+/*
+ * Allocations of at least HUGEPAGE_SIZE come straight from mmap, rounded up to whole huge pages,
+ * and are marked MADV_HUGEPAGE; smaller ones use operator new.
+ */
+template<typename T>
+struct HugePageAllocator {
+    using value_type = T;
+    static constexpr size_t HUGEPAGE_SIZE = 1 << 21;
+
+    HugePageAllocator() = default;
+    template<typename U>
+    HugePageAllocator(const HugePageAllocator<U> &) noexcept {}
+    static size_t mapped_size(size_t bytes) {return (bytes + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);}
+    T *allocate(size_t n) {
+        const size_t bytes = n * sizeof(T);
+        if(bytes < HUGEPAGE_SIZE) return static_cast<T *>(::operator new(bytes));
+        void *p = ::mmap(nullptr, mapped_size(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+        ::madvise(p, mapped_size(bytes), MADV_HUGEPAGE);
+#endif
+        return static_cast<T *>(p);
+    }
+    void deallocate(T *p, size_t n) noexcept {
+        const size_t bytes = n * sizeof(T);
+        if(bytes < HUGEPAGE_SIZE) ::operator delete(p);
+        else ::munmap(p, mapped_size(bytes));
+    }
+    template<typename U>
+    bool operator==(const HugePageAllocator<U> &) const noexcept {return true;}
+    template<typename U>
+    bool operator!=(const HugePageAllocator<U> &) const noexcept {return false;}
+};
+
+/*
+ * Per-thread cache of freed buffers in power-of-two size classes, so buffers are recycled when files
+ * are opened and closed in a loop. Memory comes from, and beyond MAX_CACHED per class returns to, Upstream.
+ * Buffers freed on another thread join that thread's cache.
+ */
+template<typename Upstream=std::allocator<char>>
+class BufferPool {
+public:
+    static constexpr unsigned MIN_SHIFT = 12, NCLASSES = 32;
+    static constexpr size_t MAX_CACHED = 8;
+private:
+    std::vector<char *> free_[NCLASSES];
+    Upstream upstream_;
+public:
+    static BufferPool &local() {
+        thread_local BufferPool pool;
+        return pool;
+    }
+    static unsigned size_class(size_t bytes) {
+        unsigned c = MIN_SHIFT;
+        while((size_t(1) << c) < bytes) ++c;
+        return c;
+    }
+    char *take(unsigned c) {
+        if(c - MIN_SHIFT < NCLASSES && !free_[c - MIN_SHIFT].empty()) {
+            char *p = free_[c - MIN_SHIFT].back();
+            free_[c - MIN_SHIFT].pop_back();
+            return p;
+        }
+        return upstream_.allocate(size_t(1) << c);
+    }
+    void give(char *p, unsigned c) {
+        if(c - MIN_SHIFT < NCLASSES && free_[c - MIN_SHIFT].size() < MAX_CACHED) free_[c - MIN_SHIFT].push_back(p);
+        else upstream_.deallocate(p, size_t(1) << c);
+    }
+    // Returns every cached buffer to Upstream.
+    void trim() {
+        for(unsigned i = 0; i < NCLASSES; ++i) {
+            for(char *p: free_[i]) upstream_.deallocate(p, size_t(1) << (i + MIN_SHIFT));
+            free_[i].clear();
+        }
+    }
+    ~BufferPool() {trim();}
+};
+
+// Stateless allocator drawing from the calling thread's BufferPool<Upstream>.
+template<typename T, typename Upstream=std::allocator<char>>
+struct PoolAllocator {
+    using value_type = T;
+    template<typename U>
+    struct rebind {
+        using other = PoolAllocator<U, Upstream>;
+    };
+
+    PoolAllocator() = default;
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U, Upstream> &) noexcept {}
+    T *allocate(size_t n) {
+        return reinterpret_cast<T *>(BufferPool<Upstream>::local().take(BufferPool<Upstream>::size_class(n * sizeof(T))));
+    }
+    void deallocate(T *p, size_t n) noexcept {
+        BufferPool<Upstream>::local().give(reinterpret_cast<char *>(p), BufferPool<Upstream>::size_class(n * sizeof(T)));
+    }
+    template<typename U>
+    bool operator==(const PoolAllocator<U, Upstream> &) const noexcept {return true;}
+    template<typename U>
+    bool operator!=(const PoolAllocator<U, Upstream> &) const noexcept {return false;}
+};
+
+namespace detail {
+
+struct ModeInfo: Options {
+    bool write = false;
+    bool append = false;
+};
+
+inline bool is_digit(char c) {return c >= '0' && c <= '9';}
+
+inline int parse_digits(const char *&p) {
+    int ret = 0;
+    while(is_digit(*p)) ret = ret * 10 + (*p++ - '0');
+    return ret;
+}
+
+// Parses fopen/gzopen-style mode strings, e.g. "rb", "wb9", "ab19".
+// Extensions: "T<n>" requests n worker threads from backends which support them,
+// "L" enables long-distance matching and "L<n>" also sets the window log.
+// Fields set in opts take precedence.
+inline ModeInfo parse_mode(const char *mode, const Options &opts=Options()) {
+    ModeInfo ret;
+    for(const char *p = mode; p && *p;) {
+        switch(*p) {
+            case 'w': ret.write = true; ++p; break;
+            case 'a': ret.write = ret.append = true; ++p; break;
+            case 'r': ret.write = false; ++p; break;
+            case 'T':
+                if(is_digit(*++p)) ret.threads = parse_digits(p);
+                break;
+            case 'L':
+                ret.long_distance = true;
+                if(is_digit(*++p)) ret.window_log = parse_digits(p);
+                break;
+            default:
+                if(is_digit(*p)) ret.level = parse_digits(p);
+                else ++p;
+        }
+    }
+    if(opts.level >= 0) ret.level = opts.level;
+    if(opts.threads >= 0) ret.threads = opts.threads;
+    if(opts.window_log > 0) ret.window_log = opts.window_log;
+    if(opts.long_distance) ret.long_distance = true;
+    ret.auto_buffer = opts.auto_buffer;
+    ret.dictionary = opts.dictionary;
+    return ret;
+}
+
+// Removes the "T<n>" and "L<n>" extensions before handing a mode to gzopen or fopen;
+// gzopen would otherwise read 'T' as transparent writing.
+inline std::string strip_extensions(const char *mode) {
+    std::string ret;
+    for(const char *p = mode; *p; ++p) {
+        if(*p == 'L' || (*p == 'T' && is_digit(p[1]))) {
+            while(is_digit(p[1])) ++p;
+        } else ret += *p;
+    }
+    return ret;
+}
+
+static constexpr size_t AUTO_BUFSIZE_MIN = 1 << 12, AUTO_BUFSIZE_START = 1 << 20, AUTO_BUFSIZE_MAX = 1 << 22;
+static constexpr unsigned AUTO_GROW_AFTER = 4;
+
+// Initial buffer size for Options::auto_buffer, from fstat(fd), or stat(path) when fd < 0. Small regular files
+// are read in one go and larger ones start at AUTO_BUFSIZE_START; pipes and files being written get 64 KiB.
+inline size_t auto_buffer_size(int fd, const char *path, bool write) {
+    struct stat s;
+    const int rc = write ? -1: fd >= 0 ? ::fstat(fd, &s): path ? ::stat(path, &s): -1;
+    if(rc != 0 || !S_ISREG(s.st_mode)) return 1 << 16;
+    const size_t rounded = (std::uint64_t(s.st_size) + AUTO_BUFSIZE_MIN - 1) & ~std::uint64_t(AUTO_BUFSIZE_MIN - 1);
+    return std::clamp(rounded, AUTO_BUFSIZE_MIN, AUTO_BUFSIZE_START);
+}
+
+// Counts transfers that fill a buffer. After AUTO_GROW_AFTER in a row, maybe_grow() doubles the buffer,
+// which must be empty, up to AUTO_BUFSIZE_MAX.
+class BufferGrowth {
+    unsigned streak_ = 0;
+public:
+    void observe(std::int64_t transferred, size_t capacity) {
+        streak_ = transferred > 0 && size_t(transferred) >= capacity ? streak_ + 1: 0;
+    }
+    template<typename Buffer>
+    void maybe_grow(Buffer &buf) {
+        if(streak_ < AUTO_GROW_AFTER || buf.size() >= AUTO_BUFSIZE_MAX) return;
+        streak_ = 0;
+        const size_t n = std::min(buf.size() * 2, AUTO_BUFSIZE_MAX);
+        buf.clear();
+        buf.resize(n);
+    }
+};
+
+inline unsigned resolve_threads(int requested) {
+    if(requested > 0) return requested;
+    if(requested < 0) return 1;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+inline ssize_t read_fd(int fd, void *buf, size_t nb) {
+    ssize_t rc;
+    do rc = ::read(fd, buf, nb); while(rc < 0 && errno == EINTR);
+    return rc;
+}
+
+inline bool would_block(int err) {return err == EAGAIN || err == EWOULDBLOCK;}
+
+// Waits out EAGAIN on non-blocking descriptors: compressed output cannot be handed back partially written.
+inline bool write_fd(int fd, const void *buf, size_t nb) {
+    auto p = static_cast<const char *>(buf);
+    while(nb) {
+        const ssize_t rc = ::write(fd, p, nb);
+        if(rc < 0) {
+            if(errno == EINTR) continue;
+            if(would_block(errno)) {
+                pollfd pfd{fd, POLLOUT, 0};
+                if(::poll(&pfd, 1, -1) >= 0 || errno == EINTR) continue;
+            }
+            return false;
+        }
+        p += rc; nb -= rc;
+    }
+    return true;
+}
+
+// Buffers per writev call: Linux and the BSDs take up to 1024 (IOV_MAX).
+constexpr int MAX_IOV = 1024;
+
+// writev counterpart of write_fd: one system call per record unless the kernel takes it in pieces.
+inline bool writev_fd(int fd, const struct iovec *iov, int iovcnt) {
+    while(iovcnt > 0) {
+        const ssize_t rc = ::writev(fd, iov, std::min(iovcnt, MAX_IOV));
+        if(rc < 0) {
+            if(errno == EINTR) continue;
+            if(would_block(errno)) {
+                pollfd pfd{fd, POLLOUT, 0};
+                if(::poll(&pfd, 1, -1) >= 0 || errno == EINTR) continue;
+            }
+            return false;
+        }
+        size_t n = rc;
+        for(; iovcnt && n >= iov->iov_len; ++iov, --iovcnt) n -= iov->iov_len;
+        // A buffer split by a short write is finished on its own.
+        if(n) {
+            if(!write_fd(fd, static_cast<const char *>(iov->iov_base) + n, iov->iov_len - n)) return false;
+            ++iov, --iovcnt;
+        }
+    }
+    return true;
+}
+
+// Calls fn(base, len) on each buffer in turn until one transfers less than its length.
+// Returns the bytes transferred, or -1 if the first call failed.
+template<typename Func>
+inline std::int64_t each_iov(const struct iovec *iov, int iovcnt, Func fn) {
+    std::int64_t done = 0;
+    for(int i = 0; i < iovcnt; ++i) {
+        const std::int64_t rc = fn(iov[i].iov_base, iov[i].iov_len);
+        if(rc < 0) return done ? done: -1;
+        done += rc;
+        if(size_t(rc) < iov[i].iov_len) break;
+    }
+    return done;
+}
+
+// vprintf for backends that stage output: formats straight into [dst, dst + space) and calls commit(len) when the
+// result fits, otherwise formats into a temporary and passes it to write(data, len). Returns the length, -1 on error.
+template<typename Commit, typename Write>
+inline int vprintf_staged(char *dst, size_t space, const char *fmt, va_list ap, Commit commit, Write write) {
+    va_list ap2;
+    va_copy(ap2, ap);
+    int ret = std::vsnprintf(dst, space, fmt, ap);
+    if(ret >= 0 && size_t(ret) < space) {
+        commit(size_t(ret));
+    } else if(ret >= 0) {
+        std::string tmp(ret, '\0');
+        std::vsnprintf(&tmp[0], ret + 1, fmt, ap2);
+        if(write(tmp.data(), size_t(ret)) != ret) ret = -1;
+    }
+    va_end(ap2);
+    return ret;
+}
+
+// Forward seek for compressed writers, which emulate it by writing n zeros through write(data, len).
+template<typename Write>
+inline bool write_zeros(std::uint64_t n, Write write) {
+    static const char zeros[4096] = {0};
+    while(n) {
+        const size_t len = std::min<std::uint64_t>(sizeof(zeros), n);
+        if(write(zeros, len) != ssize_t(len)) return false;
+        n -= len;
+    }
+    return true;
+}
+
+// Error state for backends: error() reports the first error recorded, and errno messages are copied so it stays valid.
+class ErrorState {
+protected:
+    const char *err_ = nullptr;
+    std::string errbuf_;
+    void set_error(const char *msg) {
+        if(!err_) err_ = msg ? msg: "unknown error";
+    }
+    void set_errno_error(int err=errno) {
+        if(err_) return;
+        errbuf_ = std::strerror(err);
+        err_ = errbuf_.data();
+    }
+public:
+    const char *error() const {return err_;}
+};
+
+// Backend factories: runs init on a new Backend and releases it to the caller only if init succeeded.
+template<typename Backend, typename Init>
+inline Backend *make_backend(Init init) {
+    auto ret = std::make_unique<Backend>();
+    return init(*ret) ? ret.release(): nullptr;
+}
+// Hands a freshly opened fd to open_fd, closing it again if that fails.
+template<typename OpenFd>
+inline bool adopt_fd(int fd, OpenFd open_fd) {
+    if(fd < 0) return false;
+    if(open_fd(fd)) return true;
+    ::close(fd);
+    return false;
+}
+
+// std::to_chars for doubles, or snprintf where the standard library lacks it (libstdc++ before 11).
+inline std::to_chars_result double_chars(char *first, char *last, double v) {
+#if __cpp_lib_to_chars >= 201611L
+    return std::to_chars(first, last, v);
+#else
+    const int n = std::snprintf(first, last - first, "%.17g", v);
+    if(n < 0 || n >= last - first) return {last, std::errc::value_too_large};
+    return {first + n, std::errc()};
+#endif
+}
+inline std::to_chars_result double_chars(char *first, char *last, double v, std::chars_format fmt, int precision) {
+#if __cpp_lib_to_chars >= 201611L
+    return std::to_chars(first, last, v, fmt, precision);
+#else
+    const char *spec = fmt == std::chars_format::scientific ? "%.*e": fmt == std::chars_format::general ? "%.*g": "%.*f";
+    const int n = std::snprintf(first, last - first, spec, precision, v);
+    if(n < 0 || n >= last - first) return {last, std::errc::value_too_large};
+    return {first + n, std::errc()};
+#endif
+}
+
+// Reads until nb bytes are read or end of file. Returns the number of bytes read, -1 on error.
+inline ssize_t read_full(int fd, void *buf, size_t nb) {
+    auto p = static_cast<char *>(buf);
+    size_t n = 0;
+    while(n < nb) {
+        const ssize_t rc = read_fd(fd, p + n, nb - n);
+        if(rc < 0) return -1;
+        if(rc == 0) break;
+        n += rc;
+    }
+    return n;
+}
+
+inline std::uint16_t load_le16(const void *p) {
+    auto b = static_cast<const unsigned char *>(p);
+    return b[0] | (b[1] << 8);
+}
+
+inline std::uint32_t load_le32(const void *p) {
+    auto b = static_cast<const unsigned char *>(p);
+    return std::uint32_t(b[0]) | (std::uint32_t(b[1]) << 8) | (std::uint32_t(b[2]) << 16) | (std::uint32_t(b[3]) << 24);
+}
+
+inline void store_le16(void *p, std::uint16_t v) {
+    auto b = static_cast<unsigned char *>(p);
+    b[0] = v; b[1] = v >> 8;
+}
+
+inline void store_le32(void *p, std::uint32_t v) {
+    auto b = static_cast<unsigned char *>(p);
+    b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
+}
+
+inline bool needs_swap(ByteOrder order) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return order == ByteOrder::little;
+#else
+    return order == ByteOrder::big;
+#endif
+}
+
+template<typename U, typename Swap>
+inline void bswap_words(void *data, size_t n, Swap swap) {
+    auto p = static_cast<char *>(data);
+    size_t i = 0;
+#if __SSSE3__
+    // Reverses each U-sized group within 16-byte blocks.
+    alignas(16) char order[16];
+    for(size_t j = 0; j < 16; ++j) order[j] = (j / sizeof(U) + 1) * sizeof(U) - 1 - j % sizeof(U);
+    const __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i *>(order));
+    for(constexpr size_t per = 16 / sizeof(U); i + per <= n; i += per) {
+        auto q = reinterpret_cast<__m128i *>(p + i * sizeof(U));
+        _mm_storeu_si128(q, _mm_shuffle_epi8(_mm_loadu_si128(q), mask));
+    }
+#endif
+    for(; i < n; ++i) {
+        U v;
+        std::memcpy(&v, p + i * sizeof(U), sizeof(U));
+        v = swap(v);
+        std::memcpy(p + i * sizeof(U), &v, sizeof(U));
+    }
+}
+
+template<typename T>
+struct is_byte_swappable: std::integral_constant<bool,
+    (std::is_arithmetic<T>::value || std::is_enum<T>::value)
+    && (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8)> {};
+
+// Returns whether elements of type T stored in order need their bytes reversed, throwing if they cannot be.
+template<typename T>
+inline bool element_swap(ByteOrder order) {
+    const bool swap = sizeof(T) > 1 && needs_swap(order);
+    if(swap && !is_byte_swappable<T>::value)
+        throw std::invalid_argument("Byte order conversion requires 1-, 2-, 4- or 8-byte arithmetic or enum elements");
+    return swap;
+}
+
+// Reverses the bytes of each of the n elements of type T at data.
+template<typename T>
+inline void bswap_array(void *data, size_t n) {
+    CONST_IF(!is_byte_swappable<T>::value)
+        throw std::invalid_argument("Byte order conversion requires 1-, 2-, 4- or 8-byte arithmetic or enum elements");
+    else CONST_IF(sizeof(T) == 2)
+        bswap_words<std::uint16_t>(data, n, [](std::uint16_t v) {return __builtin_bswap16(v);});
+    else CONST_IF(sizeof(T) == 4)
+        bswap_words<std::uint32_t>(data, n, [](std::uint32_t v) {return __builtin_bswap32(v);});
+    else CONST_IF(sizeof(T) == 8)
+        bswap_words<std::uint64_t>(data, n, [](std::uint64_t v) {return __builtin_bswap64(v);});
+}
+
+// Returns the total size of the BGZF block beginning with header (BSIZE + 1), or 0 if it is not a BGZF header.
+// extra must point to the xlen bytes of extra field following the 12-byte fixed header.
+inline size_t bgzf_block_size(const unsigned char *header, const unsigned char *extra) {
+    if(header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || !(header[3] & 4)) return 0;
+    const size_t xlen = load_le16(header + 10);
+    for(size_t i = 0; i + 4 <= xlen;) {
+        const size_t slen = load_le16(extra + i + 2);
+        if(extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen)
+            return load_le16(extra + i + 4) + size_t(1);
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+class ThreadPool {
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mut_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+
+    void run() {
+        for(;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mut_);
+                cv_.wait(lock, [this] {return stop_ || !tasks_.empty();});
+                if(tasks_.empty()) return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+public:
+    explicit ThreadPool(unsigned n) {
+        threads_.reserve(n);
+        while(n--) threads_.emplace_back([this] {run();});
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    template<typename Func>
+    auto submit(Func &&func) -> std::future<decltype(func())> {
+        auto task = std::make_shared<std::packaged_task<decltype(func())()>>(std::forward<Func>(func));
+        auto ret = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mut_);
+            tasks_.emplace_back([task] {(*task)();});
+        }
+        cv_.notify_one();
+        return ret;
+    }
+    size_t size() const {return threads_.size();}
+    // Finishes queued tasks before joining.
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mut_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for(auto &t: threads_) t.join();
+    }
+};
+
+// Bounded single-producer/single-consumer queue of reusable slots.
+// Slot hand-off is lock-free; a side only takes the mutex to sleep when the queue is full or empty.
+template<typename T>
+class SpscRing {
+    std::vector<T> slots_;
+    alignas(64) std::atomic<size_t> head_{0}; // Next slot to consume
+    alignas(64) std::atomic<size_t> tail_{0}; // Next slot to produce
+    std::atomic<bool> closed_{false}, waiting_{false};
+    std::mutex mut_;
+    std::condition_variable cv_;
+
+    template<typename Pred>
+    bool wait_for(Pred ready) {
+        for(int i = 0; i < 64; ++i) {
+            if(ready()) return true;
+            if(closed_.load(std::memory_order_acquire)) return ready();
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mut_);
+        waiting_.store(true);
+        cv_.wait(lock, [&] {return ready() || closed_.load();});
+        waiting_.store(false);
+        return ready();
+    }
+    void wake() {
+        if(waiting_.load()) {
+            std::lock_guard<std::mutex> lock(mut_);
+            cv_.notify_all();
+        }
+    }
+public:
+    explicit SpscRing(size_t n): slots_(n) {}
+    size_t capacity() const {return slots_.size();}
+    // Producer side: returns the slot to fill, or nullptr once closed.
+    T *acquire_empty() {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if(!wait_for([&] {return tail - head_.load(std::memory_order_acquire) < slots_.size();})) return nullptr;
+        return &slots_[tail % slots_.size()];
+    }
+    void publish() {
+        tail_.fetch_add(1, std::memory_order_seq_cst);
+        wake();
+    }
+    // Consumer side: returns the oldest filled slot, or nullptr if the queue is empty and closed.
+    T *acquire_full() {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if(!wait_for([&] {return tail_.load(std::memory_order_acquire) != head;})) return nullptr;
+        return &slots_[head % slots_.size()];
+    }
+    void release() {
+        head_.fetch_add(1, std::memory_order_seq_cst);
+        wake();
+    }
+    // Wakes both sides; acquire_empty fails from then on, acquire_full once drained.
+    void close() {
+        closed_.store(true);
+        std::lock_guard<std::mutex> lock(mut_);
+        cv_.notify_all();
+    }
+    // Producer side: waits until the consumer has released every published slot.
+    bool wait_drained() {
+        return wait_for([&] {return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed);});
+    }
+    // Only valid while neither side is active.
+    void reset() {
+        head_.store(0);
+        tail_.store(0);
+        closed_.store(false);
+    }
+    std::vector<T> &slots() {return slots_;}
+};
+
+} // namespace detail
+
+enum class Format: int {
+    plain,
+    gzip,
+    bgzf,
+    zstd,
+    xz,
+    bzip2
+};
+
+inline const char *format_name(Format f) {
+    switch(f) {
+        case Format::gzip:  return "gzip";
+        case Format::bgzf:  return "bgzf";
+        case Format::zstd:  return "zstd";
+        case Format::xz:    return "xz";
+        case Format::bzip2: return "bzip2";
+        default:            return "plain";
+    }
+}
+
+// Identifies a format from the first bytes of a stream.
+// At least 6 bytes are needed to recognize xz and 18 to distinguish BGZF from gzip.
+inline Format detect_format(const void *buf, size_t n) {
+    auto p = static_cast<const unsigned char *>(buf);
+    if(n >= 12 && (p[3] & 4) && n >= 12u + detail::load_le16(p + 10) && detail::bgzf_block_size(p, p + 12))
+        return Format::bgzf;
+    if(n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return Format::gzip;
+    if(n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return Format::zstd;
+    if(n >= 6 && std::memcmp(p, "\xfd" "7zXZ\0", 6) == 0) return Format::xz;
+    if(n >= 3 && std::memcmp(p, "BZh", 3) == 0) return Format::bzip2;
+    return Format::plain;
+}
+
+// Peeks at the start of the file at path. Unreadable or empty files are reported as plain.
+inline Format detect_format(const char *path) {
+    unsigned char buf[18]; // Size of a BGZF header
+    const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return Format::plain;
+    const ssize_t n = detail::read_full(fd, buf, sizeof(buf));
+    ::close(fd);
+    return detect_format(buf, n > 0 ? n: 0);
+}
+
+// Chooses the output format from a path's extension.
+inline Format format_from_extension(const char *path) {
+    const size_t len = std::strlen(path);
+    auto ends_with = [&](const char *ext) {
+        const size_t elen = std::strlen(ext);
+        return len >= elen && std::strcmp(path + len - elen, ext) == 0;
+    };
+    if(ends_with(".bgz")) return Format::bgzf;
+    if(ends_with(".gz")) return Format::gzip;
+    if(ends_with(".zst") || ends_with(".zstd")) return Format::zstd;
+    if(ends_with(".xz")) return Format::xz;
+    if(ends_with(".bz2")) return Format::bzip2;
+    return Format::plain;
+}
+
+namespace detail {
+
+// Rough expansion factors for text-like data, used by FszMode::estimate.
+inline double typical_ratio(Format f) {
+    switch(f) {
+        case Format::gzip: case Format::bgzf: return 4.;
+        case Format::zstd:                    return 4.5;
+        case Format::xz:                      return 6.;
+        case Format::bzip2:                   return 5.;
+        default:                              return 1.;
+    }
+}
+
+inline std::uint64_t estimate_fsz(const char *path) {
+    struct stat st;
+    if(::stat(path, &st)) return -1;
+    return st.st_size * typical_ratio(detect_format(path));
+}
+
+} // namespace detail
+
+/*
+ * Codecs are thin adapters over a native streaming engine.
+ * They consume from/produce into CodecBuffers and report stream_end when a stream
+ * (decoding) or a flush/finish request (encoding) is complete.
+ * CodecFile<Codec> adds file descriptor I/O, buffering and a gzFile-like interface.
+ */
+
+enum class CodecStatus: int {
+    error = -1,
+    ok = 0,
+    stream_end = 1
+};
+
+enum class CodecFlush: int {
+    none,
+    flush,
+    finish
+};
+
+struct CodecBuffers {
+    const char *in;
+    size_t in_left;
+    char *out;
+    size_t out_left;
+};
+
+/*
+ * A compression dictionary that any number of wrappers share through Options::dictionary, for data made of many
+ * small, similar files or records. zstd digests it once into a ZSTD_DDict and one ZSTD_CDict per compression level
+ * used; zlib takes the raw bytes (at most the last 32 KiB matter) as a preset dictionary. Files written with one can
+ * only be read with the same dictionary.
+ */
+class Dictionary {
+    std::string data_;
+#if FP_USE_ZSTD
+    mutable std::mutex mtx_;
+    mutable std::vector<std::pair<int, ZSTD_CDict *>> cdicts_;
+    mutable ZSTD_DDict *ddict_ = nullptr;
+#endif
+public:
+    // zstd's default dictionary size.
+    static constexpr size_t DEFAULT_CAPACITY = 112640;
+
+    explicit Dictionary(std::string data): data_(std::move(data)) {}
+    Dictionary(const Dictionary &) = delete;
+    Dictionary &operator=(const Dictionary &) = delete;
+    static std::shared_ptr<const Dictionary> load(const char *path) {
+        std::string data;
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if(fd < 0 || ::fstat(fd, &st)) {
+            if(fd >= 0) ::close(fd);
+            throw std::runtime_error(std::string("Could not open dictionary at ") + path);
+        }
+        data.resize(st.st_size);
+        const ssize_t n = detail::read_full(fd, &data[0], data.size());
+        ::close(fd);
+        if(n != ssize_t(data.size())) throw std::runtime_error(std::string("Could not read dictionary at ") + path);
+        return std::make_shared<const Dictionary>(std::move(data));
+    }
+    bool save(const char *path) const {
+        const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) return false;
+        const bool ok = detail::write_fd(fd, data_.data(), data_.size());
+        return ::close(fd) == 0 && ok;
+    }
+#if FP_USE_ZSTD
+    // Trains a dictionary of at most capacity bytes with ZDICT from samples, a container of strings or string_views,
+    // each a typical file or record. zlib can use the result too.
+    template<typename Samples>
+    static std::shared_ptr<const Dictionary> train(const Samples &samples, size_t capacity=DEFAULT_CAPACITY) {
+        std::string joined;
+        std::vector<size_t> sizes;
+        for(const auto &s: samples) {
+            const std::string_view v(s);
+            joined.append(v.data(), v.size());
+            sizes.push_back(v.size());
+        }
+        std::string data(capacity, '\0');
+        const size_t n = ZDICT_trainFromBuffer(&data[0], capacity, joined.data(), sizes.data(), sizes.size());
+        if(ZDICT_isError(n)) throw std::runtime_error(std::string("Dictionary training failed: ") + ZDICT_getErrorName(n));
+        data.resize(n);
+        return std::make_shared<const Dictionary>(std::move(data));
+    }
+    // Digested on first use and kept for the dictionary's lifetime. nullptr if zstd rejects the dictionary.
+    const ZSTD_CDict *cdict(int level) const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for(const auto &c: cdicts_) if(c.first == level) return c.second;
+        ZSTD_CDict *ret = ZSTD_createCDict(data_.data(), data_.size(), level);
+        if(ret) cdicts_.emplace_back(level, ret);
+        return ret;
+    }
+    const ZSTD_DDict *ddict() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if(!ddict_) ddict_ = ZSTD_createDDict(data_.data(), data_.size());
+        return ddict_;
+    }
+#endif
+    std::string_view data() const {return data_;}
+    size_t size() const {return data_.size();}
+    ~Dictionary() {
+#if FP_USE_ZSTD
+        for(const auto &c: cdicts_) ZSTD_freeCDict(c.second);
+        ZSTD_freeDDict(ddict_);
+#endif
+    }
+};
+
+#if FP_USE_ZSTD
+class ZstdCodec {
+    ZSTD_DStream *dctx_ = nullptr;
+    ZSTD_CStream *cctx_ = nullptr;
+    // Keeps the digested dictionary the contexts refer to alive.
+    std::shared_ptr<const Dictionary> dict_;
+    const char *err_ = nullptr;
+public:
+    static constexpr const char *name() {return "zstd";}
+    // Only compression uses worker threads.
+    static constexpr bool PARALLEL_WRITE = true;
+    ZstdCodec() = default;
+    ZstdCodec(const ZstdCodec &) = delete;
+    ZstdCodec &operator=(const ZstdCodec &) = delete;
+    bool init_decoder(const Options &opts) {
+        if(!dctx_ && (dctx_ = ZSTD_createDStream()) == nullptr) return false;
+        // Parameters are reset too: contexts are reused across files through ContextPool.
+        if(ZSTD_isError(ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_and_parameters))) return false;
+        dict_ = opts.dictionary;
+        if(dict_) {
+            const ZSTD_DDict *d = dict_->ddict();
+            if(!d || ZSTD_isError(ZSTD_DCtx_refDDict(dctx_, d))) return false;
+        }
+        return !opts.window_log || !ZSTD_isError(ZSTD_DCtx_setParameter(dctx_, ZSTD_d_windowLogMax, opts.window_log));
+    }
+    bool init_encoder(const Options &opts) {
+        if(!cctx_ && (cctx_ = ZSTD_createCStream()) == nullptr) return false;
+        ZSTD_CCtx_reset(cctx_, ZSTD_reset_session_and_parameters);
+        const int level = opts.level < 0 ? ZSTD_CLEVEL_DEFAULT: opts.level;
+        if(ZSTD_isError(ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, level))) return false;
+        dict_ = opts.dictionary;
+        if(dict_) {
+            // The CDict was digested at this level; its parameters take precedence over the context's.
+            const ZSTD_CDict *d = dict_->cdict(level);
+            if(!d || ZSTD_isError(ZSTD_CCtx_refCDict(cctx_, d))) return false;
+        }
+        if(opts.threads >= 0) {
+            // nbWorkers = 0 compresses on the calling thread. Fails harmlessly if libzstd lacks threading.
+            const unsigned n = detail::resolve_threads(opts.threads);
+            ZSTD_CCtx_setParameter(cctx_, ZSTD_c_nbWorkers, n > 1 ? n: 0);
+        }
+        if(opts.long_distance && ZSTD_isError(ZSTD_CCtx_setParameter(cctx_, ZSTD_c_enableLongDistanceMatching, 1)))
+            return false;
+        return !opts.window_log || !ZSTD_isError(ZSTD_CCtx_setParameter(cctx_, ZSTD_c_windowLog, opts.window_log));
+    }
+    // Records the size of the next frame in its header. Only valid before the frame's first encode().
+    bool pledge_size(std::uint64_t n) {return !ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(cctx_, n));}
+    // Concatenated frames are decoded transparently.
+    bool next_stream() {return true;}
+    CodecStatus decode(CodecBuffers &b, bool) {
+        ZSTD_inBuffer in{b.in, b.in_left, 0};
+        ZSTD_outBuffer out{b.out, b.out_left, 0};
+        const size_t rc = ZSTD_decompressStream(dctx_, &out, &in);
+        b.in += in.pos; b.in_left -= in.pos;
+        b.out += out.pos; b.out_left -= out.pos;
+        if(ZSTD_isError(rc)) {
+            err_ = ZSTD_getErrorName(rc);
+            return CodecStatus::error;
+        }
+        return rc ? CodecStatus::ok: CodecStatus::stream_end;
+    }
+    CodecStatus encode(CodecBuffers &b, CodecFlush f) {
+        ZSTD_inBuffer in{b.in, b.in_left, 0};
+        ZSTD_outBuffer out{b.out, b.out_left, 0};
+        const size_t rc = ZSTD_compressStream2(cctx_, &out, &in,
+            f == CodecFlush::none ? ZSTD_e_continue: f == CodecFlush::flush ? ZSTD_e_flush: ZSTD_e_end);
+        b.in += in.pos; b.in_left -= in.pos;
+        b.out += out.pos; b.out_left -= out.pos;
+        if(ZSTD_isError(rc)) {
+            err_ = ZSTD_getErrorName(rc);
+            return CodecStatus::error;
+        }
+        return f != CodecFlush::none && rc == 0 ? CodecStatus::stream_end: CodecStatus::ok;
+    }
+    const char *error() const {return err_;}
+    ~ZstdCodec() {
+        ZSTD_freeDStream(dctx_);
+        ZSTD_freeCStream(cctx_);
+    }
+};
+#endif /* FP_USE_ZSTD */
+
+#if FP_USE_XZ
+class XzCodec {
+    lzma_stream strm_ = LZMA_STREAM_INIT;
+    const char *err_ = nullptr;
+    static const char *errstr(lzma_ret rc) {
+        switch(rc) {
+            case LZMA_MEM_ERROR:     return "xz: out of memory";
+            case LZMA_FORMAT_ERROR:  return "xz: input not in .xz format";
+            case LZMA_OPTIONS_ERROR: return "xz: unsupported options";
+            case LZMA_DATA_ERROR:    return "xz: corrupt input";
+            case LZMA_BUF_ERROR:     return "xz: truncated input";
+            default:                 return "xz: internal error";
+        }
+    }
+    void stage(CodecBuffers &b) {
+        strm_.next_in = reinterpret_cast<const std::uint8_t *>(b.in);
+        strm_.avail_in = b.in_left;
+        strm_.next_out = reinterpret_cast<std::uint8_t *>(b.out);
+        strm_.avail_out = b.out_left;
+    }
+    void unstage(CodecBuffers &b) {
+        b.in = reinterpret_cast<const char *>(strm_.next_in);
+        b.in_left = strm_.avail_in;
+        b.out = reinterpret_cast<char *>(strm_.next_out);
+        b.out_left = strm_.avail_out;
+    }
+    // Reinitialized in place, liblzma's multithreaded encoder keeps buffers sized for its earlier preset, and a
+    // pooled stream may have been set up with any settings, so start from a fresh one.
+    void end() {
+        lzma_end(&strm_);
+        strm_ = LZMA_STREAM_INIT;
+    }
+public:
+    static constexpr const char *name() {return "xz";}
+    // Only compression uses worker threads.
+    static constexpr bool PARALLEL_WRITE = true;
+    XzCodec() = default;
+    XzCodec(const XzCodec &) = delete;
+    XzCodec &operator=(const XzCodec &) = delete;
+    bool init_decoder(const Options &) {
+        end();
+        return lzma_stream_decoder(&strm_, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+    }
+    bool init_encoder(const Options &opts) {
+        end();
+        const std::uint32_t preset = opts.level < 0 ? LZMA_PRESET_DEFAULT: std::min(opts.level, 9);
+        if(const unsigned n = detail::resolve_threads(opts.threads); n > 1) {
+            lzma_mt mt;
+            std::memset(&mt, 0, sizeof(mt));
+            mt.threads = n;
+            mt.preset = preset;
+            mt.check = LZMA_CHECK_CRC64;
+            return lzma_stream_encoder_mt(&strm_, &mt) == LZMA_OK;
+        }
+        return lzma_easy_encoder(&strm_, preset, LZMA_CHECK_CRC64) == LZMA_OK;
+    }
+    // LZMA_CONCATENATED handles multi-stream input.
+    bool next_stream() {return true;}
+    CodecStatus decode(CodecBuffers &b, bool input_done) {
+        stage(b);
+        const lzma_ret rc = lzma_code(&strm_, input_done ? LZMA_FINISH: LZMA_RUN);
+        unstage(b);
+        switch(rc) {
+            case LZMA_OK: case LZMA_BUF_ERROR: return CodecStatus::ok; // No progress is detected by the caller
+            case LZMA_STREAM_END: return CodecStatus::stream_end;
+            default: err_ = errstr(rc); return CodecStatus::error;
+        }
+    }
+    CodecStatus encode(CodecBuffers &b, CodecFlush f) {
+        stage(b);
+        const lzma_ret rc = lzma_code(&strm_, f == CodecFlush::none ? LZMA_RUN: f == CodecFlush::flush ? LZMA_FULL_FLUSH: LZMA_FINISH);
+        unstage(b);
+        switch(rc) {
+            case LZMA_OK: case LZMA_BUF_ERROR: return CodecStatus::ok;
+            case LZMA_STREAM_END: return CodecStatus::stream_end;
+            default: err_ = errstr(rc); return CodecStatus::error;
+        }
+    }
+    const char *error() const {return err_;}
+    ~XzCodec() {lzma_end(&strm_);}
+};
+#endif /* FP_USE_XZ */
+
+#if FP_USE_BZ2
+class Bz2Codec {
+    bz_stream strm_;
+    enum: int {NONE, DECODER, ENCODER} state_ = NONE;
+    const char *err_ = nullptr;
+    void end() {
+        if(state_ == DECODER) BZ2_bzDecompressEnd(&strm_);
+        else if(state_ == ENCODER) BZ2_bzCompressEnd(&strm_);
+        state_ = NONE;
+    }
+    void stage(CodecBuffers &b) {
+        strm_.next_in = const_cast<char *>(b.in);
+        strm_.avail_in = std::min<size_t>(b.in_left, UINT_MAX);
+        strm_.next_out = b.out;
+        strm_.avail_out = std::min<size_t>(b.out_left, UINT_MAX);
+    }
+    void unstage(CodecBuffers &b) {
+        b.in_left -= strm_.next_in - b.in;
+        b.in = strm_.next_in;
+        b.out_left -= strm_.next_out - b.out;
+        b.out = strm_.next_out;
+    }
+public:
+    static constexpr const char *name() {return "bzip2";}
+    Bz2Codec() {std::memset(&strm_, 0, sizeof(strm_));}
+    Bz2Codec(const Bz2Codec &) = delete;
+    Bz2Codec &operator=(const Bz2Codec &) = delete;
+    bool init_decoder(const Options &) {
+        end();
+        std::memset(&strm_, 0, sizeof(strm_));
+        if(BZ2_bzDecompressInit(&strm_, 0, 0) != BZ_OK) return false;
+        state_ = DECODER;
+        return true;
+    }
+    bool init_encoder(const Options &opts) {
+        end();
+        std::memset(&strm_, 0, sizeof(strm_));
+        if(BZ2_bzCompressInit(&strm_, opts.level < 1 ? 9: std::min(opts.level, 9), 0, 0) != BZ_OK) return false;
+        state_ = ENCODER;
+        return true;
+    }
+    // Multi-stream files (e.g., from pbzip2) need a fresh decoder per stream.
+    bool next_stream() {return init_decoder(Options());}
+    CodecStatus decode(CodecBuffers &b, bool) {
+        stage(b);
+        const int rc = BZ2_bzDecompress(&strm_);
+        unstage(b);
+        if(rc == BZ_OK) return CodecStatus::ok;
+        if(rc == BZ_STREAM_END) return CodecStatus::stream_end;
+        err_ = rc == BZ_DATA_ERROR_MAGIC ? "bzip2: input not in bzip2 format": "bzip2: corrupt input";
+        return CodecStatus::error;
+    }
+    CodecStatus encode(CodecBuffers &b, CodecFlush f) {
+        // BZ_RUN reports BZ_PARAM_ERROR when there is nothing to consume.
+        if(f == CodecFlush::none && !b.in_left) return CodecStatus::ok;
+        stage(b);
+        const int rc = BZ2_bzCompress(&strm_, f == CodecFlush::none ? BZ_RUN: f == CodecFlush::flush ? BZ_FLUSH: BZ_FINISH);
+        unstage(b);
+        switch(rc) {
+            case BZ_RUN_OK: return f == CodecFlush::flush ? CodecStatus::stream_end: CodecStatus::ok;
+            case BZ_FLUSH_OK: case BZ_FINISH_OK: return CodecStatus::ok;
+            case BZ_STREAM_END: return CodecStatus::stream_end;
+            default: err_ = "bzip2: internal error"; return CodecStatus::error;
+        }
+    }
+    const char *error() const {return err_;}
+    ~Bz2Codec() {end();}
+};
+#endif /* FP_USE_BZ2 */
+
+// zlib's inflate/deflate with gzip framing. Unlike gzFile, the z_stream survives reopening.
+class GzipCodec {
+    z_stream strm_;
+    enum: int {NONE, DECODER, ENCODER} state_ = NONE;
+    int level_ = 0, wbits_ = 0;
+    std::shared_ptr<const Dictionary> dict_;
+    const char *err_ = nullptr;
+    bool look_ = false, have_first_ = false, trailing_ = false; // State of the header check after each member
+    unsigned char first_ = 0;
+    void end() {
+        if(state_ == DECODER) inflateEnd(&strm_);
+        else if(state_ == ENCODER) deflateEnd(&strm_);
+        state_ = NONE;
+    }
+    void stage(CodecBuffers &b) {
+        strm_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(b.in));
+        strm_.avail_in = std::min<size_t>(b.in_left, UINT_MAX);
+        strm_.next_out = reinterpret_cast<Bytef *>(b.out);
+        strm_.avail_out = std::min<size_t>(b.out_left, UINT_MAX);
+    }
+    void unstage(CodecBuffers &b) {
+        b.in_left -= reinterpret_cast<const char *>(strm_.next_in) - b.in;
+        b.in = reinterpret_cast<const char *>(strm_.next_in);
+        b.out_left -= reinterpret_cast<char *>(strm_.next_out) - b.out;
+        b.out = reinterpret_cast<char *>(strm_.next_out);
+    }
+    // zlib only uses the last window's worth of a dictionary.
+    template<typename Set>
+    bool set_dictionary(Set set) {
+        const std::string_view d = dict_->data();
+        const size_t n = std::min<size_t>(d.size(), 1u << 15);
+        return set(&strm_, reinterpret_cast<const Bytef *>(d.data() + d.size() - n), n) == Z_OK;
+    }
+    // Whether a member can begin with byte c, or with c followed by d; zlib streams are only written with a dictionary.
+    bool header_start(unsigned c) const {
+        return c == 0x1f || (dict_ && (c & 0x0f) == Z_DEFLATED && (c >> 4) <= 7);
+    }
+    bool header(unsigned c, unsigned d) const {
+        return (c == 0x1f && d == 0x8b) || (dict_ && header_start(c) && (c * 256 + d) % 31 == 0);
+    }
+    // After a member, checks the next bytes are another header; anything else is trailing garbage, as in gzread.
+    // Garbage is consumed and reported as the end of a stream until the input ends.
+    bool check_header(CodecBuffers &b, bool last) {
+        if(!trailing_ && look_) {
+            const auto p = reinterpret_cast<const unsigned char *>(b.in);
+            if(have_first_) trailing_ = b.in_left ? !header(first_, p[0]): last;
+            else if(b.in_left >= 2) trailing_ = !header(p[0], p[1]);
+            else if(b.in_left) trailing_ = last || !header_start(p[0]);
+            if(b.in_left && !trailing_) {
+                if(have_first_ || b.in_left >= 2) look_ = have_first_ = false;
+                else have_first_ = true, first_ = p[0];
+            }
+        }
+        if(!trailing_) return true;
+        b.in += b.in_left;
+        b.in_left = 0;
+        return false;
+    }
+public:
+    static constexpr const char *name() {return "gzip";}
+    GzipCodec() {std::memset(&strm_, 0, sizeof(strm_));}
+    GzipCodec(const GzipCodec &) = delete;
+    GzipCodec &operator=(const GzipCodec &) = delete;
+    // gzip has no way to name a preset dictionary, so with Options::dictionary streams are written in zlib format
+    // (RFC 1950), which records its checksum, and the decoder accepts either.
+    bool init_decoder(const Options &opts) {
+        dict_ = opts.dictionary;
+        const int wbits = 15 + (dict_ ? 32: 16);
+        look_ = have_first_ = trailing_ = false;
+        if(state_ == DECODER) return inflateReset2(&strm_, wbits) == Z_OK;
+        end();
+        std::memset(&strm_, 0, sizeof(strm_));
+        if(inflateInit2(&strm_, wbits) != Z_OK) return false;
+        state_ = DECODER;
+        return true;
+    }
+    bool init_encoder(const Options &opts) {
+        const int level = opts.level < 0 ? Z_DEFAULT_COMPRESSION: std::min(opts.level, 9);
+        dict_ = opts.dictionary;
+        const int wbits = dict_ ? 15: 15 + 16;
+        if(state_ != ENCODER || level != level_ || wbits != wbits_) {
+            end();
+            std::memset(&strm_, 0, sizeof(strm_));
+            if(deflateInit2(&strm_, level, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+            state_ = ENCODER;
+            level_ = level;
+            wbits_ = wbits;
+        } else if(deflateReset(&strm_) != Z_OK) return false;
+        return !dict_ || set_dictionary(deflateSetDictionary);
+    }
+    // Each gzip member ends the stream; resetting keeps the window allocated.
+    bool next_stream() {return inflateReset(&strm_) == Z_OK;}
+    CodecStatus decode(CodecBuffers &b, bool last) {
+        if(!check_header(b, last)) return CodecStatus::stream_end;
+        stage(b);
+        int rc = inflate(&strm_, Z_NO_FLUSH);
+        // Each zlib stream asks for the dictionary after its header.
+        if(rc == Z_NEED_DICT && dict_ && set_dictionary(inflateSetDictionary)) rc = inflate(&strm_, Z_NO_FLUSH);
+        unstage(b);
+        switch(rc) {
+            case Z_OK: case Z_BUF_ERROR: return CodecStatus::ok;
+            case Z_STREAM_END: look_ = true; return CodecStatus::stream_end;
+            case Z_MEM_ERROR: err_ = "gzip: out of memory"; return CodecStatus::error;
+            case Z_NEED_DICT: err_ = dict_ ? "gzip: wrong dictionary": "gzip: stream needs a dictionary"; return CodecStatus::error;
+            default: err_ = "gzip: corrupt input"; return CodecStatus::error;
+        }
+    }
+    CodecStatus encode(CodecBuffers &b, CodecFlush f) {
+        stage(b);
+        const int rc = deflate(&strm_, f == CodecFlush::none ? Z_NO_FLUSH: f == CodecFlush::flush ? Z_SYNC_FLUSH: Z_FINISH);
+        const bool room = strm_.avail_out;
+        unstage(b);
+        switch(rc) {
+            // A sync flush is complete once deflate leaves output space unused.
+            case Z_OK: case Z_BUF_ERROR: return f == CodecFlush::flush && room ? CodecStatus::stream_end: CodecStatus::ok;
+            case Z_STREAM_END: return CodecStatus::stream_end;
+            default: err_ = "gzip: internal error"; return CodecStatus::error;
+        }
+    }
+    const char *error() const {return err_;}
+    ~GzipCodec() {end();}
+};
+
+#if FP_USE_ISAL
+// ISA-L's igzip with gzip framing: SIMD inflate, and a fast deflate whose levels 0-3 stand in for zlib's.
+class IgzipCodec {
+    inflate_state istate_;
+    isal_zstream zs_;
+    std::unique_ptr<std::uint8_t[]> level_buf_;
+    enum: int {NONE, DECODER, ENCODER} state_ = NONE;
+    const char *err_ = nullptr;
+    static unsigned level_buf_size(int level) {
+        switch(level) {
+            case 1: return ISAL_DEF_LVL1_DEFAULT;
+            case 2: return ISAL_DEF_LVL2_DEFAULT;
+            case 3: return ISAL_DEF_LVL3_DEFAULT;
+            default: return 0;
+        }
+    }
+public:
+    static constexpr const char *name() {return "gzip";}
+    IgzipCodec() = default;
+    IgzipCodec(const IgzipCodec &) = delete;
+    IgzipCodec &operator=(const IgzipCodec &) = delete;
+    bool init_decoder(const Options &) {
+        isal_inflate_init(&istate_);
+        istate_.crc_flag = ISAL_GZIP;
+        state_ = DECODER;
+        return true;
+    }
+    bool init_encoder(const Options &opts) {
+        // zlib levels 1-9 map onto 1-3; -1 picks 1.
+        const int level = opts.level < 0 ? 1: std::min((opts.level + 2) / 3, 3);
+        const unsigned bufsize = level_buf_size(level);
+        isal_deflate_init(&zs_);
+        zs_.gzip_flag = IGZIP_GZIP;
+        zs_.level = level;
+        if(bufsize) {
+            level_buf_.reset(new std::uint8_t[bufsize]);
+            zs_.level_buf = level_buf_.get();
+            zs_.level_buf_size = bufsize;
+        }
+        state_ = ENCODER;
+        return true;
+    }
+    bool next_stream() {
+        isal_inflate_reset(&istate_);
+        istate_.crc_flag = ISAL_GZIP;
+        return true;
+    }
+    CodecStatus decode(CodecBuffers &b, bool) {
+        istate_.next_in = reinterpret_cast<std::uint8_t *>(const_cast<char *>(b.in));
+        istate_.avail_in = std::min<size_t>(b.in_left, UINT32_MAX);
+        istate_.next_out = reinterpret_cast<std::uint8_t *>(b.out);
+        istate_.avail_out = std::min<size_t>(b.out_left, UINT32_MAX);
+        const int rc = isal_inflate(&istate_);
+        b.in_left -= reinterpret_cast<const char *>(istate_.next_in) - b.in;
+        b.in = reinterpret_cast<const char *>(istate_.next_in);
+        b.out_left -= reinterpret_cast<char *>(istate_.next_out) - b.out;
+        b.out = reinterpret_cast<char *>(istate_.next_out);
+        if(rc < 0) {
+            err_ = rc == ISAL_INCORRECT_CHECKSUM ? "gzip: CRC mismatch": "gzip: corrupt input";
+            return CodecStatus::error;
+        }
+        return istate_.block_state == ISAL_BLOCK_FINISH ? CodecStatus::stream_end: CodecStatus::ok;
+    }
+    CodecStatus encode(CodecBuffers &b, CodecFlush f) {
+        zs_.next_in = reinterpret_cast<std::uint8_t *>(const_cast<char *>(b.in));
+        zs_.avail_in = std::min<size_t>(b.in_left, UINT32_MAX);
+        zs_.next_out = reinterpret_cast<std::uint8_t *>(b.out);
+        zs_.avail_out = std::min<size_t>(b.out_left, UINT32_MAX);
+        zs_.end_of_stream = f == CodecFlush::finish && zs_.avail_in == b.in_left;
+        zs_.flush = f == CodecFlush::flush ? SYNC_FLUSH: NO_FLUSH;
+        const int rc = isal_deflate(&zs_);
+        b.in_left -= reinterpret_cast<const char *>(zs_.next_in) - b.in;
+        b.in = reinterpret_cast<const char *>(zs_.next_in);
+        b.out_left -= reinterpret_cast<char *>(zs_.next_out) - b.out;
+        b.out = reinterpret_cast<char *>(zs_.next_out);
+        if(rc != COMP_OK) {
+            err_ = "gzip: internal error";
+            return CodecStatus::error;
+        }
+        if(f == CodecFlush::finish) return zs_.internal_state.state == ZSTATE_END ? CodecStatus::stream_end: CodecStatus::ok;
+        // As with deflate's sync flush, output space left over means the flush is complete.
+        return f == CodecFlush::flush && !b.in_left && zs_.avail_out ? CodecStatus::stream_end: CodecStatus::ok;
+    }
+    const char *error() const {return err_;}
+};
+#endif /* FP_USE_ISAL */
+
+/*
+ * Process-wide cache of idle codec contexts. CodecFile takes one when constructed and hands it back when
+ * destroyed, so opening many small files in turn reuses the same inflate/deflate, ZSTD_DCtx or lzma state
+ * instead of allocating a new one each time. At most capacity() idle contexts are kept (one per core by default);
+ * set_capacity(0) frees them and disables caching.
+ */
+template<typename Codec>
+class ContextPool {
+    mutable std::mutex mtx_;
+    std::vector<std::unique_ptr<Codec>> free_;
+    size_t capacity_;
+public:
+    explicit ContextPool(size_t capacity=std::max(1u, std::thread::hardware_concurrency())): capacity_(capacity) {}
+    ContextPool(const ContextPool &) = delete;
+    ContextPool &operator=(const ContextPool &) = delete;
+    static ContextPool &global() {
+        static ContextPool pool;
+        return pool;
+    }
+    std::unique_ptr<Codec> acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if(!free_.empty()) {
+                auto ret = std::move(free_.back());
+                free_.pop_back();
+                return ret;
+            }
+        }
+        return std::make_unique<Codec>();
+    }
+    void release(std::unique_ptr<Codec> codec) {
+        if(!codec) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        if(free_.size() < capacity_) free_.push_back(std::move(codec));
+    }
+    void set_capacity(size_t n) {
+        std::vector<std::unique_ptr<Codec>> evicted;
+        std::lock_guard<std::mutex> lock(mtx_);
+        capacity_ = n;
+        while(free_.size() > n) {
+            evicted.push_back(std::move(free_.back()));
+            free_.pop_back();
+        }
+    }
+    size_t capacity() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return capacity_;
+    }
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return free_.size();
+    }
+};
+
+template<typename Codec>
+class CodecFile: public detail::ErrorState {
+    std::unique_ptr<Codec> codec_;
+    // Reading: ibuf_ holds compressed input, obuf_ holds decompressed data for small reads and getc.
+    // Writing: ibuf_ stages uncompressed input, obuf_ collects compressed output.
+    // Buffers are recycled through the thread's BufferPool, so short-lived CodecFiles reuse them as well.
+    std::vector<char, DefaultInitAllocator<char, PoolAllocator<char>>> ibuf_, obuf_;
+    // Input in [in_ + ipos_, in_ + iend_): ibuf_, or the caller's buffer when reading from memory.
+    const char *in_ = nullptr;
+    size_t ipos_ = 0, iend_ = 0, opos_ = 0, oend_ = 0;
+    // In-memory source, or sink for compressed output, in place of fd_.
+    std::string_view src_;
+    std::string *sink_ = nullptr;
+    bool memory_ = false;
+    std::uint64_t pos_ = 0;
+    Options opts_;
+    int fd_ = -1;
+    IoStats stats_;
+    detail::BufferGrowth growth_;
+    // again_: the last read of a non-blocking descriptor found nothing available.
+    bool writing_ = false, ieof_ = false, eof_ = false, boundary_ = true, again_ = false;
+
+    ssize_t refill() {
+        ipos_ = iend_ = 0;
+        if(memory_) {
+            // The whole source counts as one read, decoded in place.
+            in_ = src_.data();
+            iend_ = src_.size();
+            ieof_ = true;
+            detail::count(stats_.raw_read, iend_);
+            return iend_;
+        }
+        if(opts_.auto_buffer) growth_.maybe_grow(ibuf_);
+        in_ = ibuf_.data();
+        ssize_t rc;
+        {
+            detail::StatTimer t(stats_.io_ns);
+            rc = detail::read_fd(fd_, ibuf_.data(), ibuf_.size());
+        }
+        detail::count(stats_.syscalls);
+        growth_.observe(rc, ibuf_.size());
+        if(rc < 0) {
+            // Non-blocking descriptors report EAGAIN when nothing has arrived; that is not an error.
+            if(!(again_ = detail::would_block(errno))) set_errno_error();
+        } else if(rc == 0) ieof_ = true;
+        else detail::count(stats_.raw_read, iend_ = rc);
+        return rc;
+    }
+    // Returns the number of bytes decoded into dst, 0 at end of input, -1 on error.
+    ssize_t decode_into(char *dst, size_t n) {
+        if(err_) return -1;
+        again_ = false;
+        CodecBuffers b{nullptr, 0, dst, n};
+        while(b.out_left && !eof_) {
+            if(ipos_ == iend_ && !ieof_ && refill() < 0) break;
+            if(ipos_ == iend_ && ieof_ && boundary_) {
+                eof_ = true;
+                break;
+            }
+            b.in = in_ + ipos_;
+            b.in_left = iend_ - ipos_;
+            const size_t in0 = b.in_left, out0 = b.out_left;
+            CodecStatus st;
+            {
+                detail::StatTimer t(stats_.codec_ns);
+                st = codec_->decode(b, ieof_);
+            }
+            ipos_ = iend_ - b.in_left;
+            if(st == CodecStatus::error) {
+                set_error(codec_->error());
+                break;
+            }
+            if(in0 != b.in_left) boundary_ = false;
+            if(st == CodecStatus::stream_end) {
+                // The codec is readied first: on a non-blocking descriptor the next stream may arrive later.
+                boundary_ = true;
+                if(!codec_->next_stream()) set_error(codec_->error());
+                else if(ipos_ == iend_ && (ieof_ || refill() <= 0)) {
+                    eof_ = !err_ && !again_;
+                    break;
+                }
+            } else if(in0 == b.in_left && out0 == b.out_left && ipos_ == iend_ && ieof_) {
+                set_error("truncated input");
+            }
+            if(err_) break;
+        }
+        const size_t produced = n - b.out_left;
+        if(produced || !(err_ || again_)) return produced;
+        if(again_) errno = EAGAIN;
+        return -1;
+    }
+    bool init(const char *mode, const Options &opts) {
+        ipos_ = iend_ = opos_ = oend_ = 0;
+        pos_ = 0;
+        err_ = nullptr;
+        ieof_ = eof_ = false;
+        boundary_ = true;
+        const auto m = detail::parse_mode(mode, opts);
+        writing_ = m.write;
+        opts_ = m;
+        stats_ = IoStats();
+        growth_ = detail::BufferGrowth();
+        return writing_ ? codec_->init_encoder(opts_): codec_->init_decoder(opts_);
+    }
+    bool fill_staging() {
+        opos_ = 0;
+        const ssize_t rc = decode_into(obuf_.data(), obuf_.size());
+        oend_ = rc > 0 ? rc: 0;
+        return rc > 0;
+    }
+    bool write_out() {
+        detail::count(stats_.raw_written, oend_);
+        growth_.observe(oend_, obuf_.size());
+        if(sink_) sink_->append(obuf_.data(), oend_);
+        else if(oend_) {
+            detail::StatTimer t(stats_.io_ns);
+            detail::count(stats_.syscalls);
+            if(!detail::write_fd(fd_, obuf_.data(), oend_)) {
+                set_errno_error();
+                return false;
+            }
+        }
+        oend_ = 0;
+        return true;
+    }
+    bool encode(const char *p, size_t n, CodecFlush f) {
+        CodecBuffers b{p, n, obuf_.data() + oend_, obuf_.size() - oend_};
+        for(;;) {
+            CodecStatus st;
+            {
+                detail::StatTimer t(stats_.codec_ns);
+                st = codec_->encode(b, f);
+            }
+            oend_ = obuf_.size() - b.out_left;
+            if(st == CodecStatus::error) {
+                set_error(codec_->error());
+                return false;
+            }
+            // Checked before draining obuf_: codecs must not be called again once a finish completes.
+            const bool done = b.in_left == 0 && (f == CodecFlush::none || st == CodecStatus::stream_end);
+            if(b.out_left == 0) {
+                if(!write_out()) return false;
+                if(opts_.auto_buffer) growth_.maybe_grow(obuf_);
+                b.out = obuf_.data();
+                b.out_left = obuf_.size();
+            }
+            if(done) return true;
+        }
+    }
+    bool encode_staged(CodecFlush f) {
+        const bool ret = encode(ibuf_.data(), iend_, f);
+        iend_ = 0;
+        return ret;
+    }
+    bool rewind() {
+        if((!memory_ && ::lseek(fd_, 0, SEEK_SET) != 0) || !codec_->init_decoder(opts_)) return false;
+        ipos_ = iend_ = opos_ = oend_ = 0;
+        pos_ = 0;
+        ieof_ = eof_ = false;
+        boundary_ = true;
+        return true;
+    }
+public:
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 17;
+
+    CodecFile(): codec_(ContextPool<Codec>::global().acquire()), ibuf_(DEFAULT_BUFSIZE), obuf_(DEFAULT_BUFSIZE) {}
+    CodecFile(const CodecFile &) = delete;
+    CodecFile &operator=(const CodecFile &) = delete;
+
+    // Mirrors gzopen: returns nullptr on failure, with errno set where applicable.
+    static CodecFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<CodecFile>([&](auto &f) {return f.open_path(path, mode, opts);});
+    }
+    static CodecFile *dopen(int fd, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<CodecFile>([&](auto &f) {return f.open_fd(fd, mode, opts);});
+    }
+    static CodecFile *open_memory(std::string_view src, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<CodecFile>([&](auto &f) {return f.open_source(src, mode, opts);});
+    }
+    static CodecFile *open_memory(std::string *sink, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<CodecFile>([&](auto &f) {return f.open_sink(sink, mode, opts);});
+    }
+    bool open_path(const char *path, const char *mode, const Options &opts=Options()) {
+        const auto m = detail::parse_mode(mode, opts);
+        const int flags = m.write ? O_WRONLY | O_CREAT | (m.append ? O_APPEND: O_TRUNC): O_RDONLY;
+        return detail::adopt_fd(::open(path, flags | O_CLOEXEC, 0666), [&](int fd) {return open_fd(fd, mode, opts);});
+    }
+    bool open_fd(int fd, const char *mode, const Options &opts=Options()) {
+        if(const int fl = ::fcntl(fd, F_GETFL); opts.nonblocking && (fl < 0 || ::fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0)) return false;
+        if(!init(mode, opts)) return false;
+        // Output buffers start at the default and grow as they fill.
+        if(opts.auto_buffer && !writing_) ibuf_.resize(detail::auto_buffer_size(fd, nullptr, false));
+        fd_ = fd;
+        return true;
+    }
+    // Decodes src, which must stay valid until close().
+    bool open_source(std::string_view src, const char *mode="rb", const Options &opts=Options()) {
+        if(detail::parse_mode(mode).write || !init(mode, opts)) return false;
+        src_ = src;
+        memory_ = true;
+        return true;
+    }
+    // Appends the compressed output to *sink.
+    bool open_sink(std::string *sink, const char *mode="wb", const Options &opts=Options()) {
+        if(!detail::parse_mode(mode).write || !init(mode, opts)) return false;
+        sink_ = sink;
+        memory_ = true;
+        return true;
+    }
+    bool is_open() const {return fd_ >= 0 || memory_;}
+    ssize_t read(void *dst, size_t nb) {
+        if(writing_) return -1;
+        auto out = static_cast<char *>(dst);
+        size_t n = 0;
+        while(n < nb) {
+            if(opos_ < oend_) {
+                const size_t take = std::min(nb - n, oend_ - opos_);
+                std::memcpy(out + n, obuf_.data() + opos_, take);
+                opos_ += take;
+                n += take;
+            } else if(nb - n >= obuf_.size() / 2) {
+                // Large requests decode straight into the caller's buffer.
+                const ssize_t rc = decode_into(out + n, nb - n);
+                if(rc <= 0) break;
+                n += rc;
+            } else if(!fill_staging()) break;
+        }
+        pos_ += n;
+        if(!n && again_) {
+            // Nothing has arrived yet on a non-blocking descriptor; eof() stays false.
+            errno = EAGAIN;
+            return -1;
+        }
+        return n || !err_ ? ssize_t(n): ssize_t(-1);
+    }
+    int getc() {
+        if(opos_ == oend_ && (writing_ || !fill_staging())) return -1;
+        ++pos_;
+        return static_cast<unsigned char>(obuf_[opos_++]);
+    }
+    // Decoded data held in the staging buffer, decoding more if it is empty; valid until the next call.
+    std::string_view peek() {
+        if(opos_ == oend_ && (writing_ || !fill_staging())) return std::string_view();
+        return std::string_view(obuf_.data() + opos_, oend_ - opos_);
+    }
+    void consume(size_t n) {
+        n = std::min(n, oend_ - opos_);
+        opos_ += n;
+        pos_ += n;
+    }
+    ssize_t write(const void *buf, size_t nb) {
+        if(!writing_ || err_) return -1;
+        if(nb > ibuf_.size() - iend_) {
+            if(!encode_staged(CodecFlush::none)) return -1;
+            if(nb >= ibuf_.size()) {
+                if(!encode(static_cast<const char *>(buf), nb, CodecFlush::none)) return -1;
+                pos_ += nb;
+                return nb;
+            }
+        }
+        std::memcpy(ibuf_.data() + iend_, buf, nb);
+        iend_ += nb;
+        pos_ += nb;
+        return nb;
+    }
+    // Gathers the buffers into the staging buffer, so the codec takes the record in one call.
+    ssize_t writev(const struct iovec *iov, int iovcnt) {
+        if(!writing_ || err_) return -1;
+        size_t total = 0;
+        for(int i = 0; i < iovcnt; ++i) total += iov[i].iov_len;
+        if(total > ibuf_.size() - iend_ && !encode_staged(CodecFlush::none)) return -1;
+        for(int i = 0; i < iovcnt; ++i) {
+            const char *p = static_cast<const char *>(iov[i].iov_base);
+            if(total > ibuf_.size()) {
+                if(!encode(p, iov[i].iov_len, CodecFlush::none)) return -1;
+            } else {
+                std::memcpy(ibuf_.data() + iend_, p, iov[i].iov_len);
+                iend_ += iov[i].iov_len;
+            }
+        }
+        pos_ += total;
+        return total;
+    }
+    // Room for n bytes at the end of the staging buffer, for formatting in place; commit() then keeps what was
+    // written. Returns nullptr if n cannot fit.
+    char *reserve(size_t n) {
+        if(!writing_ || err_ || n > ibuf_.size()) return nullptr;
+        if(n > ibuf_.size() - iend_ && !encode_staged(CodecFlush::none)) return nullptr;
+        return ibuf_.data() + iend_;
+    }
+    void commit(size_t n) {
+        iend_ += n;
+        pos_ += n;
+    }
+    int putc(int c) {
+        const char ch = c;
+        return write(&ch, 1) == 1 ? static_cast<unsigned char>(ch): -1;
+    }
+    int puts(const char *s) {
+        return write(s, std::strlen(s));
+    }
+    int vprintf(const char *fmt, va_list ap) {
+        if(!writing_) return -1;
+        // Format directly into the staging buffer when it fits.
+        return detail::vprintf_staged(ibuf_.data() + iend_, ibuf_.size() - iend_, fmt, ap,
+                                      [this](size_t n) {iend_ += n; pos_ += n;},
+                                      [this](const char *p, size_t n) {return write(p, n);});
+    }
+    // Emits all buffered data as a complete, decodable block.
+    int flush() {
+        if(!writing_) return 0;
+        return encode_staged(CodecFlush::flush) && write_out() ? 0: -1;
+    }
+    // Seeking on a compressed stream is emulated, as with gzseek:
+    // reading seeks forward by decompressing and backward by rewinding; writing only moves forward, padding with zeros.
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence != SEEK_SET) return -1;
+        if(off < 0) return -1;
+        if(writing_) {
+            if(std::uint64_t(off) < pos_
+               || !detail::write_zeros(off - pos_, [this](const char *p, size_t n) {return write(p, n);})) return -1;
+            return pos_;
+        }
+        if(std::uint64_t(off) < pos_ && !rewind()) return -1;
+        while(pos_ < std::uint64_t(off)) {
+            if(opos_ == oend_ && !fill_staging()) return err_ ? -1: std::int64_t(pos_);
+            const size_t take = std::min<std::uint64_t>(oend_ - opos_, off - pos_);
+            opos_ += take;
+            pos_ += take;
+        }
+        return pos_;
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return eof_ && opos_ == oend_;}
+    // As with gzbuffer, changes the size of the compressed-side buffer. Must be called before any I/O.
+    int buffer(size_t nb) {
+        if(nb == 0 || iend_ || pos_) return -1;
+        ibuf_.resize(nb);
+        return 0;
+    }
+    int close() {
+        if(!is_open()) return -1;
+        bool ok = true;
+        if(writing_) ok = encode_staged(CodecFlush::finish) && write_out();
+        if(fd_ >= 0) ok &= ::close(fd_) == 0;
+        fd_ = -1;
+        src_ = std::string_view();
+        sink_ = nullptr;
+        memory_ = false;
+        // Read errors were already reported by read().
+        return ok && !(writing_ && err_) ? 0: -1;
+    }
+    // Closes the current file, if any, and opens path keeping the codec context and buffers.
+    bool reopen(const char *path, const char *mode, const Options &opts=Options()) {
+        if(is_open()) close();
+        return open_path(path, mode, opts);
+    }
+    int fd() const {return fd_;}
+    const IoStats &stats() const {return stats_;}
+    ~CodecFile() {
+        if(is_open()) close();
+        ContextPool<Codec>::global().release(std::move(codec_));
+    }
+}; // CodecFile
+
+using GzipFile = CodecFile<GzipCodec>;
+#if FP_USE_ISAL
+using IgzipFile = CodecFile<IgzipCodec>;
+#endif
+
+// Whole-buffer gzip for payloads already in memory, through libdeflate with FP_USE_LIBDEFLATE and zlib otherwise.
+// Output is appended to out. Every member of multi-member input is decoded.
+inline bool gzip_compress(std::string_view src, std::string &out, int level=-1) {
+    const size_t start = out.size();
+#if FP_USE_LIBDEFLATE
+    std::unique_ptr<libdeflate_compressor, void (*)(libdeflate_compressor *)> c(
+        libdeflate_alloc_compressor(level < 0 ? 6: level), libdeflate_free_compressor);
+    if(!c) return false;
+    out.resize(start + libdeflate_gzip_compress_bound(c.get(), src.size()));
+    const size_t n = libdeflate_gzip_compress(c.get(), src.data(), src.size(), &out[start], out.size() - start);
+    out.resize(start + n);
+    return n != 0;
+#else
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+    if(deflateInit2(&strm, level < 0 ? Z_DEFAULT_COMPRESSION: std::min(level, 9), Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    out.resize(start + deflateBound(&strm, std::min<size_t>(src.size(), ULONG_MAX)));
+    strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.data()));
+    int rc;
+    size_t in_left = src.size();
+    do {
+        if(out.size() - start == strm.total_out) out.resize(out.size() * 2);
+        const uInt in = std::min<size_t>(in_left, UINT_MAX);
+        strm.avail_in = in;
+        strm.next_out = reinterpret_cast<Bytef *>(&out[start + strm.total_out]);
+        strm.avail_out = std::min<size_t>(out.size() - start - strm.total_out, UINT_MAX);
+        rc = deflate(&strm, in == in_left ? Z_FINISH: Z_NO_FLUSH);
+        in_left -= in - strm.avail_in;
+    } while(rc == Z_OK || rc == Z_BUF_ERROR);
+    out.resize(start + strm.total_out);
+    deflateEnd(&strm);
+    return rc == Z_STREAM_END;
+#endif
+}
+
+inline bool gzip_decompress(std::string_view src, std::string &out) {
+    if(src.empty()) return true;
+    size_t pos = out.size();
+#if FP_USE_LIBDEFLATE
+    thread_local std::unique_ptr<libdeflate_decompressor, void (*)(libdeflate_decompressor *)> d(
+        libdeflate_alloc_decompressor(), libdeflate_free_decompressor);
+    if(!d) return false;
+    // libdeflate needs room for a whole member up front; the last member's ISIZE trailer is a good first guess.
+    size_t cap = std::max<size_t>({src.size() >= 4 ? detail::load_le32(src.data() + src.size() - 4): 0, 4 * src.size(), 1 << 16});
+    while(!src.empty()) {
+        size_t in_used, out_used;
+        out.resize(pos + cap);
+        const auto rc = libdeflate_gzip_decompress_ex(d.get(), src.data(), src.size(), &out[pos], cap, &in_used, &out_used);
+        if(rc == LIBDEFLATE_INSUFFICIENT_SPACE) {
+            cap *= 2;
+            continue;
+        }
+        if(rc != LIBDEFLATE_SUCCESS) {
+            out.resize(pos);
+            return false;
+        }
+        pos += out_used;
+        src.remove_prefix(in_used);
+    }
+    out.resize(pos);
+    return true;
+#else
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+    if(inflateInit2(&strm, 15 + 16) != Z_OK) return false;
+    out.resize(pos + std::max<size_t>(4 * src.size(), 1 << 16));
+    bool ok = false;
+    for(;;) {
+        if(pos == out.size()) out.resize(out.size() * 2);
+        strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.data()));
+        strm.avail_in = std::min<size_t>(src.size(), UINT_MAX);
+        strm.next_out = reinterpret_cast<Bytef *>(&out[pos]);
+        strm.avail_out = std::min<size_t>(out.size() - pos, UINT_MAX);
+        const uInt in0 = strm.avail_in, out0 = strm.avail_out;
+        const int rc = inflate(&strm, Z_NO_FLUSH);
+        src.remove_prefix(in0 - strm.avail_in);
+        pos += out0 - strm.avail_out;
+        if(rc == Z_STREAM_END) {
+            if(src.empty()) {
+                ok = true;
+                break;
+            }
+            if(inflateReset(&strm) != Z_OK) break;
+        } else if(rc != Z_OK && rc != Z_BUF_ERROR) {
+            break;
+        } else if(strm.avail_out) {
+            // Output space left over, so inflate wants input: truncated unless some remains.
+            if(src.empty()) break;
+        }
+    }
+    inflateEnd(&strm);
+    out.resize(pos);
+    return ok;
+#endif
+}
+#if FP_USE_ZSTD
+using ZstdFile = CodecFile<ZstdCodec>;
+#endif
+#if FP_USE_XZ
+using XzFile = CodecFile<XzCodec>;
+#endif
+#if FP_USE_BZ2
+using Bz2File = CodecFile<Bz2Codec>;
+#endif
+
+#if FP_USE_ZSTD
+/*
+ * zstd seekable format, as in zstd's contrib/seekable_format: independent frames of Options::index_span
+ * decompressed bytes (1 MiB by default) followed by a skippable frame listing every frame's compressed and
+ * decompressed size. Any zstd decoder reads the output; this backend also seeks by jumping to the frame
+ * holding the target. Frame checksums are neither written nor verified.
+ */
+class SeekableZstdFile: public detail::ErrorState {
+public:
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 17;
+    static constexpr bool RANDOM_ACCESS = true;
+    static constexpr std::uint64_t DEFAULT_FRAME_SIZE = 1 << 20, MAX_FRAME_SIZE = 1u << 30;
+    static constexpr std::uint32_t SKIPPABLE_MAGIC = 0x184D2A5E, SEEKABLE_MAGIC = 0x8F92EAB1;
+    static constexpr size_t FOOTER_SIZE = 9;
+    struct Frame {
+        std::uint64_t coff, doff;   // Offsets in the compressed and decompressed streams
+        std::uint32_t csize, dsize;
+    };
+private:
+    ZstdCodec codec_;
+    std::vector<Frame> frames_;
+    // Reading: cur_ holds frame frame_, decompressed, and ibuf_ its compressed bytes.
+    // Writing: cur_ stages the next frame and ibuf_ collects its compressed output.
+    std::vector<char> cur_, ibuf_;
+    size_t cpos_ = 0, cend_ = 0;
+    std::ptrdiff_t frame_ = -1;
+    std::uint64_t pos_ = 0, coff_ = 0;
+    Options opts_;
+    int fd_ = -1;
+    bool writing_ = false, eof_ = false;
+    IoStats stats_;
+
+    bool write_raw(const void *buf, size_t nb) {
+        detail::StatTimer t(stats_.io_ns);
+        detail::count(stats_.syscalls);
+        detail::count(stats_.raw_written, nb);
+        return detail::write_fd(fd_, buf, nb);
+    }
+    std::uint64_t total() const {return frames_.empty() ? 0: frames_.back().doff + frames_.back().dsize;}
+    bool load_frame(size_t i) {
+        const Frame &f = frames_[i];
+        ibuf_.resize(f.csize);
+        cur_.resize(f.dsize);
+        ssize_t rc;
+        {
+            detail::StatTimer t(stats_.io_ns);
+            rc = ::pread(fd_, ibuf_.data(), f.csize, f.coff);
+        }
+        detail::count(stats_.syscalls);
+        if(rc != ssize_t(f.csize)) {
+            if(rc < 0) set_errno_error();
+            return set_error("zstd: truncated frame"), false;
+        }
+        detail::count(stats_.raw_read, rc);
+        if(!codec_.init_decoder(opts_)) return set_error("zstd: failed to initialize decoder"), false;
+        CodecBuffers b{ibuf_.data(), ibuf_.size(), cur_.data(), cur_.size()};
+        CodecStatus st;
+        {
+            detail::StatTimer t(stats_.codec_ns);
+            do st = codec_.decode(b, true);
+            while(st == CodecStatus::ok && b.in_left && b.out_left);
+        }
+        if(st == CodecStatus::error) return set_error(codec_.error()), false;
+        if(b.out_left || st != CodecStatus::stream_end) return set_error("zstd: frame does not match seek table"), false;
+        frame_ = i;
+        cpos_ = 0;
+        cend_ = f.dsize;
+        return true;
+    }
+    bool next_frame() {
+        for(size_t i = frame_ + 1; i < frames_.size(); ++i)
+            if(frames_[i].dsize) return load_frame(i);
+        frame_ = frames_.size();
+        cpos_ = cend_ = 0;
+        eof_ = true;
+        return false;
+    }
+    bool write_out(size_t n) {
+        if(!write_raw(ibuf_.data(), n)) return set_errno_error(), false;
+        coff_ += n;
+        return true;
+    }
+    bool emit_frame() {
+        if(!cend_) return !err_;
+        if(err_ || !codec_.pledge_size(cend_)) return set_error("zstd: failed to start frame"), false;
+        const std::uint64_t start = coff_;
+        CodecBuffers b{cur_.data(), cend_, nullptr, 0};
+        for(CodecStatus st = CodecStatus::ok; st != CodecStatus::stream_end;) {
+            b.out = ibuf_.data();
+            b.out_left = ibuf_.size();
+            {
+                detail::StatTimer t(stats_.codec_ns);
+                st = codec_.encode(b, CodecFlush::finish);
+            }
+            if(st == CodecStatus::error) return set_error(codec_.error()), false;
+            if(!write_out(ibuf_.size() - b.out_left)) return false;
+        }
+        frames_.push_back(Frame{start, pos_ - cend_, std::uint32_t(coff_ - start), std::uint32_t(cend_)});
+        cend_ = 0;
+        return true;
+    }
+    bool write_seek_table() {
+        std::vector<char> t(8 + frames_.size() * 8 + FOOTER_SIZE);
+        detail::store_le32(t.data(), SKIPPABLE_MAGIC);
+        detail::store_le32(t.data() + 4, t.size() - 8);
+        char *p = t.data() + 8;
+        for(const Frame &f: frames_) {
+            detail::store_le32(p, f.csize);
+            detail::store_le32(p + 4, f.dsize);
+            p += 8;
+        }
+        detail::store_le32(p, frames_.size());
+        p[4] = 0; // Seek_Table_Descriptor: no checksums
+        detail::store_le32(p + 5, SEEKABLE_MAGIC);
+        if(!write_raw(t.data(), t.size())) return set_errno_error(), false;
+        return true;
+    }
+public:
+    SeekableZstdFile() = default;
+    SeekableZstdFile(const SeekableZstdFile &) = delete;
+    SeekableZstdFile &operator=(const SeekableZstdFile &) = delete;
+
+    // Parses the seek table at the end of fd. Returns false if there is none or it does not describe the file.
+    static bool read_seek_table(int fd, std::vector<Frame> &frames) {
+        struct stat st;
+        unsigned char footer[FOOTER_SIZE];
+        if(::fstat(fd, &st) != 0 || std::uint64_t(st.st_size) < 8 + FOOTER_SIZE
+           || ::pread(fd, footer, FOOTER_SIZE, st.st_size - FOOTER_SIZE) != ssize_t(FOOTER_SIZE)
+           || detail::load_le32(footer + 5) != SEEKABLE_MAGIC || (footer[4] & 0x7c))
+            return false;
+        const std::uint64_t n = detail::load_le32(footer), esize = footer[4] & 0x80 ? 12: 8;
+        const std::uint64_t tsize = 8 + n * esize + FOOTER_SIZE;
+        if(tsize > std::uint64_t(st.st_size)) return false;
+        std::vector<unsigned char> t(tsize - FOOTER_SIZE);
+        if(::pread(fd, t.data(), t.size(), st.st_size - tsize) != ssize_t(t.size())
+           || detail::load_le32(t.data()) != SKIPPABLE_MAGIC || detail::load_le32(t.data() + 4) != tsize - 8)
+            return false;
+        frames.clear();
+        frames.reserve(n);
+        std::uint64_t coff = 0, doff = 0;
+        for(const unsigned char *p = t.data() + 8; frames.size() < n; p += esize) {
+            frames.push_back(Frame{coff, doff, detail::load_le32(p), detail::load_le32(p + 4)});
+            coff += frames.back().csize;
+            doff += frames.back().dsize;
+        }
+        return coff == st.st_size - tsize;
+    }
+    // Returns nullptr for input without a seek table.
+    static SeekableZstdFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<SeekableZstdFile>([&](auto &f) {return f.open_path(path, mode, opts);});
+    }
+    static SeekableZstdFile *dopen(int fd, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<SeekableZstdFile>([&](auto &f) {return f.open_fd(fd, mode, opts);});
+    }
+    bool open_path(const char *path, const char *mode, const Options &opts=Options()) {
+        const auto m = detail::parse_mode(mode, opts);
+        // Appending would need the old seek table removed first.
+        if(m.append) return false;
+        const int flags = m.write ? O_WRONLY | O_CREAT | O_TRUNC: O_RDONLY;
+        return detail::adopt_fd(::open(path, flags | O_CLOEXEC, 0666), [&](int fd) {return open_fd(fd, mode, opts);});
+    }
+    // Reading needs a seekable descriptor, since the seek table comes last.
+    bool open_fd(int fd, const char *mode, const Options &opts=Options()) {
+        const auto m = detail::parse_mode(mode, opts);
+        if(m.append) return false;
+        writing_ = m.write;
+        opts_ = m;
+        stats_ = IoStats();
+        if(writing_) {
+            const std::uint64_t fsize = std::min(opts.index_span ? opts.index_span: DEFAULT_FRAME_SIZE, MAX_FRAME_SIZE);
+            cur_.resize(fsize);
+            ibuf_.resize(ZSTD_CStreamOutSize());
+            if(!codec_.init_encoder(opts_)) return false;
+        } else if(!read_seek_table(fd, frames_)) return false;
+        fd_ = fd;
+        return true;
+    }
+    ssize_t read(void *dst, size_t nb) {
+        if(writing_) return -1;
+        auto out = static_cast<char *>(dst);
+        size_t n = 0;
+        while(n < nb && (cpos_ < cend_ || next_frame())) {
+            const size_t take = std::min(nb - n, cend_ - cpos_);
+            std::memcpy(out + n, cur_.data() + cpos_, take);
+            cpos_ += take;
+            n += take;
+        }
+        pos_ += n;
+        return n || !err_ ? ssize_t(n): ssize_t(-1);
+    }
+    int getc() {
+        if(writing_ || (cpos_ == cend_ && !next_frame())) return -1;
+        ++pos_;
+        return static_cast<unsigned char>(cur_[cpos_++]);
+    }
+    // The rest of the current frame, decompressing the next one if it is used up.
+    std::string_view peek() {
+        if(writing_ || (cpos_ == cend_ && !next_frame())) return std::string_view();
+        return std::string_view(cur_.data() + cpos_, cend_ - cpos_);
+    }
+    void consume(size_t n) {
+        n = std::min(n, cend_ - cpos_);
+        cpos_ += n;
+        pos_ += n;
+    }
+    ssize_t write(const void *buf, size_t nb) {
+        if(!writing_ || err_) return -1;
+        auto p = static_cast<const char *>(buf);
+        for(size_t left = nb; left;) {
+            const size_t take = std::min(left, cur_.size() - cend_);
+            std::memcpy(cur_.data() + cend_, p, take);
+            cend_ += take;
+            pos_ += take;
+            p += take;
+            left -= take;
+            if(cend_ == cur_.size() && !emit_frame()) return -1;
+        }
+        return nb;
+    }
+    int puts(const char *s) {
+        return write(s, std::strlen(s));
+    }
+    int vprintf(const char *fmt, va_list ap) {
+        if(!writing_) return -1;
+        return detail::vprintf_staged(cur_.data() + cend_, cur_.size() - cend_, fmt, ap,
+                                      [this](size_t n) {cend_ += n; pos_ += n;},
+                                      [this](const char *p, size_t n) {return write(p, n);});
+    }
+    // Ends the current frame early.
+    int flush() {
+        return !writing_ || emit_frame() ? 0: -1;
+    }
+    // Offsets past the end are clamped to it. Writers can only report their position.
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(writing_) return whence == SEEK_CUR && off == 0 ? std::int64_t(pos_): std::int64_t(-1);
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence == SEEK_END) off += total();
+        else if(whence != SEEK_SET) return -1;
+        if(off < 0 || err_) return -1;
+        const std::uint64_t target = std::min<std::uint64_t>(off, total());
+        auto it = std::upper_bound(frames_.begin(), frames_.end(), target, [](std::uint64_t o, const Frame &f) {return o < f.doff;});
+        const std::ptrdiff_t i = (it - frames_.begin()) - 1;
+        eof_ = false;
+        if(i < 0 || target == total()) {
+            frame_ = frames_.size();
+            cpos_ = cend_ = 0;
+        } else if(i != frame_ && !load_frame(i)) {
+            return -1;
+        } else {
+            cpos_ = target - frames_[i].doff;
+        }
+        return pos_ = target;
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return eof_;}
+    int buffer(size_t) {return 0;}
+    const std::vector<Frame> &frames() const {return frames_;}
+    int close() {
+        if(fd_ < 0) return -1;
+        bool ok = true;
+        if(writing_) ok = emit_frame() && write_seek_table();
+        ok &= ::close(fd_) == 0;
+        fd_ = -1;
+        return ok && !(writing_ && err_) ? 0: -1;
+    }
+    int fd() const {return fd_;}
+    const IoStats &stats() const {return stats_;}
+    ~SeekableZstdFile() {
+        if(fd_ >= 0) close();
+    }
+}; // SeekableZstdFile
+#endif /* FP_USE_ZSTD */
+
+enum class Advice: int {
+    normal,
+    sequential,
+    random,
+    willneed,
+    dontneed,
+    hugepage
+};
+
+/*
+ * Read-only memory-mapped file. view() and next_span() return string_views into the mapping,
+ * valid until close(); read() and getc() copy from it for compatibility with the other backends.
+ */
+class MmapFile {
+    const char *data_ = nullptr;
+    size_t size_ = 0, pos_ = 0;
+    int fd_ = -1;
+    bool eof_ = false;
+public:
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 17;
+    static constexpr bool RANDOM_ACCESS = true;
+
+    MmapFile() = default;
+    MmapFile(const MmapFile &) = delete;
+    MmapFile &operator=(const MmapFile &) = delete;
+
+    // Only read modes are supported; returns nullptr with errno set on failure.
+    static MmapFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        static_cast<void>(opts);
+        if(detail::parse_mode(mode).write) {
+            errno = EINVAL;
+            return nullptr;
+        }
+        return detail::make_backend<MmapFile>([&](auto &f) {return f.open_path(path);});
+    }
+    static MmapFile *dopen(int fd, const char *mode, const Options &opts=Options()) {
+        static_cast<void>(opts);
+        if(detail::parse_mode(mode).write) {
+            errno = EINVAL;
+            return nullptr;
+        }
+        return detail::make_backend<MmapFile>([&](auto &f) {return f.open_fd(fd);});
+    }
+    bool open_path(const char *path) {
+        return detail::adopt_fd(::open(path, O_RDONLY | O_CLOEXEC), [&](int fd) {return open_fd(fd);});
+    }
+    // fd must refer to something mmap accepts, such as a regular file.
+    bool open_fd(int fd) {
+        struct stat st;
+        if(::fstat(fd, &st)) return false;
+        if(st.st_size) {
+            void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(p == MAP_FAILED) return false;
+            data_ = static_cast<const char *>(p);
+            size_ = st.st_size;
+        }
+        fd_ = fd;
+        return true;
+    }
+    const char *data() const {return data_;}
+    size_t size() const {return size_;}
+    // Clamped to the mapping; an offset past the end yields an empty view.
+    std::string_view view(size_t offset, size_t len) const {
+        if(offset >= size_) return std::string_view();
+        return std::string_view(data_ + offset, std::min(len, size_ - offset));
+    }
+    // Returns up to n bytes from the current position and advances past them.
+    std::string_view next_span(size_t n) {
+        const auto ret = view(pos_, n);
+        pos_ += ret.size();
+        if(ret.size() < n) eof_ = true;
+        return ret;
+    }
+    // Applies an madvise hint to [offset, offset + len), rounded out to page boundaries.
+    int advise(Advice advice, size_t offset=0, size_t len=SIZE_MAX) {
+        if(offset >= size_) return 0;
+        static const size_t pgsz = ::sysconf(_SC_PAGESIZE);
+        const size_t start = offset & ~(pgsz - 1);
+        len = std::min(len, size_ - offset) + (offset - start);
+        void *p = const_cast<char *>(data_ + start);
+        int flag;
+        switch(advice) {
+            case Advice::sequential: flag = MADV_SEQUENTIAL; break;
+            case Advice::random:     flag = MADV_RANDOM; break;
+            case Advice::willneed:   flag = MADV_WILLNEED; break;
+            case Advice::dontneed:   flag = MADV_DONTNEED; break;
+#ifdef MADV_HUGEPAGE
+            case Advice::hugepage:   flag = MADV_HUGEPAGE; break;
+#endif
+            default:                 flag = MADV_NORMAL;
+        }
+        return ::madvise(p, len, flag);
+    }
+    ssize_t read(void *dst, size_t nb) {
+        const auto v = next_span(nb);
+        // At end of input, or for an empty file with nothing mapped, v.data() may be null.
+        if(v.empty()) return 0;
+        std::memcpy(dst, v.data(), v.size());
+        return v.size();
+    }
+    int getc() {
+        if(pos_ >= size_) {
+            eof_ = true;
+            return -1;
+        }
+        return static_cast<unsigned char>(data_[pos_++]);
+    }
+    // Everything from the current position to the end of the mapping.
+    std::string_view peek() {
+        if(pos_ >= size_) eof_ = true;
+        return view(pos_, size_);
+    }
+    void consume(size_t n) {
+        if(pos_ < size_) pos_ += std::min(n, size_ - pos_);
+    }
+    // Returns the next record ending in delim (excluding it) as a view into the mapping and advances past it.
+    bool next_record(std::string_view &out, int delim) {
+        if(pos_ >= size_) {
+            eof_ = true;
+            return false;
+        }
+        const char *p = data_ + pos_;
+        const size_t left = size_ - pos_;
+        auto q = static_cast<const char *>(std::memchr(p, delim, left));
+        const size_t len = q ? size_t(q - p): left;
+        out = std::string_view(p, len);
+        pos_ += len + (q != nullptr);
+        return true;
+    }
+    ssize_t write(const void *, size_t) {return -1;}
+    int puts(const char *) {return -1;}
+    int vprintf(const char *, va_list) {return -1;}
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence == SEEK_END) off += size_;
+        else if(whence != SEEK_SET) return -1;
+        if(off < 0) return -1;
+        pos_ = off;
+        eof_ = false;
+        return pos_;
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return eof_;}
+    int buffer(size_t) {return 0;}
+    int flush() {return 0;}
+    int close() {
+        int ret = 0;
+        if(data_) ret = ::munmap(const_cast<char *>(data_), size_);
+        if(fd_ >= 0) ret |= ::close(fd_);
+        data_ = nullptr;
+        size_ = pos_ = 0;
+        fd_ = -1;
+        return ret;
+    }
+    const char *error() const {return nullptr;}
+    int fd() const {return fd_;}
+    ~MmapFile() {close();}
+}; // MmapFile
+
+template<> inline std::uint64_t get_fsz<MmapFile *>(const char *path, FszMode mode) {
+    return get_fsz<std::FILE *>(path, mode);
+}
+
+namespace detail {
+
+// posix_fadvise with the conventions of madvise: 0 on success, -1 with errno set on failure.
+inline int fadvise(int fd, Advice advice, size_t offset, size_t len) {
+    int flag;
+    switch(advice) {
+        case Advice::sequential: flag = POSIX_FADV_SEQUENTIAL; break;
+        case Advice::random:     flag = POSIX_FADV_RANDOM; break;
+        case Advice::willneed:   flag = POSIX_FADV_WILLNEED; break;
+        case Advice::dontneed:   flag = POSIX_FADV_DONTNEED; break;
+        case Advice::hugepage:   return 0; // Only meaningful for mappings
+        default:                 flag = POSIX_FADV_NORMAL;
+    }
+    // A length of 0 extends to the end of the file.
+    const int rc = ::posix_fadvise(fd, offset, len == SIZE_MAX ? 0: len, flag);
+    if(rc) errno = rc;
+    return rc ? -1: 0;
+}
+
+} // namespace detail
+
+/*
+ * Uncompressed file I/O with O_DIRECT, bypassing the page cache. Transfers go through a buffer aligned to
+ * ALIGNMENT, or straight to the caller's memory when it and the file offset are aligned. If the filesystem
+ * refuses O_DIRECT, the file is used through the page cache instead; direct() reports which is in effect.
+ * Options::buffer_size sets the transfer size, rounded up to ALIGNMENT.
+ */
+class DirectFile: public detail::ErrorState {
+#ifdef O_DIRECT
+    static constexpr int DIRECT_FLAG = O_DIRECT;
+#else
+    static constexpr int DIRECT_FLAG = 0;
+#endif
+public:
+    static constexpr size_t ALIGNMENT = 4096;
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 20;
+    static constexpr bool RANDOM_ACCESS = true;
+private:
+    std::unique_ptr<char, decltype(&std::free)> buf_{nullptr, &std::free};
+    size_t bufsize_ = DEFAULT_BUFSIZE;
+    // Reading: the buffer holds [boff_, boff_ + bend_) of the file. Writing: it stages bend_ bytes for offset boff_.
+    std::uint64_t boff_ = 0, pos_ = 0;
+    size_t bend_ = 0;
+    int fd_ = -1;
+    bool writing_ = false, direct_ = false, eof_ = false;
+
+    static bool aligned(std::uint64_t v) {return (v & (ALIGNMENT - 1)) == 0;}
+    static bool aligned(const void *p) {return aligned(reinterpret_cast<std::uintptr_t>(p));}
+    bool set_direct(bool on) {
+        const int flags = ::fcntl(fd_, F_GETFL);
+        if(flags < 0 || ::fcntl(fd_, F_SETFL, on ? flags | DIRECT_FLAG: flags & ~DIRECT_FLAG) < 0) return false;
+        direct_ = on;
+        return true;
+    }
+    // pread/pwrite of the whole range, dropping O_DIRECT for good if the kernel rejects it.
+    template<typename IO, typename Ptr>
+    ssize_t transfer(IO io, Ptr p, size_t nb, std::uint64_t off) {
+        size_t n = 0;
+        while(n < nb) {
+            const ssize_t rc = io(fd_, p + n, nb - n, off + n);
+            if(rc < 0) {
+                if(errno == EINTR) continue;
+                if(errno == EINVAL && direct_ && set_direct(false)) continue;
+                set_errno_error();
+                return n ? ssize_t(n): ssize_t(-1);
+            }
+            if(rc == 0) break;
+            n += rc;
+        }
+        return n;
+    }
+    ssize_t pread_all(char *p, size_t nb, std::uint64_t off) {return transfer(::pread, p, nb, off);}
+    ssize_t pwrite_all(const char *p, size_t nb, std::uint64_t off) {return transfer(::pwrite, p, nb, off);}
+    bool refill() {
+        boff_ = pos_ & ~std::uint64_t(ALIGNMENT - 1);
+        const ssize_t rc = pread_all(buf_.get(), bufsize_, boff_);
+        bend_ = rc > 0 ? rc: 0;
+        if(pos_ >= boff_ + bend_) {
+            eof_ = rc >= 0;
+            return false;
+        }
+        return true;
+    }
+    // Writes the aligned prefix of the staged data and moves the rest to the front of the buffer.
+    bool write_staged() {
+        const size_t whole = bend_ & ~(ALIGNMENT - 1);
+        if(!whole) return true;
+        if(pwrite_all(buf_.get(), whole, boff_) != ssize_t(whole)) return false;
+        std::memmove(buf_.get(), buf_.get() + whole, bend_ - whole);
+        boff_ += whole;
+        bend_ -= whole;
+        return true;
+    }
+    // Writes the unaligned tail through the page cache. It stays staged, so later data rewrites its block directly.
+    bool write_tail() {
+        if(!write_staged()) return false;
+        if(!bend_) return true;
+        const bool was_direct = direct_;
+        if(was_direct && !set_direct(false)) return set_errno_error(), false;
+        const bool ok = pwrite_all(buf_.get(), bend_, boff_) == ssize_t(bend_);
+        if(was_direct) set_direct(true);
+        return ok;
+    }
+public:
+    DirectFile() = default;
+    DirectFile(const DirectFile &) = delete;
+    DirectFile &operator=(const DirectFile &) = delete;
+
+    static DirectFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<DirectFile>([&](auto &f) {return f.open_path(path, mode, opts);});
+    }
+    static DirectFile *dopen(int fd, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<DirectFile>([&](auto &f) {return f.open_fd(fd, mode, opts);});
+    }
+    bool open_path(const char *path, const char *mode, const Options &opts=Options()) {
+        const auto m = detail::parse_mode(mode, opts);
+        // Appending rereads the partial last block, which needs read access.
+        const int flags = (m.append ? O_RDWR | O_CREAT: m.write ? O_WRONLY | O_CREAT | O_TRUNC: O_RDONLY) | O_CLOEXEC;
+        int fd = ::open(path, flags | DIRECT_FLAG, 0666);
+        if(fd < 0 && errno == EINVAL) fd = ::open(path, flags, 0666);
+        return detail::adopt_fd(fd, [&](int d) {return open_fd(d, mode, opts);});
+    }
+    // Transfers bypass the page cache only if fd was opened with O_DIRECT.
+    bool open_fd(int fd, const char *mode, const Options &opts=Options()) {
+        const auto m = detail::parse_mode(mode, opts);
+        const int fl = ::fcntl(fd, F_GETFL);
+        if(fl < 0) return false;
+        direct_ = (fl & DIRECT_FLAG) != 0;
+        writing_ = m.write;
+        if(opts.buffer_size) bufsize_ = (opts.buffer_size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        void *p;
+        if(::posix_memalign(&p, ALIGNMENT, bufsize_)) return false;
+        buf_.reset(static_cast<char *>(p));
+        fd_ = fd;
+        if(m.append) {
+            // Appends start at the end of the file, within the last block if it is partial.
+            struct stat st;
+            if(::fstat(fd_, &st)) {
+                fd_ = -1;
+                return false;
+            }
+            pos_ = st.st_size;
+            boff_ = pos_ & ~std::uint64_t(ALIGNMENT - 1);
+            bend_ = pos_ - boff_;
+            if(bend_ && pread_all(buf_.get(), ALIGNMENT, boff_) != ssize_t(bend_)) {
+                fd_ = -1;
+                return false;
+            }
+        }
+        return true;
+    }
+    bool direct() const {return direct_;}
+    ssize_t read(void *dst, size_t nb) {
+        if(writing_) return -1;
+        auto out = static_cast<char *>(dst);
+        size_t n = 0;
+        while(n < nb) {
+            if(pos_ >= boff_ && pos_ < boff_ + bend_) {
+                const size_t off = pos_ - boff_, take = std::min(nb - n, bend_ - off);
+                std::memcpy(out + n, buf_.get() + off, take);
+                n += take;
+                pos_ += take;
+                continue;
+            }
+            const size_t left = nb - n;
+            if(left >= bufsize_ && aligned(out + n) && aligned(pos_)) {
+                // The caller's buffer is aligned, so skip the copy.
+                const ssize_t rc = pread_all(out + n, left & ~(ALIGNMENT - 1), pos_);
+                if(rc <= 0) {
+                    if(rc == 0) eof_ = true;
+                    break;
+                }
+                n += rc;
+                pos_ += rc;
+                if(size_t(rc) < (left & ~(ALIGNMENT - 1))) {
+                    eof_ = true;
+                    break;
+                }
+                continue;
+            }
+            if(!refill()) break;
+        }
+        return n || !err_ ? ssize_t(n): ssize_t(-1);
+    }
+    int getc() {
+        unsigned char c;
+        return read(&c, 1) == 1 ? c: -1;
+    }
+    // The rest of the aligned transfer buffer, reading the next block if the position is outside it.
+    std::string_view peek() {
+        if(writing_ || (!(pos_ >= boff_ && pos_ < boff_ + bend_) && !refill())) return std::string_view();
+        return std::string_view(buf_.get() + (pos_ - boff_), bend_ - (pos_ - boff_));
+    }
+    void consume(size_t n) {
+        if(!writing_ && pos_ >= boff_ && pos_ < boff_ + bend_) pos_ += std::min<std::uint64_t>(n, boff_ + bend_ - pos_);
+    }
+    ssize_t write(const void *src, size_t nb) {
+        if(!writing_ || err_) return -1;
+        auto p = static_cast<const char *>(src);
+        for(size_t left = nb; left;) {
+            if(!bend_ && left >= bufsize_ && aligned(p) && aligned(boff_)) {
+                const size_t whole = left & ~(ALIGNMENT - 1);
+                if(pwrite_all(p, whole, boff_) != ssize_t(whole)) return -1;
+                boff_ += whole;
+                pos_ += whole;
+                p += whole;
+                left -= whole;
+                continue;
+            }
+            const size_t take = std::min(left, bufsize_ - bend_);
+            std::memcpy(buf_.get() + bend_, p, take);
+            bend_ += take;
+            pos_ += take;
+            p += take;
+            left -= take;
+            if(bend_ == bufsize_ && !write_staged()) return -1;
+        }
+        return nb;
+    }
+    int puts(const char *s) {
+        return write(s, std::strlen(s));
+    }
+    int vprintf(const char *fmt, va_list ap) {
+        return detail::vprintf_staged(nullptr, 0, fmt, ap, [](size_t) {},
+                                      [this](const char *p, size_t n) {return write(p, n);});
+    }
+    int flush() {
+        return !writing_ || write_tail() ? 0: -1;
+    }
+    // Writers can only report their position.
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(writing_) return whence == SEEK_CUR && off == 0 ? std::int64_t(pos_): std::int64_t(-1);
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence == SEEK_END) {
+            struct stat st;
+            if(::fstat(fd_, &st)) return -1;
+            off += st.st_size;
+        } else if(whence != SEEK_SET) return -1;
+        if(off < 0) return -1;
+        eof_ = false;
+        return pos_ = off;
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return eof_;}
+    int buffer(size_t) {return 0;}
+    int close() {
+        if(fd_ < 0) return -1;
+        bool ok = !writing_ || write_tail();
+        ok &= ::close(fd_) == 0;
+        fd_ = -1;
+        return ok && !(writing_ && err_) ? 0: -1;
+    }
+    int fd() const {return fd_;}
+    ~DirectFile() {
+        if(fd_ >= 0) close();
+    }
+}; // DirectFile
+
+template<> inline std::uint64_t get_fsz<DirectFile *>(const char *path, FszMode mode) {
+    return get_fsz<std::FILE *>(path, mode);
+}
+
+#if FP_USE_URING
+/*
+ * Linux io_uring reader for uncompressed files, driven through raw syscalls. Up to Options::buffers reads
+ * (16 by default) of Options::buffer_size bytes (256 KiB) are kept in flight in registered buffers.
+ * read() streams the file with every free buffer reading ahead; submit_read() schedules a read at any offset
+ * and poll() runs the callbacks of those which have finished. Where io_uring is unavailable, reads fall back
+ * to pread and callbacks run from poll(); uring() reports which is in use.
+ */
+class UringFile: public detail::ErrorState {
+public:
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 18;
+    static constexpr unsigned DEFAULT_DEPTH = 16;
+    static constexpr bool RANDOM_ACCESS = true;
+    // Called with the data read and its length, or nullptr and -errno on failure.
+    // data is only valid during the call.
+    using Callback = std::function<void(const char *data, ssize_t n)>;
+private:
+    struct Request {
+        std::uint64_t offset = 0;
+        size_t len = 0, done = 0;
+        std::vector<char> heap;     // Backs reads larger than a registered buffer
+        Callback cb;                // Empty for read-ahead
+        int result = 0;
+        bool busy = false, complete = false;
+    };
+    struct Pending {
+        std::uint64_t offset;
+        size_t len;
+        Callback cb;
+    };
+    std::unique_ptr<char, decltype(&std::free)> bufs_{nullptr, &std::free};
+    size_t bufsize_ = DEFAULT_BUFSIZE;
+    std::vector<Request> reqs_;     // One per registered buffer
+    std::vector<unsigned> free_;
+    std::deque<Pending> backlog_;
+    std::deque<unsigned> ra_;       // Read-ahead requests, in file order
+    size_t rpos_ = 0;               // Consumed bytes of ra_.front()
+    std::uint64_t pos_ = 0, ra_next_ = 0, fsize_ = 0;
+    // Ring state
+    int ring_fd_ = -1;
+    void *sq_ptr_ = nullptr, *cq_ptr_ = nullptr;
+    size_t sq_size_ = 0, cq_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    io_uring_cqe *cqes_ = nullptr;
+    unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_, *cq_head_, *cq_tail_, *cq_mask_;
+    unsigned sq_entries_ = 0, to_submit_ = 0;
+    bool fixed_ = false;
+    int fd_ = -1;
+    bool eof_ = false;
+
+    char *data_of(unsigned i) {
+        Request &r = reqs_[i];
+        return r.len > bufsize_ ? r.heap.data(): bufs_.get() + i * bufsize_;
+    }
+    bool setup_ring(unsigned depth) {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        const long fd = ::syscall(__NR_io_uring_setup, depth, &p);
+        if(fd < 0) return false;
+        ring_fd_ = fd;
+        sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if(single) sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if(sq_ptr_ == MAP_FAILED) return sq_ptr_ = nullptr, false;
+        if(single) cq_ptr_ = sq_ptr_;
+        else if((cq_ptr_ = ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING)) == MAP_FAILED)
+            return cq_ptr_ = nullptr, false;
+        void *sqes = ::mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) return false;
+        sqes_ = static_cast<io_uring_sqe *>(sqes);
+        auto sq = static_cast<char *>(sq_ptr_);
+        auto cq = static_cast<char *>(cq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask_ = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask_ = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        sq_entries_ = p.sq_entries;
+        // Registration can fail under RLIMIT_MEMLOCK; plain reads into the same buffers still work.
+        std::vector<iovec> iov(reqs_.size());
+        for(size_t i = 0; i < iov.size(); ++i) iov[i] = iovec{bufs_.get() + i * bufsize_, bufsize_};
+        fixed_ = ::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iov.data(), unsigned(iov.size())) == 0;
+        return true;
+    }
+    void teardown_ring() {
+        if(sqes_) ::munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+        if(cq_ptr_ && cq_ptr_ != sq_ptr_) ::munmap(cq_ptr_, cq_size_);
+        if(sq_ptr_) ::munmap(sq_ptr_, sq_size_);
+        if(ring_fd_ >= 0) ::close(ring_fd_);
+        sqes_ = nullptr;
+        sq_ptr_ = cq_ptr_ = nullptr;
+        ring_fd_ = -1;
+    }
+    // Queues the unread part of request i. In-flight requests never outnumber the ring's entries.
+    void push(unsigned i) {
+        Request &r = reqs_[i];
+        const unsigned tail = *sq_tail_, idx = tail & *sq_mask_;
+        io_uring_sqe *sqe = &sqes_[idx];
+        std::memset(sqe, 0, sizeof(*sqe));
+        const bool fixed = fixed_ && r.len <= bufsize_;
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED: IORING_OP_READ;
+        sqe->fd = fd_;
+        sqe->off = r.offset + r.done;
+        sqe->addr = reinterpret_cast<std::uintptr_t>(data_of(i) + r.done);
+        sqe->len = r.len - r.done;
+        sqe->buf_index = fixed ? i: 0;
+        sqe->user_data = i;
+        sq_array_[idx] = idx;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit_;
+    }
+    // Submits queued reads and optionally waits for one to complete.
+    bool enter(bool wait) {
+        if(!to_submit_ && !wait) return true;
+        for(;;) {
+            const long rc = ::syscall(__NR_io_uring_enter, ring_fd_, to_submit_, wait ? 1: 0, wait ? IORING_ENTER_GETEVENTS: 0, nullptr, 0);
+            if(rc >= 0) {
+                to_submit_ -= rc;
+                return true;
+            }
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                set_errno_error(errno);
+                return false;
+            }
+        }
+    }
+    // Reads request i synchronously, for when there is no ring.
+    void run_sync(unsigned i) {
+        Request &r = reqs_[i];
+        while(r.done < r.len) {
+            const ssize_t rc = ::pread(fd_, data_of(i) + r.done, r.len - r.done, r.offset + r.done);
+            if(rc < 0 && errno == EINTR) continue;
+            if(rc <= 0) {
+                if(rc < 0) r.result = -errno;
+                break;
+            }
+            r.done += rc;
+        }
+        r.complete = true;
+    }
+    bool start(std::uint64_t offset, size_t len, Callback cb) {
+        if(free_.empty()) return false;
+        const unsigned i = free_.back();
+        free_.pop_back();
+        Request &r = reqs_[i];
+        r.offset = offset;
+        r.len = len;
+        r.done = 0;
+        r.result = 0;
+        r.cb = std::move(cb);
+        r.busy = true;
+        r.complete = false;
+        if(len > bufsize_) r.heap.resize(len);
+        if(!r.cb) ra_.push_back(i);
+        if(ring_fd_ >= 0) push(i);
+        else if(r.cb) run_sync(i);
+        return true;
+    }
+    void release(unsigned i) {
+        Request &r = reqs_[i];
+        r.busy = r.complete = false;
+        r.cb = nullptr;
+        std::vector<char>().swap(r.heap);
+        free_.push_back(i);
+    }
+    // Starts backlogged reads first, then reads ahead of pos_ with whatever buffers remain.
+    void refill_queue(bool readahead) {
+        while(!backlog_.empty() && !free_.empty()) {
+            Pending p = std::move(backlog_.front());
+            backlog_.pop_front();
+            start(p.offset, p.len, std::move(p.cb));
+        }
+        if(!readahead) return;
+        while(ra_next_ < fsize_ && !free_.empty() && backlog_.empty()) {
+            const size_t len = std::min<std::uint64_t>(bufsize_, fsize_ - ra_next_);
+            start(ra_next_, len, Callback());
+            if(ring_fd_ < 0) run_sync(ra_.back());
+            ra_next_ += len;
+        }
+    }
+    // Handles completed reads, resubmitting short ones before end of file. Returns the number of callbacks run.
+    size_t reap() {
+        size_t ncb = 0;
+        unsigned head = *cq_head_;
+        const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        std::vector<unsigned> done;
+        for(; head != tail; ++head) {
+            const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+            const unsigned i = cqe.user_data;
+            Request &r = reqs_[i];
+            if(cqe.res == -EAGAIN || cqe.res == -EINTR || (cqe.res > 0 && (r.done += cqe.res) < r.len && r.offset + r.done < fsize_)) {
+                push(i);
+                continue;
+            }
+            if(cqe.res < 0) r.result = cqe.res;
+            r.complete = true;
+            if(r.cb) done.push_back(i);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        // Callbacks run after the ring is consistent, so they may submit more reads.
+        for(const unsigned i: done) {
+            Request &r = reqs_[i];
+            Callback cb = std::move(r.cb);
+            const ssize_t n = r.result < 0 ? ssize_t(r.result): ssize_t(r.done);
+            const char *data = r.result < 0 ? nullptr: data_of(i);
+            // The buffer is only handed back after the callback returns.
+            cb(data, n);
+            release(i);
+            ++ncb;
+        }
+        return ncb;
+    }
+    size_t run_sync_callbacks() {
+        size_t ncb = 0;
+        for(unsigned i = 0; i < reqs_.size(); ++i) {
+            Request &r = reqs_[i];
+            if(!r.busy || !r.complete || !r.cb) continue;
+            Callback cb = std::move(r.cb);
+            cb(r.result < 0 ? nullptr: data_of(i), r.result < 0 ? ssize_t(r.result): ssize_t(r.done));
+            release(i);
+            ++ncb;
+        }
+        return ncb;
+    }
+    size_t in_flight() const {
+        size_t n = 0;
+        for(const Request &r: reqs_) n += r.busy && !r.complete;
+        return n;
+    }
+    size_t run_backlog_sync() {
+        Pending p = std::move(backlog_.front());
+        backlog_.pop_front();
+        std::vector<char> tmp(p.len);
+        size_t done = 0;
+        ssize_t rc = 0;
+        while(done < p.len && (rc = ::pread(fd_, tmp.data() + done, p.len - done, p.offset + done)) != 0) {
+            if(rc < 0) {
+                if(errno == EINTR) continue;
+                break;
+            }
+            done += rc;
+        }
+        if(rc < 0) p.cb(nullptr, -errno);
+        else p.cb(tmp.data(), done);
+        return 1;
+    }
+    // Waits for the read-ahead buffer at the front of the queue.
+    bool wait_front() {
+        Request &r = reqs_[ra_.front()];
+        while(!r.complete) {
+            if(!enter(true)) return false;
+            reap();
+        }
+        if(r.result < 0) {
+            set_errno_error(-r.result);
+            return false;
+        }
+        return true;
+    }
+    void drop_readahead() {
+        while(!ra_.empty()) {
+            if(ring_fd_ >= 0) {
+                Request &r = reqs_[ra_.front()];
+                while(!r.complete && enter(true)) reap();
+            }
+            release(ra_.front());
+            ra_.pop_front();
+        }
+        rpos_ = 0;
+    }
+public:
+    UringFile() = default;
+    UringFile(const UringFile &) = delete;
+    UringFile &operator=(const UringFile &) = delete;
+
+    // Only read modes are supported.
+    static UringFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        if(detail::parse_mode(mode, opts).write) return nullptr;
+        return detail::make_backend<UringFile>([&](auto &f) {return f.open_path(path, opts);});
+    }
+    static UringFile *dopen(int fd, const char *mode, const Options &opts=Options()) {
+        if(detail::parse_mode(mode, opts).write) return nullptr;
+        return detail::make_backend<UringFile>([&](auto &f) {return f.open_fd(fd, opts);});
+    }
+    bool open_path(const char *path, const Options &opts=Options()) {
+        return detail::adopt_fd(::open(path, O_RDONLY | O_CLOEXEC), [&](int fd) {return open_fd(fd, opts);});
+    }
+    bool open_fd(int fd, const Options &opts=Options()) {
+        struct stat st;
+        if(::fstat(fd, &st)) return false;
+        fsize_ = st.st_size;
+        const unsigned depth = opts.buffers > 0 ? opts.buffers: DEFAULT_DEPTH;
+        if(opts.buffer_size) bufsize_ = opts.buffer_size;
+        void *p;
+        if(::posix_memalign(&p, 4096, depth * bufsize_)) return false;
+        fd_ = fd;
+        bufs_.reset(static_cast<char *>(p));
+        reqs_.resize(depth);
+        for(unsigned i = depth; i--;) free_.push_back(i);
+        if(!setup_ring(depth)) teardown_ring();
+        return true;
+    }
+    bool uring() const {return ring_fd_ >= 0;}
+    bool registered_buffers() const {return fixed_;}
+
+    // Schedules a read of len bytes at offset; cb runs from a later poll(). Never blocks: reads beyond
+    // the queue depth wait in a backlog.
+    void submit_read(std::uint64_t offset, size_t len, Callback cb) {
+        backlog_.push_back(Pending{offset, len, std::move(cb)});
+        refill_queue(false);
+        if(ring_fd_ >= 0 && to_submit_) enter(false);
+    }
+    // Runs callbacks for finished reads, waiting for at least one if wait is set and any are outstanding.
+    // Returns the number of callbacks run.
+    size_t poll(bool wait=false) {
+        size_t ncb = 0;
+        for(;;) {
+            if(ring_fd_ >= 0) {
+                if(!enter(wait && !ncb && pending() && in_flight())) break;
+                ncb += reap();
+            } else ncb += run_sync_callbacks();
+            refill_queue(false);
+            // If unread read-ahead holds every buffer, backlogged reads cannot start; serve one directly.
+            if(!ncb && !backlog_.empty() && !in_flight()) ncb += run_backlog_sync();
+            if(ring_fd_ >= 0 && to_submit_) enter(false);
+            if(!wait || ncb || !pending()) break;
+        }
+        return ncb;
+    }
+    // Reads scheduled with submit_read whose callbacks have not run.
+    size_t pending() const {
+        size_t n = backlog_.size();
+        for(const Request &r: reqs_) n += r.busy && r.cb;
+        return n;
+    }
+    // Runs callbacks until every submitted read has finished.
+    void drain() {
+        while(pending()) poll(true);
+    }
+
+    // The unread part of the oldest read-ahead buffer, waiting for it to complete.
+    std::string_view peek() {
+        while(!err_) {
+            refill_queue(true);
+            if(ring_fd_ >= 0 && to_submit_ && !enter(false)) break;
+            if(ra_.empty()) {
+                if(ra_next_ >= fsize_) {
+                    eof_ = true;
+                    break;
+                }
+                // Every buffer is serving submit_read; wait for one.
+                poll(true);
+                continue;
+            }
+            if(!wait_front()) break;
+            const unsigned i = ra_.front();
+            if(rpos_ < reqs_[i].done) return std::string_view(data_of(i) + rpos_, reqs_[i].done - rpos_);
+            consume(0);
+        }
+        return std::string_view();
+    }
+    void consume(size_t n) {
+        if(ra_.empty() || !reqs_[ra_.front()].complete) return;
+        const unsigned i = ra_.front();
+        const Request &r = reqs_[i];
+        n = std::min(n, r.done - rpos_);
+        rpos_ += n;
+        pos_ += n;
+        if(rpos_ == r.done) {
+            // A short read means the file ended early.
+            if(r.done < r.len) ra_next_ = fsize_ = r.offset + r.done;
+            release(i);
+            ra_.pop_front();
+            rpos_ = 0;
+        }
+    }
+    ssize_t read(void *dst, size_t nb) {
+        auto out = static_cast<char *>(dst);
+        size_t n = 0;
+        while(n < nb) {
+            const std::string_view v = peek();
+            if(v.empty()) break;
+            const size_t take = std::min(nb - n, v.size());
+            std::memcpy(out + n, v.data(), take);
+            consume(take);
+            n += take;
+        }
+        return n || !err_ ? ssize_t(n): ssize_t(-1);
+    }
+    int getc() {
+        unsigned char c;
+        return read(&c, 1) == 1 ? c: -1;
+    }
+    ssize_t write(const void *, size_t) {return -1;}
+    int puts(const char *) {return -1;}
+    int vprintf(const char *, va_list) {return -1;}
+    int flush() {return 0;}
+    // Moving within the current read-ahead buffer keeps the queue; elsewhere it restarts at off.
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence == SEEK_END) off += fsize_;
+        else if(whence != SEEK_SET) return -1;
+        if(off < 0) return -1;
+        if(!ra_.empty() && reqs_[ra_.front()].complete) {
+            const Request &r = reqs_[ra_.front()];
+            if(std::uint64_t(off) >= r.offset && std::uint64_t(off) < r.offset + r.done) {
+                rpos_ = off - r.offset;
+                eof_ = false;
+                return pos_ = off;
+            }
+        }
+        drop_readahead();
+        eof_ = false;
+        ra_next_ = pos_ = off;
+        return pos_;
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return eof_;}
+    int buffer(size_t) {return 0;}
+    int close() {
+        if(fd_ < 0) return -1;
+        // Outstanding reads must finish, and their callbacks run, before the buffers go away.
+        drain();
+        drop_readahead();
+        teardown_ring();
+        const int rc = ::close(fd_);
+        fd_ = -1;
+        return rc == 0 ? 0: -1;
+    }
+    int fd() const {return fd_;}
+    ~UringFile() {
+        if(fd_ >= 0) close();
+    }
+}; // UringFile
+
+template<> inline std::uint64_t get_fsz<UringFile *>(const char *path, FszMode mode) {
+    return get_fsz<std::FILE *>(path, mode);
+}
+#endif /* FP_USE_URING */
+
+namespace detail {
+
+struct BgzfBlock {
+    std::vector<char> data;
+    const char *err = nullptr;
+    std::uint64_t codec_ns = 0; // With FP_STATS, time spent inflating or deflating it
+};
+
+#if FP_USE_LIBDEFLATE
+// libdeflate works on whole buffers only, which suits BGZF blocks. Contexts are kept per thread.
+class RawInflater {
+    libdeflate_decompressor *d_;
+public:
+    RawInflater(): d_(libdeflate_alloc_decompressor()) {}
+    RawInflater(const RawInflater &) = delete;
+    // Succeeds only if exactly outlen bytes come out.
+    bool inflate_all(const char *in, size_t inlen, char *out, size_t outlen) {
+        return d_ && libdeflate_deflate_decompress(d_, in, inlen, out, outlen, nullptr) == LIBDEFLATE_SUCCESS;
+    }
+    ~RawInflater() {if(d_) libdeflate_free_decompressor(d_);}
+};
+
+class RawDeflater {
+    libdeflate_compressor *c_ = nullptr;
+    int level_;
+    // A single stored block, which older libdeflate releases cannot produce at level 0.
+    static size_t store(const char *in, size_t inlen, char *out, size_t outlen) {
+        if(inlen > 0xffff || outlen < inlen + 5) return 0;
+        out[0] = 1; // Final block, stored
+        store_le16(out + 1, inlen);
+        store_le16(out + 3, ~inlen);
+        std::memcpy(out + 5, in, inlen);
+        return inlen + 5;
+    }
+public:
+    // zlib's default level is 6; libdeflate's levels go up to 12.
+    RawDeflater(int level): level_(level) {
+        if(level) c_ = libdeflate_alloc_compressor(level < 0 ? 6: level);
+    }
+    RawDeflater(const RawDeflater &) = delete;
+    // Returns the compressed size, or 0 if the output does not fit.
+    size_t deflate_all(int level, const char *in, size_t inlen, char *out, size_t outlen) {
+        if(level == 0) return store(in, inlen, out, outlen);
+        if(level != level_ || !c_) {
+            if(c_) libdeflate_free_compressor(c_);
+            level_ = level;
+            if(!(c_ = libdeflate_alloc_compressor(level < 0 ? 6: level))) return 0;
+        }
+        return libdeflate_deflate_compress(c_, in, inlen, out, outlen);
+    }
+    ~RawDeflater() {if(c_) libdeflate_free_compressor(c_);}
+};
+
+inline std::uint32_t crc32_of(const void *p, size_t n) {return libdeflate_crc32(0, p, n);}
+#else
+// Raw deflate contexts are kept per thread and reset between blocks.
+class RawInflater {
+    z_stream strm_;
+    bool ok_;
+public:
+    RawInflater() {
+        std::memset(&strm_, 0, sizeof(strm_));
+        ok_ = inflateInit2(&strm_, -15) == Z_OK;
+    }
+    RawInflater(const RawInflater &) = delete;
+    bool inflate_all(const char *in, size_t inlen, char *out, size_t outlen) {
+        if(!ok_ || inflateReset(&strm_) != Z_OK) return false;
+        // inflate cannot finish without output space, even for an empty block.
+        char dummy;
+        strm_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+        strm_.avail_in = inlen;
+        strm_.next_out = reinterpret_cast<Bytef *>(outlen ? out: &dummy);
+        strm_.avail_out = outlen ? outlen: 1;
+        return inflate(&strm_, Z_FINISH) == Z_STREAM_END && strm_.total_out == outlen;
+    }
+    ~RawInflater() {if(ok_) inflateEnd(&strm_);}
+};
+
+class RawDeflater {
+    z_stream strm_;
+    int level_;
+    bool ok_;
+public:
+    RawDeflater(int level): level_(level) {
+        std::memset(&strm_, 0, sizeof(strm_));
+        ok_ = deflateInit2(&strm_, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    RawDeflater(const RawDeflater &) = delete;
+    // Returns the compressed size, or 0 if the output does not fit.
+    size_t deflate_all(int level, const char *in, size_t inlen, char *out, size_t outlen) {
+        if(!ok_) return 0;
+        if(level != level_) {
+            deflateEnd(&strm_);
+            std::memset(&strm_, 0, sizeof(strm_));
+            level_ = level;
+            if(!(ok_ = deflateInit2(&strm_, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK)) return 0;
+        } else if(deflateReset(&strm_) != Z_OK) return 0;
+        strm_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+        strm_.avail_in = inlen;
+        strm_.next_out = reinterpret_cast<Bytef *>(out);
+        strm_.avail_out = outlen;
+        return deflate(&strm_, Z_FINISH) == Z_STREAM_END ? outlen - strm_.avail_out: 0;
+    }
+    ~RawDeflater() {if(ok_) deflateEnd(&strm_);}
+};
+
+inline std::uint32_t crc32_of(const void *p, size_t n) {
+    uLong crc = crc32(0, nullptr, 0);
+    for(auto b = static_cast<const Bytef *>(p); n;) {
+        const uInt take = std::min<size_t>(n, UINT_MAX);
+        crc = crc32(crc, b, take);
+        b += take;
+        n -= take;
+    }
+    return crc;
+}
+#endif /* FP_USE_LIBDEFLATE */
+
+} // namespace detail
+
+/*
+ * BGZF (blocked gzip, as used by htslib) reader and writer. Each block is an independent gzip member,
+ * so the output remains readable by gzopen and gzip -d. With "T<n>" in the mode string,
+ * blocks are inflated or deflated on n worker threads and delivered in order; "T0" uses every core.
+ */
+class BgzfFile: public detail::ErrorState {
+public:
+    static constexpr size_t BLOCK_SIZE = 0xff00;      // Uncompressed bytes per block, as in htslib
+    static constexpr size_t MAX_BLOCK_SIZE = 1 << 16; // Upper bound on a block's size, compressed or not
+    static constexpr size_t HEADER_SIZE = 18, FOOTER_SIZE = 8;
+    static constexpr size_t DEFAULT_BUFSIZE = MAX_BLOCK_SIZE;
+    static constexpr bool PARALLEL = true;
+private:
+    std::unique_ptr<detail::ThreadPool> pool_;
+    std::deque<std::future<detail::BgzfBlock>> pending_;
+    // Reading: cur_ holds the current decompressed block. Writing: cur_ stages the next block.
+    std::vector<char> cur_;
+    size_t cpos_ = 0, cend_ = 0;
+    std::vector<char> ibuf_;
+    size_t ipos_ = 0, iend_ = 0;
+    std::uint64_t pos_ = 0;
+    int fd_ = -1, level_ = Z_DEFAULT_COMPRESSION;
+    bool writing_ = false, ieof_ = false, eof_ = false, auto_buffer_ = false;
+    IoStats stats_;
+    detail::BufferGrowth growth_;
+
+    size_t depth() const {return pool_ ? 2 * pool_->size(): 0;}
+
+    static detail::BgzfBlock inflate_block(const std::vector<char> &raw, size_t cdata_off) {
+        thread_local detail::RawInflater inflater;
+        detail::BgzfBlock ret;
+        {
+            detail::StatTimer t(ret.codec_ns);
+            const char *footer = raw.data() + raw.size() - FOOTER_SIZE;
+            ret.data.resize(detail::load_le32(footer + 4));
+            if(ret.data.size() > MAX_BLOCK_SIZE
+               || !inflater.inflate_all(raw.data() + cdata_off, raw.size() - cdata_off - FOOTER_SIZE, ret.data.data(), ret.data.size())) {
+                ret.err = "bgzf: corrupt block";
+            } else if(detail::crc32_of(ret.data.data(), ret.data.size()) != detail::load_le32(footer)) {
+                ret.err = "bgzf: CRC mismatch";
+            }
+        }
+        return ret;
+    }
+    static detail::BgzfBlock deflate_block(int level, const std::vector<char> &data) {
+        thread_local detail::RawDeflater deflater(level);
+        static const unsigned char header[HEADER_SIZE - 2] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0};
+        detail::BgzfBlock ret;
+        {
+            detail::StatTimer t(ret.codec_ns);
+            ret.data.resize(MAX_BLOCK_SIZE);
+            char *out = ret.data.data();
+            const size_t cap = MAX_BLOCK_SIZE - HEADER_SIZE - FOOTER_SIZE;
+            size_t clen = deflater.deflate_all(level, data.data(), data.size(), out + HEADER_SIZE, cap);
+            // Incompressible blocks are stored, which always fits.
+            if(!clen) clen = deflater.deflate_all(0, data.data(), data.size(), out + HEADER_SIZE, cap);
+            if(!clen) {
+                ret.err = "bgzf: deflate failed";
+            } else {
+                const size_t total = HEADER_SIZE + clen + FOOTER_SIZE;
+                std::memcpy(out, header, sizeof(header));
+                out[16] = (total - 1) & 0xff;
+                out[17] = (total - 1) >> 8;
+                detail::store_le32(out + HEADER_SIZE + clen, detail::crc32_of(data.data(), data.size()));
+                detail::store_le32(out + HEADER_SIZE + clen + 4, data.size());
+                ret.data.resize(total);
+            }
+        }
+        return ret;
+    }
+    bool write_raw(const void *buf, size_t nb) {
+        detail::StatTimer t(stats_.io_ns);
+        detail::count(stats_.syscalls);
+        detail::count(stats_.raw_written, nb);
+        return detail::write_fd(fd_, buf, nb);
+    }
+
+    // Buffered reads of compressed input. Returns the number of bytes read, < nb only at end of file.
+    ssize_t read_input(char *dst, size_t nb) {
+        size_t n = 0;
+        while(n < nb) {
+            if(ipos_ == iend_) {
+                if(auto_buffer_) growth_.maybe_grow(ibuf_);
+                ssize_t rc;
+                {
+                    detail::StatTimer t(stats_.io_ns);
+                    rc = detail::read_fd(fd_, ibuf_.data(), ibuf_.size());
+                }
+                detail::count(stats_.syscalls);
+                growth_.observe(rc, ibuf_.size());
+                if(rc < 0) {
+                    set_errno_error();
+                    return -1;
+                }
+                detail::count(stats_.raw_read, rc);
+                if(rc == 0) break;
+                ipos_ = 0;
+                iend_ = rc;
+            }
+            const size_t take = std::min(nb - n, iend_ - ipos_);
+            std::memcpy(dst + n, ibuf_.data() + ipos_, take);
+            ipos_ += take;
+            n += take;
+        }
+        return n;
+    }
+    // Reads the next compressed block into raw. Returns 1 on success, 0 at end of file and -1 on error.
+    int read_raw_block(std::vector<char> &raw, size_t &cdata_off) {
+        unsigned char header[12];
+        const ssize_t rc = read_input(reinterpret_cast<char *>(header), sizeof(header));
+        if(rc <= 0) return rc;
+        if(rc != sizeof(header)) return set_error("bgzf: truncated block header"), -1;
+        if(header[0] != 0x1f || header[1] != 0x8b || !(header[3] & 4)) return set_error("bgzf: input is not BGZF"), -1;
+        const size_t xlen = detail::load_le16(header + 10);
+        raw.resize(sizeof(header) + xlen);
+        std::memcpy(raw.data(), header, sizeof(header));
+        if(read_input(raw.data() + sizeof(header), xlen) != ssize_t(xlen))
+            return set_error("bgzf: truncated block header"), -1;
+        const size_t bsize = detail::bgzf_block_size(header, reinterpret_cast<unsigned char *>(raw.data() + sizeof(header)));
+        cdata_off = sizeof(header) + xlen;
+        if(bsize < cdata_off + FOOTER_SIZE) return set_error("bgzf: input is not BGZF"), -1;
+        raw.resize(bsize);
+        const size_t rest = bsize - cdata_off;
+        if(read_input(raw.data() + cdata_off, rest) != ssize_t(rest))
+            return set_error("bgzf: truncated block"), -1;
+        return 1;
+    }
+    void prefetch() {
+        while(!ieof_ && !err_ && pending_.size() < depth()) {
+            std::vector<char> raw;
+            size_t off;
+            const int rc = read_raw_block(raw, off);
+            if(rc <= 0) {
+                ieof_ = true;
+                break;
+            }
+            pending_.push_back(pool_->submit([raw = std::move(raw), off] {return inflate_block(raw, off);}));
+        }
+    }
+    bool next_block() {
+        for(;;) {
+            detail::BgzfBlock block;
+            if(pool_) {
+                prefetch();
+                if(pending_.empty()) break;
+                block = pending_.front().get();
+                pending_.pop_front();
+                prefetch();
+            } else {
+                std::vector<char> raw;
+                size_t off;
+                if(ieof_ || err_ || read_raw_block(raw, off) <= 0) break;
+                block = inflate_block(raw, off);
+            }
+            detail::count(stats_.codec_ns, block.codec_ns);
+            if(block.err) {
+                set_error(block.err);
+                break;
+            }
+            cur_ = std::move(block.data);
+            cpos_ = 0;
+            cend_ = cur_.size();
+            if(cend_) return true; // Skip empty blocks, such as the EOF marker
+        }
+        cpos_ = cend_ = 0;
+        eof_ = true;
+        return false;
+    }
+    bool write_block(const detail::BgzfBlock &block) {
+        detail::count(stats_.codec_ns, block.codec_ns);
+        if(block.err) set_error(block.err);
+        else if(!write_raw(block.data.data(), block.data.size())) set_errno_error();
+        return !err_;
+    }
+    bool submit_staged() {
+        if(!cend_) return !err_;
+        std::vector<char> data(std::move(cur_));
+        data.resize(cend_);
+        cur_.resize(BLOCK_SIZE);
+        cend_ = 0;
+        if(!pool_) return write_block(deflate_block(level_, data));
+        pending_.push_back(pool_->submit([data = std::move(data), level = level_] {return deflate_block(level, data);}));
+        while(pending_.size() > depth()) {
+            write_block(pending_.front().get());
+            pending_.pop_front();
+        }
+        return !err_;
+    }
+    bool drain() {
+        while(!pending_.empty()) {
+            write_block(pending_.front().get());
+            pending_.pop_front();
+        }
+        return !err_;
+    }
+    bool rewind() {return seek_block(0, 0) == 0;}
+public:
+    BgzfFile() = default;
+    BgzfFile(const BgzfFile &) = delete;
+    BgzfFile &operator=(const BgzfFile &) = delete;
+
+    static BgzfFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<BgzfFile>([&](auto &f) {return f.open_path(path, mode, opts);});
+    }
+    static BgzfFile *dopen(int fd, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<BgzfFile>([&](auto &f) {return f.open_fd(fd, mode, opts);});
+    }
+    bool open_path(const char *path, const char *mode, const Options &opts=Options()) {
+        const auto m = detail::parse_mode(mode, opts);
+        const int flags = m.write ? O_WRONLY | O_CREAT | (m.append ? O_APPEND: O_TRUNC): O_RDONLY;
+        return detail::adopt_fd(::open(path, flags | O_CLOEXEC, 0666), [&](int fd) {return open_fd(fd, mode, opts);});
+    }
+    bool open_fd(int fd, const char *mode, const Options &opts=Options()) {
+        const auto m = detail::parse_mode(mode, opts);
+        fd_ = fd;
+        writing_ = m.write;
+        stats_ = IoStats();
+        if(m.level >= 0) level_ = std::min(m.level, 9);
+        if(const unsigned nthreads = detail::resolve_threads(m.threads); nthreads > 1)
+            pool_ = std::make_unique<detail::ThreadPool>(nthreads);
+        auto_buffer_ = m.auto_buffer;
+        growth_ = detail::BufferGrowth();
+        if(writing_) cur_.resize(BLOCK_SIZE);
+        else ibuf_.resize(auto_buffer_ ? detail::auto_buffer_size(fd, nullptr, false): DEFAULT_BUFSIZE * 4);
+        return true;
+    }
+    ssize_t read(void *dst, size_t nb) {
+        if(writing_) return -1;
+        auto out = static_cast<char *>(dst);
+        size_t n = 0;
+        while(n < nb && (cpos_ < cend_ || next_block())) {
+            const size_t take = std::min(nb - n, cend_ - cpos_);
+            std::memcpy(out + n, cur_.data() + cpos_, take);
+            cpos_ += take;
+            n += take;
+        }
+        pos_ += n;
+        return n || !err_ ? ssize_t(n): ssize_t(-1);
+    }
+    int getc() {
+        if(writing_ || (cpos_ == cend_ && !next_block())) return -1;
+        ++pos_;
+        return static_cast<unsigned char>(cur_[cpos_++]);
+    }
+    // The rest of the current block, inflating the next one if it is used up.
+    std::string_view peek() {
+        if(writing_ || (cpos_ == cend_ && !next_block())) return std::string_view();
+        return std::string_view(cur_.data() + cpos_, cend_ - cpos_);
+    }
+    void consume(size_t n) {
+        n = std::min(n, cend_ - cpos_);
+        cpos_ += n;
+        pos_ += n;
+    }
+    ssize_t write(const void *buf, size_t nb) {
+        if(!writing_ || err_) return -1;
+        auto p = static_cast<const char *>(buf);
+        for(size_t left = nb; left;) {
+            const size_t take = std::min(left, BLOCK_SIZE - cend_);
+            std::memcpy(cur_.data() + cend_, p, take);
+            cend_ += take;
+            p += take;
+            left -= take;
+            if(cend_ == BLOCK_SIZE && !submit_staged()) return -1;
+        }
+        pos_ += nb;
+        return nb;
+    }
+    // As CodecFile::reserve(); a block that cannot take n more bytes is submitted short.
+    char *reserve(size_t n) {
+        if(!writing_ || err_ || n > BLOCK_SIZE) return nullptr;
+        if(n > BLOCK_SIZE - cend_ && !submit_staged()) return nullptr;
+        return cur_.data() + cend_;
+    }
+    void commit(size_t n) {
+        cend_ += n;
+        pos_ += n;
+        if(cend_ == BLOCK_SIZE) submit_staged();
+    }
+    int putc(int c) {
+        const char ch = c;
+        return write(&ch, 1) == 1 ? static_cast<unsigned char>(ch): -1;
+    }
+    int puts(const char *s) {
+        return write(s, std::strlen(s));
+    }
+    int vprintf(const char *fmt, va_list ap) {
+        if(!writing_) return -1;
+        return detail::vprintf_staged(cur_.data() + cend_, BLOCK_SIZE - cend_, fmt, ap,
+                                      [this](size_t n) {cend_ += n; pos_ += n;},
+                                      [this](const char *p, size_t n) {return write(p, n);});
+    }
+    // Ends the current block and waits until every pending block has been written.
+    int flush() {
+        if(!writing_) return 0;
+        return submit_staged() && drain() ? 0: -1;
+    }
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence != SEEK_SET) return -1;
+        if(off < 0) return -1;
+        if(writing_) {
+            if(std::uint64_t(off) < pos_
+               || !detail::write_zeros(off - pos_, [this](const char *p, size_t n) {return write(p, n);})) return -1;
+            return pos_;
+        }
+        if(std::uint64_t(off) < pos_ && !rewind()) return -1;
+        while(pos_ < std::uint64_t(off)) {
+            if(cpos_ == cend_ && !next_block()) return err_ ? -1: std::int64_t(pos_);
+            const size_t take = std::min<std::uint64_t>(cend_ - cpos_, off - pos_);
+            cpos_ += take;
+            pos_ += take;
+        }
+        return pos_;
+    }
+    // Resumes reading at the block beginning at compressed offset coff, whose data starts at offset uoff.
+    int seek_block(std::uint64_t coff, std::uint64_t uoff) {
+        if(writing_) return -1;
+        pending_.clear();
+        if(::lseek(fd_, coff, SEEK_SET) < 0) return -1;
+        ipos_ = iend_ = cpos_ = cend_ = 0;
+        pos_ = uoff;
+        ieof_ = eof_ = false;
+        return 0;
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return eof_;}
+    int buffer(size_t) {return 0;}
+    unsigned threads() const {return pool_ ? pool_->size(): 1;}
+    const IoStats &stats() const {return stats_;}
+    int close() {
+        if(fd_ < 0) return -1;
+        bool ok = true;
+        if(writing_) {
+            // The empty block marks a complete BGZF file.
+            static const unsigned char eof_block[28] = {
+                0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+            };
+            ok = submit_staged() && drain() && write_raw(eof_block, sizeof(eof_block));
+        }
+        pending_.clear();
+        pool_.reset();
+        ok &= ::close(fd_) == 0;
+        fd_ = -1;
+        // Read errors were already reported by read().
+        return ok && !(writing_ && err_) ? 0: -1;
+    }
+    int fd() const {return fd_;}
+    ~BgzfFile() {
+        if(fd_ >= 0) close();
+    }
+}; // BgzfFile
+
+namespace detail {
+
+template<typename FileType>
+inline std::uint64_t decoded_size(const char *path) {
+    std::unique_ptr<FileType> p(FileType::open(path, "rb"));
+    if(!p) return -1;
+    std::uint64_t tot_read = 0;
+    ssize_t i;
+    std::vector<char> buf(FileType::DEFAULT_BUFSIZE);
+    while((i = p->read(buf.data(), buf.size())) > 0)
+        tot_read += i;
+    if(i < 0) std::fprintf(stderr, "Warning: Error '%s' when reading from %s\n", p->error(), path);
+    return i < 0 ? std::uint64_t(-1): tot_read;
+}
+
+// Calls func(offset, isize) for each BGZF block of fd without inflating it. Returns false at the first non-BGZF block.
+template<typename Func>
+inline bool bgzf_walk(int fd, std::uint64_t fsz, Func &&func) {
+    std::vector<unsigned char> hdr(BgzfFile::HEADER_SIZE);
+    for(std::uint64_t off = 0; off < fsz;) {
+        if(::pread(fd, hdr.data(), 12, off) != 12) return false;
+        const size_t xlen = load_le16(hdr.data() + 10);
+        hdr.resize(std::max<size_t>(hdr.size(), 12 + xlen));
+        if(::pread(fd, hdr.data() + 12, xlen, off + 12) != ssize_t(xlen)) return false;
+        const size_t bsize = bgzf_block_size(hdr.data(), hdr.data() + 12);
+        unsigned char isize[4];
+        if(!bsize || off + bsize > fsz || ::pread(fd, isize, 4, off + bsize - 4) != 4) return false;
+        func(off, load_le32(isize));
+        off += bsize;
+    }
+    return true;
+}
+
+// Sums ISIZE over the BGZF blocks of fd.
+inline bool bgzf_usize(int fd, std::uint64_t fsz, std::uint64_t &usize) {
+    usize = 0;
+    return bgzf_walk(fd, fsz, [&usize](std::uint64_t, std::uint32_t isize) {usize += isize;});
+}
+
+} // namespace detail
+
+// Codec backends without size metadata have no cheaper way than decompressing the stream.
+template<typename PointerType>
+inline std::uint64_t get_fsz(const char *path, FszMode mode) {
+    if(mode == FszMode::estimate) return detail::estimate_fsz(path);
+    return detail::decoded_size<std::remove_pointer_t<PointerType>>(path);
+}
+
+template<> inline std::uint64_t get_fsz<gzFile>(const char *path, FszMode mode) {
+    if(mode == FszMode::estimate) return detail::estimate_fsz(path);
+    if(const int fd = ::open(path, O_RDONLY | O_CLOEXEC); fd >= 0) {
+        // BGZF records every block's size, and gzread passes anything that is not gzip through unchanged,
+        // zstd, xz and bzip2 included. A single gzip member records its size in the trailer, but there may
+        // be more members.
+        unsigned char buf[BgzfFile::HEADER_SIZE];
+        struct stat st;
+        std::uint64_t usize = 0;
+        bool found = false;
+        if(::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            const ssize_t n = detail::read_full(fd, buf, sizeof(buf));
+            switch(n < 0 ? Format::gzip: detect_format(buf, n)) {
+                case Format::bgzf: found = detail::bgzf_usize(fd, st.st_size, usize); break;
+                case Format::gzip:
+                    if(mode == FszMode::fast && st.st_size >= 18 && ::pread(fd, buf, 4, st.st_size - 4) == 4) {
+                        found = true;
+                        usize = detail::load_le32(buf);
+                    }
+                    break;
+                default: found = true; usize = st.st_size; break;
+            }
+        }
+        ::close(fd);
+        if(found) return usize;
+    }
+    if(auto p = gzopen(path, "rb"); p) {
+        size_t tot_read = 0;
+        ssize_t i;
+        std::vector<char> buf(1 << 18);
+        gzbuffer(p, 1 << 18);
+        while((i = gzread(p, buf.data(), buf.size())) == ssize_t(buf.size()))
+            tot_read += buf.size();
+        if(i < 0) std::fprintf(stderr, "Warning: Error code %ld when reading from gzFile\n", (long int)i);
+        else tot_read += i;
+        gzclose(p);
+        return tot_read;
+    }
+    return -1;
+}
+
+template<> inline std::uint64_t get_fsz<BgzfFile *>(const char *path, FszMode mode) {
+    return get_fsz<gzFile>(path, mode);
+}
+
+/*
+ * Access-point index for zran-style random access into gzip streams. Each point records where a
+ * deflate block begins in both the compressed and the decompressed stream, along with the 32 KiB of output
+ * preceding it, so decoding can restart there instead of at the beginning. Windows are kept zlib-compressed.
+ */
+struct GzAccessPoint {
+    std::uint64_t out;         // Decompressed offset
+    std::uint64_t in;          // Compressed offset of the first byte wholly after the point
+    int bits;                  // Bits of the byte before in which belong to the point's block
+    std::vector<char> window;  // Compressed copy of the preceding output
+};
+
+class GzIndex {
+public:
+    static constexpr size_t WINDOW_SIZE = 1 << 15;
+    static constexpr std::uint64_t DEFAULT_SPAN = 1 << 20;
+private:
+    static constexpr char MAGIC[8] = {'F', 'P', 'G', 'Z', 'I', 'D', 'X', '1'};
+    std::vector<GzAccessPoint> points_;
+    std::uint64_t span_;
+    std::uint64_t total_ = UINT64_MAX; // Decompressed size, once the whole stream has been indexed
+    std::uint64_t fsize_ = 0, mtime_ = 0;
+public:
+    explicit GzIndex(std::uint64_t span=DEFAULT_SPAN): span_(span ? span: DEFAULT_SPAN) {}
+    size_t size() const {return points_.size();}
+    const GzAccessPoint &operator[](size_t i) const {return points_[i];}
+    std::uint64_t span() const {return span_;}
+    bool complete() const {return total_ != UINT64_MAX;}
+    std::uint64_t total_out() const {return total_;}
+    // Decompressed offset past which no points have been recorded.
+    std::uint64_t frontier() const {return points_.empty() ? 0: points_.back().out;}
+    void set_complete(std::uint64_t total) {total_ = total;}
+    void set_source(std::uint64_t fsize, std::uint64_t mtime) {fsize_ = fsize; mtime_ = mtime;}
+    void clear() {points_.clear(); total_ = UINT64_MAX;}
+
+    bool add(std::uint64_t out, std::uint64_t in, int bits, const char *win, size_t wlen) {
+        GzAccessPoint p{out, in, bits, std::vector<char>(compressBound(wlen))};
+        uLongf clen = p.window.size();
+        if(compress2(reinterpret_cast<Bytef *>(p.window.data()), &clen, reinterpret_cast<const Bytef *>(win), wlen, 1) != Z_OK)
+            return false;
+        p.window.resize(clen);
+        p.window.shrink_to_fit();
+        points_.push_back(std::move(p));
+        return true;
+    }
+    // Returns the last point at or before decompressed offset off, or -1 if there is none.
+    std::ptrdiff_t find(std::uint64_t off) const {
+        auto it = std::upper_bound(points_.begin(), points_.end(), off, [](std::uint64_t o, const GzAccessPoint &p) {return o < p.out;});
+        return std::ptrdiff_t(it - points_.begin()) - 1;
+    }
+    // Decompresses point i's window into dst, which must hold WINDOW_SIZE bytes. Returns its length, -1 on error.
+    std::ptrdiff_t window(size_t i, char *dst) const {
+        uLongf len = WINDOW_SIZE;
+        const auto &w = points_[i].window;
+        if(uncompress(reinterpret_cast<Bytef *>(dst), &len, reinterpret_cast<const Bytef *>(w.data()), w.size()) != Z_OK) return -1;
+        return len;
+    }
+    // The sidecar is written in host byte order.
+    bool save(const char *path) const {
+        std::FILE *fp = std::fopen(path, "wb");
+        if(!fp) return false;
+        const std::uint64_t header[5] = {span_, total_, fsize_, mtime_, points_.size()};
+        bool ok = std::fwrite(MAGIC, sizeof(MAGIC), 1, fp) == 1 && std::fwrite(header, sizeof(header), 1, fp) == 1;
+        for(auto it = points_.begin(); ok && it != points_.end(); ++it) {
+            const std::uint64_t rec[4] = {it->out, it->in, std::uint64_t(it->bits), it->window.size()};
+            ok = std::fwrite(rec, sizeof(rec), 1, fp) == 1 && std::fwrite(it->window.data(), 1, it->window.size(), fp) == it->window.size();
+        }
+        ok &= std::fclose(fp) == 0;
+        return ok;
+    }
+    // Fails, leaving the index untouched, if path is missing, malformed or was built from a different file.
+    bool load(const char *path, std::uint64_t fsize, std::uint64_t mtime) {
+        std::FILE *fp = std::fopen(path, "rb");
+        if(!fp) return false;
+        char magic[sizeof(MAGIC)];
+        std::uint64_t header[5];
+        bool ok = std::fread(magic, sizeof(magic), 1, fp) == 1 && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0
+               && std::fread(header, sizeof(header), 1, fp) == 1 && header[2] == fsize && header[3] == mtime;
+        std::vector<GzAccessPoint> points;
+        for(std::uint64_t i = 0; ok && i < header[4]; ++i) {
+            std::uint64_t rec[4];
+            ok = std::fread(rec, sizeof(rec), 1, fp) == 1 && rec[2] < 8 && rec[3] <= compressBound(WINDOW_SIZE)
+              && (points.empty() || rec[0] > points.back().out);
+            if(!ok) break;
+            points.push_back(GzAccessPoint{rec[0], rec[1], int(rec[2]), std::vector<char>(rec[3])});
+            ok = std::fread(points.back().window.data(), 1, rec[3], fp) == rec[3];
+        }
+        std::fclose(fp);
+        if(!ok) return false;
+        points_ = std::move(points);
+        span_ = header[0];
+        total_ = header[1];
+        set_source(fsize, mtime);
+        return true;
+    }
+};
+
+/*
+ * Read-only gzip backend with random access through a GzIndex. Access points are recorded as the stream
+ * is decoded, so seeking back to data already read costs at most one span of decompression; build_index()
+ * indexes the whole file up front. Options::index_span sets the distance between points (1 MiB by default).
+ * An index saved by save_index() to the "<path>.fpgzi" sidecar is picked up by later opens of the same file.
+ * Concatenated members are supported; trailing garbage is ignored, as by gzread.
+ */
+class IndexedGzFile: public detail::ErrorState {
+public:
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 17;
+    static constexpr bool RANDOM_ACCESS = true;
+private:
+    z_stream strm_;
+    GzIndex index_;
+    std::vector<char> ibuf_, obuf_, win_;
+    size_t opos_ = 0, oend_ = 0;
+    size_t wpos_ = 0, wfill_ = 0;     // Circular window of the last WINDOW_SIZE decompressed bytes
+    std::uint64_t ioff_ = 0;          // File offset of ibuf_[0]
+    std::uint64_t out_ = 0, pos_ = 0; // Decoder output offset and the offset handed to the caller
+    std::string path_;
+    int fd_ = -1;
+    unsigned skip_ = 0;               // Member trailer bytes still to skip when decoding raw deflate
+    bool zinit_ = false, raw_ = false, member_start_ = true, ieof_ = false, eof_ = false;
+    bool look_ = false;               // A member just ended: check for another gzip header
+
+    std::uint64_t input_offset() const {
+        return ioff_ + (reinterpret_cast<const char *>(strm_.next_in) - ibuf_.data());
+    }
+    // Reads more input, keeping any bytes not yet consumed at the front of the buffer.
+    bool refill() {
+        const size_t keep = strm_.avail_in;
+        ioff_ = input_offset();
+        if(keep) std::memmove(ibuf_.data(), strm_.next_in, keep);
+        const ssize_t rc = detail::read_fd(fd_, ibuf_.data() + keep, ibuf_.size() - keep);
+        if(rc < 0) return set_errno_error(), false;
+        ieof_ = rc == 0;
+        strm_.next_in = reinterpret_cast<Bytef *>(ibuf_.data());
+        strm_.avail_in = keep + rc;
+        return true;
+    }
+    // Positions the input at compressed offset off.
+    bool reposition(std::uint64_t off) {
+        if(::lseek(fd_, off, SEEK_SET) < 0) return set_errno_error(), false;
+        ioff_ = off;
+        strm_.next_in = reinterpret_cast<Bytef *>(ibuf_.data());
+        strm_.avail_in = 0;
+        ieof_ = eof_ = look_ = false;
+        opos_ = oend_ = 0;
+        skip_ = 0;
+        return true;
+    }
+    void update_window(const char *p, size_t n) {
+        const size_t ws = GzIndex::WINDOW_SIZE;
+        if(n >= ws) {
+            std::memcpy(win_.data(), p + n - ws, ws);
+            wpos_ = 0;
+            wfill_ = ws;
+            return;
+        }
+        const size_t first = std::min(n, ws - wpos_);
+        std::memcpy(win_.data() + wpos_, p, first);
+        std::memcpy(win_.data(), p + first, n - first);
+        wpos_ = (wpos_ + n) % ws;
+        wfill_ = std::min(ws, wfill_ + n);
+    }
+    void add_point() {
+        std::vector<char> tmp(wfill_);
+        if(wfill_ < GzIndex::WINDOW_SIZE) {
+            std::memcpy(tmp.data(), win_.data(), wfill_);
+        } else {
+            std::memcpy(tmp.data(), win_.data() + wpos_, wfill_ - wpos_);
+            std::memcpy(tmp.data() + wfill_ - wpos_, win_.data(), wpos_);
+        }
+        if(!index_.add(out_, input_offset(), strm_.data_type & 7, tmp.data(), tmp.size()))
+            set_error("gzindex: failed to compress window");
+    }
+    // Restarts decoding at access point i, or at the beginning of the file if i < 0.
+    bool restore(std::ptrdiff_t i) {
+        if(i < 0) {
+            if(!reposition(0) || inflateReset2(&strm_, 31) != Z_OK) return false;
+            raw_ = false;
+            member_start_ = true;
+            out_ = pos_ = 0;
+            wpos_ = wfill_ = 0;
+            return true;
+        }
+        const GzAccessPoint &p = index_[i];
+        if(!reposition(p.in - (p.bits ? 1: 0)) || inflateReset2(&strm_, -15) != Z_OK) return false;
+        if(p.bits) {
+            if(!refill()) return false;
+            if(!strm_.avail_in) return set_error("gzindex: index does not match input"), false;
+            const int c = *strm_.next_in++;
+            --strm_.avail_in;
+            inflatePrime(&strm_, p.bits, c >> (8 - p.bits));
+        }
+        const std::ptrdiff_t wlen = index_.window(i, win_.data());
+        if(wlen < 0 || inflateSetDictionary(&strm_, reinterpret_cast<const Bytef *>(win_.data()), wlen) != Z_OK)
+            return set_error("gzindex: corrupt window"), false;
+        wfill_ = wlen;
+        wpos_ = wlen % GzIndex::WINDOW_SIZE;
+        raw_ = true;
+        member_start_ = false;
+        out_ = pos_ = p.out;
+        return true;
+    }
+    // Decompresses up to n bytes into dst, recording access points until the index is complete.
+    ssize_t decode(char *dst, size_t n) {
+        size_t produced = 0;
+        while(produced < n && !eof_ && !err_) {
+            if(!strm_.avail_in && !ieof_ && !refill()) break;
+            if(skip_) {
+                const unsigned take = std::min(skip_, strm_.avail_in);
+                strm_.next_in += take;
+                strm_.avail_in -= take;
+                if((skip_ -= take) == 0) {
+                    inflateReset2(&strm_, 31);
+                    member_start_ = look_ = true;
+                } else if(ieof_) {
+                    set_error("gzindex: truncated gzip trailer");
+                }
+                continue;
+            }
+            if(!strm_.avail_in && ieof_) {
+                if(!member_start_) set_error("gzindex: truncated gzip input");
+                else if(!index_.complete()) index_.set_complete(out_);
+                eof_ = true;
+                break;
+            }
+            if(look_) {
+                if(strm_.avail_in < 2 && !ieof_) {
+                    if(!refill()) break;
+                    continue;
+                }
+                look_ = false;
+                // Anything but a gzip magic after a complete member is trailing garbage, as in gzread.
+                if(strm_.avail_in < 2 || strm_.next_in[0] != 0x1f || strm_.next_in[1] != 0x8b) {
+                    if(!index_.complete()) index_.set_complete(out_);
+                    eof_ = true;
+                    break;
+                }
+            }
+            const bool track = !index_.complete();
+            strm_.next_out = reinterpret_cast<Bytef *>(dst + produced);
+            strm_.avail_out = n - produced;
+            const int rc = inflate(&strm_, track ? Z_BLOCK: Z_NO_FLUSH);
+            const size_t got = (n - produced) - strm_.avail_out;
+            if(got) {
+                if(track) update_window(dst + produced, got);
+                produced += got;
+                out_ += got;
+                member_start_ = false;
+            }
+            if(rc == Z_STREAM_END) {
+                if(raw_) {
+                    raw_ = false;
+                    skip_ = 8;
+                } else {
+                    inflateReset(&strm_);
+                    member_start_ = look_ = true;
+                }
+                continue;
+            }
+            if(rc != Z_OK && rc != Z_BUF_ERROR) {
+                set_error(strm_.msg ? strm_.msg: "gzindex: inflate failed");
+                break;
+            }
+            if(track && (strm_.data_type & 128) && !(strm_.data_type & 64) && out_ >= index_.frontier() + index_.span())
+                add_point();
+        }
+        return produced || !err_ ? ssize_t(produced): ssize_t(-1);
+    }
+    bool fill() {
+        const ssize_t rc = decode(obuf_.data(), obuf_.size());
+        opos_ = 0;
+        oend_ = rc > 0 ? rc: 0;
+        return oend_;
+    }
+    // Decodes and discards output until pos_ reaches off or the stream ends.
+    bool skip_to(std::uint64_t off) {
+        while(pos_ < off) {
+            if(opos_ == oend_ && !fill()) return !err_;
+            const size_t take = std::min<std::uint64_t>(oend_ - opos_, off - pos_);
+            opos_ += take;
+            pos_ += take;
+        }
+        return true;
+    }
+    void load_sidecar() {
+        struct stat st;
+        if(::fstat(fd_, &st) != 0) return;
+        index_.set_source(st.st_size, st.st_mtime);
+        GzIndex loaded;
+        if(loaded.load(sidecar_path().data(), st.st_size, st.st_mtime)) index_ = std::move(loaded);
+    }
+public:
+    IndexedGzFile() = default;
+    IndexedGzFile(const IndexedGzFile &) = delete;
+    IndexedGzFile &operator=(const IndexedGzFile &) = delete;
+
+    static IndexedGzFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        return detail::make_backend<IndexedGzFile>([&](auto &f) {return f.open_path(path, mode, opts);});
+    }
+    bool open_path(const char *path, const char *mode, const Options &opts=Options()) {
+        if(detail::parse_mode(mode, opts).write) return false;
+        if((fd_ = ::open(path, O_RDONLY | O_CLOEXEC)) < 0) return false;
+        std::memset(&strm_, 0, sizeof(strm_));
+        if(inflateInit2(&strm_, 31) != Z_OK) {
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        zinit_ = true;
+        path_ = path;
+        index_ = GzIndex(opts.index_span);
+        load_sidecar();
+        ibuf_.resize(DEFAULT_BUFSIZE);
+        obuf_.resize(DEFAULT_BUFSIZE);
+        win_.resize(GzIndex::WINDOW_SIZE);
+        strm_.next_in = reinterpret_cast<Bytef *>(ibuf_.data());
+        return true;
+    }
+    ssize_t read(void *dst, size_t nb) {
+        auto out = static_cast<char *>(dst);
+        size_t n = std::min(nb, oend_ - opos_);
+        std::memcpy(out, obuf_.data() + opos_, n);
+        opos_ += n;
+        // Large reads decode directly into the caller's buffer.
+        while(n < nb && !eof_ && !err_) {
+            if(nb - n >= obuf_.size()) {
+                const ssize_t rc = decode(out + n, nb - n);
+                if(rc <= 0) break;
+                n += rc;
+            } else {
+                if(!fill()) break;
+                const size_t take = std::min(nb - n, oend_);
+                std::memcpy(out + n, obuf_.data(), take);
+                opos_ = take;
+                n += take;
+            }
+        }
+        pos_ += n;
+        return n || !err_ ? ssize_t(n): ssize_t(-1);
+    }
+    int getc() {
+        if(opos_ == oend_ && !fill()) return -1;
+        ++pos_;
+        return static_cast<unsigned char>(obuf_[opos_++]);
+    }
+    std::string_view peek() {
+        if(opos_ == oend_ && !fill()) return std::string_view();
+        return std::string_view(obuf_.data() + opos_, oend_ - opos_);
+    }
+    void consume(size_t n) {
+        n = std::min(n, oend_ - opos_);
+        opos_ += n;
+        pos_ += n;
+    }
+    ssize_t write(const void *, size_t) {return -1;}
+    int puts(const char *) {return -1;}
+    int vprintf(const char *, va_list) {return -1;}
+    int flush() {return 0;}
+    // SEEK_END indexes the rest of the file first.
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence == SEEK_END) {
+            if(!index_.complete() && build_index() < 0) return -1;
+            off += index_.total_out();
+        } else if(whence != SEEK_SET) return -1;
+        if(off < 0 || err_) return -1;
+        const std::uint64_t target = off;
+        if(target >= pos_ && target - pos_ <= oend_ - opos_) {
+            opos_ += target - pos_;
+            pos_ = target;
+            return pos_;
+        }
+        // Restart from the nearest access point unless the decoder is already closer.
+        const std::ptrdiff_t i = index_.find(target);
+        const std::uint64_t start = i < 0 ? 0: index_[i].out;
+        if((target < pos_ || start > pos_) && !restore(i)) return -1;
+        return skip_to(target) ? std::int64_t(pos_): std::int64_t(-1);
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return eof_ && opos_ == oend_;}
+    int buffer(size_t) {return 0;}
+    // Decodes the rest of the file to complete the index, then returns to the current offset.
+    int build_index() {
+        if(index_.complete()) return 0;
+        const std::uint64_t cur = pos_;
+        const std::ptrdiff_t last = std::ptrdiff_t(index_.size()) - 1;
+        if(last >= 0 && index_[last].out > out_ && !restore(last)) return -1;
+        while(fill());
+        pos_ = out_;
+        opos_ = oend_;
+        if(err_) return -1;
+        return seek(cur, SEEK_SET) < 0 ? -1: 0;
+    }
+    const GzIndex &index() const {return index_;}
+    std::string sidecar_path() const {return path_ + ".fpgzi";}
+    // Writes the index to path, or to the sidecar if path is null. Returns 0 on success.
+    int save_index(const char *path=nullptr) const {
+        return index_.save(path ? path: sidecar_path().data()) ? 0: -1;
+    }
+    // Replaces the index with one saved from the same file. Returns 0 on success.
+    int load_index(const char *path) {
+        struct stat st;
+        if(::fstat(fd_, &st) != 0) return -1;
+        GzIndex loaded;
+        if(!loaded.load(path, st.st_size, st.st_mtime)) return -1;
+        index_ = std::move(loaded);
+        return 0;
+    }
+    int close() {
+        if(fd_ < 0) return -1;
+        if(zinit_) inflateEnd(&strm_);
+        zinit_ = false;
+        const int rc = ::close(fd_);
+        fd_ = -1;
+        return rc == 0 ? 0: -1;
+    }
+    int fd() const {return fd_;}
+    ~IndexedGzFile() {
+        if(fd_ >= 0) close();
+    }
+}; // IndexedGzFile
+
+template<> inline std::uint64_t get_fsz<IndexedGzFile *>(const char *path, FszMode mode) {
+    return get_fsz<gzFile>(path, mode);
+}
+
+#if FP_USE_ZSTD
+namespace detail {
+
+// Sums the content sizes in zstd frame headers, skipping skippable frames. Returns false if any frame omits it.
+inline bool zstd_frame_usize(const char *path, std::uint64_t &usize) {
+    MmapFile m;
+    if(!m.open_path(path)) return false;
+    const char *p = m.data();
+    usize = 0;
+    for(size_t left = m.size(); left;) {
+        const size_t csize = ZSTD_findFrameCompressedSize(p, left);
+        if(ZSTD_isError(csize)) return false;
+        if(left < 4 || (load_le32(p) & 0xFFFFFFF0u) != 0x184D2A50u) {
+            const unsigned long long fcs = ZSTD_getFrameContentSize(p, left);
+            if(fcs == ZSTD_CONTENTSIZE_UNKNOWN || fcs == ZSTD_CONTENTSIZE_ERROR) return false;
+            usize += fcs;
+        }
+        p += csize;
+        left -= csize;
+    }
+    return true;
+}
+
+} // namespace detail
+
+template<> inline std::uint64_t get_fsz<ZstdFile *>(const char *path, FszMode mode) {
+    if(mode == FszMode::estimate) return detail::estimate_fsz(path);
+    std::uint64_t usize;
+    return detail::zstd_frame_usize(path, usize) ? usize: detail::decoded_size<ZstdFile>(path);
+}
+
+template<> inline std::uint64_t get_fsz<SeekableZstdFile *>(const char *path, FszMode mode) {
+    if(mode == FszMode::estimate) return detail::estimate_fsz(path);
+    std::vector<SeekableZstdFile::Frame> frames;
+    bool found = false;
+    if(const int fd = ::open(path, O_RDONLY | O_CLOEXEC); fd >= 0) {
+        found = SeekableZstdFile::read_seek_table(fd, frames);
+        ::close(fd);
+    }
+    if(!found) return get_fsz<ZstdFile *>(path, mode);
+    return frames.empty() ? 0: frames.back().doff + frames.back().dsize;
+}
+#endif /* FP_USE_ZSTD */
+
+#if FP_USE_XZ
+namespace detail {
+
+// Reads the index of each .xz stream, walking backwards from the end of the file.
+inline bool xz_index_usize(int fd, std::uint64_t end, std::uint64_t &usize) {
+    usize = 0;
+    while(end) {
+        std::uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+        if(end < 2 * LZMA_STREAM_HEADER_SIZE || ::pread(fd, footer, sizeof(footer), end - sizeof(footer)) != ssize_t(sizeof(footer)))
+            return false;
+        if(load_le32(footer + 8) == 0) {
+            end -= 4; // Stream padding
+            continue;
+        }
+        lzma_stream_flags flags;
+        if(lzma_stream_footer_decode(&flags, footer) != LZMA_OK || flags.backward_size + sizeof(footer) > end) return false;
+        std::vector<std::uint8_t> ibuf(flags.backward_size);
+        if(::pread(fd, ibuf.data(), ibuf.size(), end - sizeof(footer) - ibuf.size()) != ssize_t(ibuf.size())) return false;
+        lzma_index *idx = nullptr;
+        std::uint64_t memlimit = UINT64_MAX;
+        size_t pos = 0;
+        if(lzma_index_buffer_decode(&idx, &memlimit, nullptr, ibuf.data(), &pos, ibuf.size()) != LZMA_OK) return false;
+        usize += lzma_index_uncompressed_size(idx);
+        const std::uint64_t stream_size = lzma_index_stream_size(idx);
+        lzma_index_end(idx, nullptr);
+        if(stream_size > end) return false;
+        end -= stream_size;
+    }
+    return true;
+}
+
+} // namespace detail
+
+template<> inline std::uint64_t get_fsz<XzFile *>(const char *path, FszMode mode) {
+    if(mode == FszMode::estimate) return detail::estimate_fsz(path);
+    std::uint64_t usize = 0;
+    bool found = false;
+    if(const int fd = ::open(path, O_RDONLY | O_CLOEXEC); fd >= 0) {
+        struct stat st;
+        found = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && detail::xz_index_usize(fd, st.st_size, usize);
+        ::close(fd);
+    }
+    return found ? usize: detail::decoded_size<XzFile>(path);
+}
+#endif /* FP_USE_XZ */
+
+namespace detail {
+
+// Backends declaring a true RANDOM_ACCESS member seek without decoding from the start.
+template<typename T, typename=void>
+struct is_random_access: std::false_type {};
+template<typename T>
+struct is_random_access<T, std::void_t<decltype(T::RANDOM_ACCESS)>>: std::bool_constant<T::RANDOM_ACCESS> {};
+
+// Backends (or codecs) declaring a true PARALLEL_READ or PARALLEL_WRITE member spread reads or writes over
+// worker threads; PARALLEL covers both.
+template<typename T, typename=void>
+struct is_parallel: std::false_type {};
+template<typename T>
+struct is_parallel<T, std::void_t<decltype(T::PARALLEL)>>: std::bool_constant<T::PARALLEL> {};
+template<typename T, typename=void>
+struct is_parallel_read: is_parallel<T> {};
+template<typename T>
+struct is_parallel_read<T, std::void_t<decltype(T::PARALLEL_READ)>>: std::bool_constant<T::PARALLEL_READ> {};
+template<typename Codec>
+struct is_parallel_read<CodecFile<Codec>>: is_parallel_read<Codec> {};
+template<typename T, typename=void>
+struct is_parallel_write: is_parallel<T> {};
+template<typename T>
+struct is_parallel_write<T, std::void_t<decltype(T::PARALLEL_WRITE)>>: std::bool_constant<T::PARALLEL_WRITE> {};
+template<typename Codec>
+struct is_parallel_write<CodecFile<Codec>>: is_parallel_write<Codec> {};
+
+// Backends with reopen(path, mode, opts) can switch files while keeping their codec state and buffers.
+template<typename T, typename=void>
+struct has_reopen: std::false_type {};
+template<typename T>
+struct has_reopen<T, std::void_t<decltype(std::declval<T &>().reopen("", "", Options()))>>: std::true_type {};
+
+template<typename T, typename=void>
+struct has_peek: std::false_type {};
+template<typename T>
+struct has_peek<T, std::void_t<decltype(std::string_view(std::declval<T &>().peek()), std::declval<T &>().consume(size_t()))>>: std::true_type {};
+
+template<typename T, typename=void>
+struct has_stats: std::false_type {};
+template<typename T>
+struct has_stats<T, std::void_t<decltype(IoStats(std::declval<const T &>().stats()))>>: std::true_type {};
+
+template<typename T, typename=void>
+struct has_writev: std::false_type {};
+template<typename T>
+struct has_writev<T, std::void_t<decltype(std::declval<T &>().writev(static_cast<const struct iovec *>(nullptr), 0))>>: std::true_type {};
+
+// Backends with reserve(n)/commit(n) let callers format straight into their staging buffer.
+template<typename T, typename=void>
+struct has_reserve: std::false_type {};
+template<typename T>
+struct has_reserve<T, std::void_t<decltype(static_cast<char *>(std::declval<T &>().reserve(size_t())), std::declval<T &>().commit(size_t()))>>: std::true_type {};
+
+// Backends with a static dopen(fd, mode, opts) can adopt descriptors, including standard input and output.
+template<typename T, typename=void>
+struct has_dopen: std::false_type {};
+template<typename T>
+struct has_dopen<T, std::void_t<decltype(T::dopen(0, "", Options()))>>: std::true_type {};
+
+// std::FILE * over memory: fmemopen reads a buffer in place; writes append to a std::string through fopencookie.
+inline std::FILE *memory_source(std::string_view src, const char *mode) {
+    if(src.empty()) return std::fopen("/dev/null", mode);
+    return ::fmemopen(const_cast<char *>(src.data()), src.size(), mode);
+}
+inline std::FILE *memory_sink(std::string *sink, const char *mode) {
+#ifdef _GNU_SOURCE
+    cookie_io_functions_t io{nullptr, [](void *c, const char *buf, size_t n) -> ssize_t {
+        static_cast<std::string *>(c)->append(buf, n);
+        return n;
+    }, nullptr, nullptr};
+    return ::fopencookie(sink, mode, io);
+#else
+    static_cast<void>(sink), static_cast<void>(mode);
+    errno = ENOTSUP;
+    return nullptr;
+#endif
+}
+
+} // namespace detail
+
+/*
+ * Static hooks FpWrapper dispatches through, resolved at compile time, and the capabilities generic code can test
+ * with if constexpr. The primary template covers pointers to backend classes, which provide open, read, write, seek
+ * and the rest as members and advertise capabilities with RANDOM_ACCESS and PARALLEL, PARALLEL_READ or
+ * PARALLEL_WRITE; gzFile and std::FILE * map onto zlib and stdio. A new backend plugs in by providing those
+ * members or a specialization of its own.
+ */
+template<typename PointerType>
+struct BackendTraits {
+    using backend = std::remove_pointer_t<PointerType>;
+    // seek() does not decode from the start.
+    static constexpr bool seekable = detail::is_random_access<backend>::value;
+    // peek()/consume() lend out decoded bytes the backend already holds.
+    static constexpr bool zero_copy = detail::has_peek<backend>::value;
+    // Reads or writes run on worker threads: Options::threads for BGZF both ways and for zstd and xz compression,
+    // a background thread for ReadAhead and WriteBehind. parallel means both directions do.
+    static constexpr bool parallel_read = detail::is_parallel_read<backend>::value;
+    static constexpr bool parallel_write = detail::is_parallel_write<backend>::value;
+    static constexpr bool parallel = parallel_read && parallel_write;
+    static constexpr bool can_dopen = detail::has_dopen<backend>::value;
+    static constexpr bool can_reopen = detail::has_reopen<backend>::value;
+    // close() also frees the handle, so nothing can be asked of it afterward.
+    // Backend objects are closed, then destroyed, which lets their counters include the final flush.
+    static constexpr bool close_frees = false;
+
+    static PointerType open(const char *path, const char *mode, const Options &opts) {return backend::open(path, mode, opts);}
+    // Adopts fd as gzdopen does: the returned handle owns it, and on failure it is left open for the caller.
+    // Every backend's dopen() keeps to this.
+    static PointerType dopen(int fd, const char *mode, const Options &opts) {return backend::dopen(fd, mode, opts);}
+    template<typename Memory>
+    static PointerType open_memory(Memory mem, const char *mode, const Options &opts) {return backend::open_memory(mem, mode, opts);}
+    // Switches a closed handle to another file, returning nullptr (and destroying h) on failure.
+    static PointerType reopen(PointerType h, const char *path, const char *mode, const Options &opts) {
+        if(h->reopen(path, mode, opts)) return h;
+        delete h;
+        return nullptr;
+    }
+    static int close(PointerType h) {return h->close();}
+    static void destroy(PointerType h) {delete h;}
+    static const char *error(PointerType h) {return h->error();}
+    static auto read(PointerType h, void *ptr, size_t nb) {return h->read(ptr, nb);}
+    static auto bulk_read(PointerType h, void *ptr, size_t nb) {return h->read(ptr, nb);}
+    static int getc(PointerType h) {return h->getc();}
+    static auto write(PointerType h, const void *buf, size_t nb) {return h->write(buf, nb);}
+    static std::int64_t writev(PointerType h, const struct iovec *iov, int iovcnt) {
+        CONST_IF(detail::has_writev<backend>::value) return h->writev(iov, iovcnt);
+        else return detail::each_iov(iov, iovcnt, [h](const void *p, size_t n) -> std::int64_t {return h->write(p, n);});
+    }
+    static auto puts(PointerType h, const char *s) {return h->puts(s);}
+    // Space in the backend's own buffer for n bytes of formatted output, or nullptr to go through put().
+    static char *reserve(PointerType h, size_t n) {
+        CONST_IF(detail::has_reserve<backend>::value) return h->reserve(n);
+        static_cast<void>(h), static_cast<void>(n);
+        return nullptr;
+    }
+    static void commit(PointerType h, size_t n) {
+        CONST_IF(detail::has_reserve<backend>::value) h->commit(n);
+        else static_cast<void>(h), static_cast<void>(n);
+    }
+    // Writes a few formatted bytes.
+    static std::int64_t put(PointerType h, const char *p, size_t n) {return h->write(p, n);}
+    static int vprintf(PointerType h, const char *fmt, va_list ap) {return h->vprintf(fmt, ap);}
+    static int flush(PointerType h) {return h->flush();}
+    static auto seek(PointerType h, size_t pos, int whence) {return h->seek(pos, whence);}
+    static auto tell(PointerType h) {return h->tell();}
+    static bool eof(PointerType h) {return h->eof();}
+    static bool can_seek(PointerType) {return seekable;}
+    static std::string_view peek(PointerType h) {return h->peek();}
+    static void consume(PointerType h, size_t n) {h->consume(n);}
+    template<typename Storage>
+    static void buffer(PointerType h, size_t n, Storage &) {h->buffer(n);}
+    // Backends apply Options::auto_buffer themselves when they open.
+    template<typename Storage>
+    static void auto_buffer(PointerType, int, const char *, bool, Storage &) {}
+    static int advise(PointerType h, Advice advice, size_t offset, size_t len) {
+        CONST_IF((std::is_same<backend, MmapFile>::value)) return h->advise(advice, offset, len);
+        else return detail::fadvise(h->fd(), advice, offset, len);
+    }
+    // Fills in the compressed side of s, which holds the wrapper's own counters, from the backend's stats(): raw bytes,
+    // system calls and codec/syscall time since the file was opened (see FP_STATS).
+    static void raw_stats(PointerType h, IoStats &s) {
+        CONST_IF(detail::has_stats<backend>::value) {
+            const IoStats b = h->stats();
+            s.raw_read = b.raw_read;
+            s.raw_written = b.raw_written;
+            s.syscalls = b.syscalls;
+            s.codec_ns = b.codec_ns;
+            s.io_ns = b.io_ns;
+        }
+    }
+};
+
+template<>
+struct BackendTraits<gzFile> {
+    static constexpr bool seekable = false, zero_copy = false;
+    static constexpr bool parallel_read = false, parallel_write = false, parallel = false;
+    static constexpr bool can_dopen = true, can_reopen = false, close_frees = true;
+    // Only the level applies.
+    static std::string gz_mode(const char *mode, const Options &opts) {
+        auto ret = detail::strip_extensions(mode);
+        if(opts.level >= 0) ret += char('0' + std::min(opts.level, 9));
+        return ret;
+    }
+    static gzFile open(const char *path, const char *mode, const Options &opts) {return gzopen(path, gz_mode(mode, opts).data());}
+    static gzFile dopen(int fd, const char *mode, const Options &opts) {return gzdopen(fd, gz_mode(mode, opts).data());}
+    static int close(gzFile h) {return gzclose(h);}
+    static int read(gzFile h, void *ptr, size_t nb) {return gzread(h, ptr, nb);}
+    static int bulk_read(gzFile h, void *ptr, size_t nb) {return gzread(h, ptr, nb);}
+    static int getc(gzFile h) {return gzgetc(h);}
+    static int write(gzFile h, const void *buf, size_t nb) {return gzwrite(h, buf, nb);}
+    static std::int64_t writev(gzFile h, const struct iovec *iov, int iovcnt) {
+        return detail::each_iov(iov, iovcnt, [h](const void *p, size_t n) -> std::int64_t {return gzwrite(h, p, n);});
+    }
+    static int puts(gzFile h, const char *s) {return gzputs(h, s);}
+    static char *reserve(gzFile, size_t) {return nullptr;}
+    static void commit(gzFile, size_t) {}
+    static std::int64_t put(gzFile h, const char *p, size_t n) {return gzwrite(h, p, n);}
+    static int vprintf(gzFile h, const char *fmt, va_list ap) {return gzvprintf(h, fmt, ap);}
+    static int flush(gzFile h) {return gzflush(h, Z_SYNC_FLUSH);}
+    static z_off_t seek(gzFile h, size_t pos, int whence) {return gzseek(h, pos, whence);}
+    static z_off_t tell(gzFile h) {return gztell(h);}
+    static bool eof(gzFile h) {return gzeof(h);}
+    static bool can_seek(gzFile) {return false;}
+    template<typename Storage>
+    static void buffer(gzFile h, size_t n, Storage &) {gzbuffer(h, n);}
+    template<typename Storage>
+    static void auto_buffer(gzFile h, int fd, const char *path, bool write, Storage &storage) {
+        buffer(h, detail::auto_buffer_size(fd, path, write), storage);
+    }
+    // gzFile does not expose its descriptor.
+    static int advise(gzFile, Advice, size_t, size_t) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    // gzoffset, so written totals miss what gzclose flushes.
+    static void raw_stats(gzFile h, IoStats &s) {(s.bytes_written ? s.raw_written: s.raw_read) = gzoffset(h);}
+};
+
+template<>
+struct BackendTraits<std::FILE *> {
+    // Whether a seek is cheap depends on what the FILE is open on; can_seek() checks.
+    static constexpr bool seekable = true, zero_copy = false;
+    static constexpr bool parallel_read = false, parallel_write = false, parallel = false;
+    static constexpr bool can_dopen = true, can_reopen = true, close_frees = true;
+    // Options do not apply.
+    static std::FILE *open(const char *path, const char *mode, const Options &) {
+        return std::fopen(path, detail::strip_extensions(mode).data());
+    }
+    static std::FILE *dopen(int fd, const char *mode, const Options &) {return ::fdopen(fd, detail::strip_extensions(mode).data());}
+    static std::FILE *open_memory(std::string_view src, const char *mode, const Options &) {
+        return detail::memory_source(src, detail::strip_extensions(mode).data());
+    }
+    static std::FILE *open_memory(std::string *sink, const char *mode, const Options &) {
+        return detail::memory_sink(sink, detail::strip_extensions(mode).data());
+    }
+    // freopen closes h itself.
+    static std::FILE *reopen(std::FILE *h, const char *path, const char *mode, const Options &) {
+        return std::freopen(path, detail::strip_extensions(mode).data(), h);
+    }
+    static int close(std::FILE *h) {return std::fclose(h);}
+    static size_t read(std::FILE *h, void *ptr, size_t nb) {return std::fread(ptr, 1, nb, h);}
+    static ssize_t bulk_read(std::FILE *h, void *ptr, size_t nb) {return ::read(::fileno(h), ptr, nb);}
+    static int getc(std::FILE *h) {return std::fgetc(h);}
+    static size_t write(std::FILE *h, const void *buf, size_t nb) {return std::fwrite(buf, 1, nb, h);}
+    // Records smaller than stdio's buffer are copied into it; larger ones flush it and go out in a single writev.
+    static std::int64_t writev(std::FILE *h, const struct iovec *iov, int iovcnt) {
+        size_t total = 0;
+        for(int i = 0; i < iovcnt; ++i) total += iov[i].iov_len;
+        const int fd = ::fileno(h);
+        if(fd < 0 || total < BUFSIZ)
+            return detail::each_iov(iov, iovcnt, [h](const void *p, size_t n) -> std::int64_t {return std::fwrite(p, 1, n, h);});
+        if(std::fflush(h) || !detail::writev_fd(fd, iov, iovcnt)) return -1;
+        return total;
+    }
+    static int puts(std::FILE *h, const char *s) {return std::fputs(s, h);}
+    static char *reserve(std::FILE *, size_t) {return nullptr;}
+    static void commit(std::FILE *, size_t) {}
+    // Skips the stream lock where glibc allows; a wrapper is not shared between threads anyway.
+    static std::int64_t put(std::FILE *h, const char *p, size_t n) {
+#ifdef _GNU_SOURCE
+        return ::fwrite_unlocked(p, 1, n, h);
+#else
+        return std::fwrite(p, 1, n, h);
+#endif
+    }
+    static int vprintf(std::FILE *h, const char *fmt, va_list ap) {return std::vfprintf(h, fmt, ap);}
+    static int flush(std::FILE *h) {return std::fflush(h);}
+    static int seek(std::FILE *h, size_t pos, int whence) {return std::fseek(h, pos, whence);}
+    static long tell(std::FILE *h) {return std::ftell(h);}
+    static bool eof(std::FILE *h) {return std::feof(h);}
+    // Pipes, sockets and terminals cannot seek.
+    static bool can_seek(std::FILE *h) {
+        struct stat s;
+        ::fstat(::fileno(h), &s);
+        return S_ISREG(s.st_mode) || S_ISBLK(s.st_mode);
+    }
+    // setvbuf takes the wrapper's storage, which must outlive the FILE.
+    template<typename Storage>
+    static void buffer(std::FILE *h, size_t n, Storage &storage) {
+        storage.resize(n);
+        std::setvbuf(h, storage.data(), _IOFBF, storage.size());
+    }
+    template<typename Storage>
+    static void auto_buffer(std::FILE *h, int, const char *, bool write, Storage &storage) {
+        buffer(h, detail::auto_buffer_size(::fileno(h), nullptr, write), storage);
+    }
+    static int advise(std::FILE *h, Advice advice, size_t offset, size_t len) {
+        return detail::fadvise(::fileno(h), advice, offset, len);
     }
-    return -1;
-}
+    // The bytes are the raw bytes, and every backend call is I/O.
+    static void raw_stats(std::FILE *, IoStats &s) {
+        s.raw_read = s.bytes_read;
+        s.raw_written = s.bytes_written;
+        s.io_ns = s.backend_ns;
+    }
+};
 
-template<typename PointerType>
+// Input range over the records of any reader with next_line(std::string_view &, int).
+template<typename Reader>
+class LineRange {
+    Reader *r_;
+    int delim_;
+public:
+    class iterator {
+        Reader *r_;
+        int delim_;
+        std::string_view line_;
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = const std::string_view &;
+        iterator(Reader *r=nullptr, int delim='\n'): r_(r), delim_(delim) {}
+        iterator &operator++() {
+            if(!r_->next_line(line_, delim_)) r_ = nullptr;
+            return *this;
+        }
+        reference operator*() const {return line_;}
+        pointer operator->() const {return &line_;}
+        bool operator==(const iterator &o) const {return r_ == o.r_;}
+        bool operator!=(const iterator &o) const {return r_ != o.r_;}
+    };
+    LineRange(Reader *r, int delim): r_(r), delim_(delim) {}
+    iterator begin() {return ++iterator(r_, delim_);}
+    iterator end() {return iterator();}
+};
+
+// Alloc provides the wrapper's own buffers: the stdio buffer set by resize_buffer() and the line buffer.
+// Both are allocated on first use, never zero-filled, and kept across close() and open().
+template<typename PointerType, typename Alloc=std::allocator<char>>
 class FpWrapper {
+public:
+    using buffer_type = std::vector<char, DefaultInitAllocator<char, Alloc>>;
+private:
     PointerType ptr_;
-    std::vector<char> buf_;
+    buffer_type buf_;
     std::string path_;
+    // Line buffer for getline()/lines(): [lpos_, lend_) is unread, [lpos_, lscan_) is known to lack a delimiter.
+    buffer_type lbuf_;
+    size_t lpos_ = 0, lscan_ = 0, lend_ = 0;
+    // Counters for the open file; once it is closed, the totals including the backend's.
+    IoStats stats_;
+    bool publish_stats_ = true;
+
+    static constexpr size_t LINE_BUFSIZE = 1 << 17;
+    // Largest single backend call made by read_array/write_array; gzread and gzwrite take an unsigned int.
+    static constexpr size_t MAX_IO_SIZE = 1 << 30;
+    static constexpr size_t SWAP_BUFSIZE = 1 << 16;
+    // write_int/write_double: local buffer for backends without reserve(); longer output uses the heap.
+    static constexpr size_t FORMAT_BUFSIZE = 512;
+    // Room for any fixed-notation double besides its fractional digits: 309 integer digits, sign and point.
+    static constexpr size_t MAX_FIXED_CHARS = 312;
+
+    template<typename T>
+    T tally(std::uint64_t &counter, T n) {
+        if(std::int64_t(n) > 0) detail::count(counter, n);
+        return n;
+    }
+    auto read_backend(void *ptr, size_t nb) {
+        detail::StatTimer t(stats_.backend_ns);
+        detail::count(stats_.calls);
+        return tally(stats_.bytes_read, traits::read(ptr_, ptr, nb));
+    }
+    auto bulk_read_backend(void *ptr, size_t nb) {
+        detail::StatTimer t(stats_.backend_ns);
+        detail::count(stats_.calls);
+        return tally(stats_.bytes_read, traits::bulk_read(ptr_, ptr, nb));
+    }
+    // Options::auto_buffer for std::FILE * and gzFile. Both only accept a buffer size before the first I/O,
+    // so unlike CodecFile and BgzfFile they keep this one for the life of the file.
+    void auto_buffer(int fd, const char *path, const char *mode) {
+        traits::auto_buffer(ptr_, fd, path, detail::parse_mode(mode).write, buf_);
+    }
+    // Keeps the final counters for stats() and adds them to GlobalStats. Called while the handle is still valid.
+    void finish_stats() {
+        CONST_IF(detail::STATS) {
+            stats_ = stats();
+            if(publish_stats_) GlobalStats::global().add(stats_);
+        }
+    }
+    // Hands out bytes left in the line buffer, so reads after getline() stay in order.
+    size_t take_buffered(void *ptr, size_t nb) {
+        const size_t take = std::min(nb, lend_ - lpos_);
+        std::memcpy(ptr, lbuf_.data() + lpos_, take);
+        lpos_ += take;
+        lscan_ = std::max(lscan_, lpos_);
+        return take;
+    }
+    void discard_buffered() {lpos_ = lscan_ = lend_ = 0;}
+    // format(first, last) writes at most n bytes and returns a std::to_chars_result.
+    template<typename Format>
+    std::int64_t write_formatted(size_t n, Format format) {
+        detail::StatTimer t(stats_.backend_ns);
+        detail::count(stats_.calls);
+        if(char *const p = traits::reserve(ptr_, n)) {
+            const std::to_chars_result r = format(p, p + n);
+            if(r.ec != std::errc()) return -1;
+            traits::commit(ptr_, r.ptr - p);
+            return tally(stats_.bytes_written, std::int64_t(r.ptr - p));
+        }
+        char local[FORMAT_BUFSIZE];
+        std::unique_ptr<char[]> heap(n > sizeof(local) ? new char[n]: nullptr);
+        char *const buf = heap ? heap.get(): local;
+        const std::to_chars_result r = format(buf, buf + n);
+        if(r.ec != std::errc()) return -1;
+        return tally(stats_.bytes_written, traits::put(ptr_, buf, r.ptr - buf));
+    }
+    // Closes a backend object and reports its error, leaving it to be destroyed.
+    int close_backend() {
+        int rc;
+        {
+            detail::StatTimer t(stats_.backend_ns);
+            rc = traits::close(ptr_);
+        }
+        if(rc && traits::error(ptr_))
+            std::fprintf(stderr, "Warning: error '%s' when closing %s\n", traits::error(ptr_), path_.data());
+        return rc;
+    }
 public:
     using type = PointerType;
-    FpWrapper(type ptr=nullptr): ptr_(ptr), buf_(BUFSIZ) {}
+    using traits = BackendTraits<PointerType>;
+    using allocator_type = Alloc;
+    FpWrapper(type ptr=nullptr): ptr_(ptr) {}
+    explicit FpWrapper(const Alloc &alloc): ptr_(nullptr), buf_(alloc), lbuf_(alloc) {}
     FpWrapper(const std::string &s, const char *m="r"): FpWrapper(s.data(), m) {}
-    FpWrapper(const char *p, const char *m="r"): ptr_(nullptr), buf_(BUFSIZ) {
+    FpWrapper(const char *p, const char *m="r"): ptr_(nullptr) {
         this->open(p, m);
     }
+    FpWrapper(const char *p, const char *m, const Options &opts, const Alloc &alloc=Alloc()): ptr_(nullptr), buf_(alloc), lbuf_(alloc) {
+        this->open(p, m, opts);
+    }
+    FpWrapper(int fd, const char *m, const Options &opts=Options(), const Alloc &alloc=Alloc()): ptr_(nullptr), buf_(alloc), lbuf_(alloc) {
+        this->dopen(fd, m, opts);
+    }
+    FpWrapper(const FpWrapper &) = delete;
+    FpWrapper &operator=(const FpWrapper &) = delete;
+    FpWrapper(FpWrapper &&o) noexcept:
+        ptr_(std::exchange(o.ptr_, nullptr)), buf_(std::move(o.buf_)), path_(std::move(o.path_)), lbuf_(std::move(o.lbuf_)),
+        lpos_(o.lpos_), lscan_(o.lscan_), lend_(o.lend_), stats_(o.stats_), publish_stats_(o.publish_stats_)
+    {
+        o.path_.clear();
+        o.discard_buffered();
+    }
+    FpWrapper &operator=(FpWrapper &&o) noexcept {
+        if(this != &o) {
+            if(ptr_) close();
+            ptr_ = std::exchange(o.ptr_, nullptr);
+            buf_ = std::move(o.buf_);
+            path_ = std::move(o.path_);
+            lbuf_ = std::move(o.lbuf_);
+            lpos_ = o.lpos_;
+            lscan_ = o.lscan_;
+            lend_ = o.lend_;
+            stats_ = o.stats_;
+            publish_stats_ = o.publish_stats_;
+            o.path_.clear();
+            o.discard_buffered();
+        }
+        return *this;
+    }
+    // Gives up the handle without closing it, leaving the wrapper closed.
+    // Data read ahead by getline()/lines() stays with the wrapper and is discarded.
+    PointerType release() {
+        // setvbuf cannot be undone, and the FILE would outlive this wrapper's buffer.
+        CONST_IF(is_fp())
+            if(ptr_ && !buf_.empty()) throw std::logic_error("Cannot release a std::FILE * using the wrapper's buffer from resize_buffer()");
+        if(ptr_) finish_stats();
+        discard_buffered();
+        path_.clear();
+        return std::exchange(ptr_, nullptr);
+    }
     const std::string &path() const {return path_;}
     static constexpr bool is_gz() {
         return std::is_same<PointerType, gzFile>::value;
     }
-    static constexpr bool maybe_seekable() {
-        return !std::is_same<PointerType, gzFile>::value;
+    static constexpr bool is_fp() {
+        return std::is_same<PointerType, std::FILE *>::value;
     }
-    bool seekable() const {
-        CONST_IF(is_gz()) return false;
-        struct stat s;
-        ::fstat(::fileno(as_fp()), &s);
-        return !S_ISFIFO(s.st_mode);
+    static constexpr bool is_mmap() {
+        return std::is_same<PointerType, MmapFile *>::value;
     }
+    // True for backends implemented as classes in this header, i.e. anything but gzFile and std::FILE *
+    static constexpr bool is_codec() {
+        return !is_gz() && !is_fp();
+    }
+    static constexpr bool can_dopen() {return traits::can_dopen;}
+    static constexpr bool maybe_seekable() {return traits::seekable;}
+    bool seekable() const {return traits::can_seek(ptr_);}
     template<typename T>
     auto read(T &val) {
         return this->read(std::addressof(val), sizeof(T));
     }
     auto read(void *ptr, size_t nb) {
-        CONST_IF(is_gz())
-            return gzread(as_gz(), ptr, nb);
-        else
-            return std::fread(ptr, 1, nb, as_fp());
+        using ret_type = decltype(read_backend(ptr, nb));
+        if(lpos_ == lend_) return read_backend(ptr, nb);
+        const size_t take = take_buffered(ptr, nb);
+        if(take == nb) return ret_type(take);
+        const auto n = read_backend(static_cast<char *>(ptr) + take, nb - take);
+        return std::int64_t(n) < 0 ? ret_type(take): ret_type(n + take);
     }
     auto bulk_read(void *ptr, size_t nb) {
-        CONST_IF(is_gz())
-            return gzread(as_gz(), ptr, nb);
-        else
-            return ::read(::fileno(as_fp()), ptr, nb);
-    }
-    auto resize_buffer(size_t newsz) {
-        CONST_IF(!is_gz()) {
-            buf_.resize(newsz);
-            std::setvbuf(as_fp(), buf_.data(), buf_.size());
+        using ret_type = decltype(bulk_read_backend(ptr, nb));
+        if(lpos_ == lend_) return bulk_read_backend(ptr, nb);
+        return ret_type(take_buffered(ptr, nb));
+    }
+    // Finds the next record ending in delim and points line at it, excluding the delimiter.
+    // The view is valid until the next call on this wrapper. Records are only copied when they
+    // straddle a buffer refill; for FpWrapper<MmapFile *> they point straight into the mapping.
+    // Returns false at end of input or on a read error; only end of input ends the last record early.
+    bool next_line(std::string_view &line, int delim='\n') {
+        CONST_IF(is_mmap()) {
+            return ptr_->next_record(line, delim);
         } else {
-            gzbuffer(as_gz(), newsz);
+            if(lbuf_.empty()) lbuf_.resize(LINE_BUFSIZE);
+            for(;;) {
+                char *const base = lbuf_.data();
+                if(auto q = static_cast<char *>(std::memchr(base + lscan_, delim, lend_ - lscan_))) {
+                    line = std::string_view(base + lpos_, q - (base + lpos_));
+                    lpos_ = lscan_ = q - base + 1;
+                    return true;
+                }
+                // Move the partial record to the front, growing the buffer if it fills it completely.
+                const size_t partial = lend_ - lpos_;
+                if(lpos_) std::memmove(base, base + lpos_, partial);
+                else if(partial == lbuf_.size()) lbuf_.resize(lbuf_.size() * 2);
+                lpos_ = 0;
+                lscan_ = lend_ = partial;
+                const auto n = read_backend(lbuf_.data() + lend_, lbuf_.size() - lend_);
+                if(std::int64_t(n) <= 0) {
+                    // Nothing available yet from a non-blocking source: the partial record waits for the next call.
+                    // After a read error it stays buffered too, rather than passing for a whole record.
+                    if(std::int64_t(n) < 0 || !partial) return false;
+                    line = std::string_view(lbuf_.data(), partial);
+                    discard_buffered();
+                    return true;
+                }
+                lend_ += n;
+            }
         }
     }
+    // Copies the next record into line, excluding the delimiter. Returns false at end of input.
+    bool getline(std::string &line, int delim='\n') {
+        std::string_view v;
+        if(!next_line(v, delim)) {
+            line.clear();
+            return false;
+        }
+        line.assign(v.data(), v.size());
+        return true;
+    }
+    // for(std::string_view line: fp.lines()) iterates over records without copying them.
+    LineRange<FpWrapper> lines(int delim='\n') {return LineRange<FpWrapper>(this, delim);}
+    // Borrows the next decompressed bytes instead of copying them out: the view covers what the backend already
+    // holds (a block, frame or staging buffer; the rest of the mapping for MmapFile), is empty only at end of input
+    // or on error, and stays valid until the next call on this wrapper. consume(n) then moves past n of its bytes.
+    // std::FILE *, gzFile and backends without a buffer of their own fill the line buffer instead, at the cost of
+    // the copy read() would make.
+    std::string_view peek() {
+        if(lpos_ == lend_) {
+            CONST_IF(traits::zero_copy) {
+                detail::count(stats_.calls);
+                return traits::peek(ptr_);
+            } else {
+                if(lbuf_.empty()) lbuf_.resize(LINE_BUFSIZE);
+                const auto n = read_backend(lbuf_.data(), lbuf_.size());
+                lpos_ = lscan_ = 0;
+                lend_ = std::int64_t(n) > 0 ? size_t(n): 0;
+            }
+        }
+        return std::string_view(lbuf_.data() + lpos_, lend_ - lpos_);
+    }
+    void consume(size_t n) {
+        if(lpos_ != lend_) {
+            lpos_ += std::min(n, lend_ - lpos_);
+            lscan_ = std::max(lscan_, lpos_);
+        } else CONST_IF(traits::zero_copy) {
+            // The backend clamps n to what its last view held, so count how far it actually moved.
+            const std::int64_t before = traits::tell(ptr_);
+            traits::consume(ptr_, n);
+            detail::count(stats_.bytes_read, std::int64_t(traits::tell(ptr_)) - before);
+        }
+    }
+    void resize_buffer(size_t newsz) {traits::buffer(ptr_, newsz, buf_);}
     void seek(size_t pos, int mode=SEEK_SET) {
-        CONST_IF(is_gz())
-            gzseek(as_gz(), pos, mode);
-        else
-            std::fseek(as_fp(), pos, mode);
+        if(mode == SEEK_CUR) pos -= lend_ - lpos_;
+        discard_buffered();
+        traits::seek(ptr_, pos, mode);
     }
-    void close() {
-        CONST_IF(is_gz())
-            gzclose(as_gz());
-        else
-            fclose(as_fp());
+    // Returns the backend's result (fclose, gzclose or close()): nonzero if the final flush or close failed.
+    int close() {
+        discard_buffered();
+        int rc;
+        CONST_IF(traits::close_frees) {
+            finish_stats();
+            rc = traits::close(ptr_);
+        } else {
+            rc = close_backend();
+            finish_stats();
+            traits::destroy(ptr_);
+        }
         ptr_ = nullptr;
+        buf_.clear();
 #if VERBOSE_AF
         std::fprintf(stderr, "Closed file at %s\n", path_.data());
 #endif
         path_.clear();
+        return rc;
     }
     auto write(const char *s) {return write(s, std::strlen(s));}
     auto write(const void *buf, size_t nelem) {
-        CONST_IF(is_gz())
-            return gzwrite(as_gz(), buf, nelem);
-        else
-            return std::fwrite(buf, 1, nelem, as_fp());
+        detail::StatTimer t(stats_.backend_ns);
+        detail::count(stats_.calls);
+        return tally(stats_.bytes_written, traits::write(ptr_, buf, nelem));
+    }
+    // Writes a record held in several buffers as one: a single writev for std::FILE * once it outgrows the stdio
+    // buffer, and one gathered feed to the codec for CodecFile backends. Returns the bytes written, or -1.
+    std::int64_t writev(const struct iovec *iov, int iovcnt) {
+        detail::StatTimer t(stats_.backend_ns);
+        detail::count(stats_.calls);
+        return tally(stats_.bytes_written, traits::writev(ptr_, iov, iovcnt));
+    }
+    // Fills each buffer in turn, stopping early at end of input. Returns the bytes read, or -1.
+    std::int64_t readv(const struct iovec *iov, int iovcnt) {
+        return detail::each_iov(iov, iovcnt, [this](void *p, size_t n) -> std::int64_t {return this->read(p, n);});
+    }
+#if __cpp_lib_span
+    std::int64_t writev(std::span<const struct iovec> iov) {return writev(iov.data(), iov.size());}
+    std::int64_t readv(std::span<const struct iovec> iov) {return readv(iov.data(), iov.size());}
+#endif
+    // Formats numbers with std::to_chars instead of printf: straight into the staging buffer for CodecFile and
+    // BgzfFile, and through a local buffer for other backends (std::FILE * without taking its lock).
+    // Returns the bytes written, or -1.
+    template<typename T, typename=std::enable_if_t<std::is_integral<T>::value>>
+    std::int64_t write_int(T v, int base=10) {
+        return write_formatted(sizeof(T) * CHAR_BIT + 1, [v, base](char *first, char *last) {
+            return std::to_chars(first, last, v, base);
+        });
+    }
+    // Shortest representation that reads back as v.
+    std::int64_t write_double(double v) {
+        return write_formatted(32, [v](char *first, char *last) {return detail::double_chars(first, last, v);});
+    }
+    // precision digits after the point for fixed, as %.*f, %.*e and %.*g would give.
+    std::int64_t write_double(double v, int precision, std::chars_format fmt=std::chars_format::fixed) {
+        precision = std::max(precision, 0);
+        return write_formatted(MAX_FIXED_CHARS + precision, [=](char *first, char *last) {
+            return detail::double_chars(first, last, v, fmt, precision);
+        });
     }
     template<typename T>
     auto write(T val) {
         static constexpr bool is_char_p = std::is_same<std::decay_t<T>, char *>::value;
         CONST_IF(is_char_p) {
-            CONST_IF(is_gz())
-                return gzputs(as_gz(), val);
-            else
-                return std::fputs(val, as_fp());
+            detail::StatTimer t(stats_.backend_ns);
+            detail::count(stats_.calls);
+            detail::count(stats_.bytes_written, std::strlen(val));
+            return traits::puts(ptr_, val);
         } else return this->write(&val, sizeof(val));
     }
+    // Reads up to n elements in as few backend calls as possible, converting them from order.
+    // Returns the number of whole elements read, or -1 if nothing could be read.
+    // A partial element left at end of input is consumed but neither counted nor converted.
+    template<typename T>
+    std::int64_t read_array(T *data, size_t n, ByteOrder order=ByteOrder::native) {
+        static_assert(std::is_trivially_copyable<T>::value, "read_array requires trivially copyable elements");
+        const bool swap = detail::element_swap<T>(order);
+        auto p = reinterpret_cast<char *>(data);
+        const size_t nb = n * sizeof(T);
+        size_t got = 0;
+        while(got < nb) {
+            const auto rc = std::int64_t(this->read(p + got, std::min(nb - got, MAX_IO_SIZE)));
+            if(rc <= 0) {
+                if(rc < 0 && !got) return -1;
+                break;
+            }
+            got += rc;
+        }
+        if(swap) detail::bswap_array<T>(data, got / sizeof(T));
+        return got / sizeof(T);
+    }
+    // Writes n elements in order. Converted elements go through a bounded staging buffer, leaving data untouched.
+    // Returns the number of whole elements written, or -1 if nothing could be written.
+    template<typename T>
+    std::int64_t write_array(const T *data, size_t n, ByteOrder order=ByteOrder::native) {
+        static_assert(std::is_trivially_copyable<T>::value, "write_array requires trivially copyable elements");
+        const bool swap = detail::element_swap<T>(order);
+        const size_t step = (swap ? std::max<size_t>(1, SWAP_BUFSIZE / sizeof(T)): MAX_IO_SIZE / sizeof(T)) * sizeof(T);
+        std::unique_ptr<char[]> tmp(swap ? new char[step]: nullptr);
+        auto p = reinterpret_cast<const char *>(data);
+        size_t done = 0;
+        for(const size_t nb = n * sizeof(T); done < nb;) {
+            const size_t len = std::min(nb - done, step);
+            const char *src = p + done;
+            if(swap) {
+                std::memcpy(tmp.get(), src, len);
+                detail::bswap_array<T>(tmp.get(), len / sizeof(T));
+                src = tmp.get();
+            }
+            const auto rc = std::int64_t(this->write(static_cast<const void *>(src), len));
+            if(rc <= 0) {
+                if(!done) return -1;
+                break;
+            }
+            done += rc;
+            if(size_t(rc) < len) break;
+        }
+        return done / sizeof(T);
+    }
+    template<typename T, typename VecAlloc>
+    std::int64_t write_array(const std::vector<T, VecAlloc> &v, ByteOrder order=ByteOrder::native) {
+        return write_array(v.data(), v.size(), order);
+    }
+#if __cpp_lib_span
+    template<typename T, size_t Extent>
+    std::int64_t read_array(std::span<T, Extent> s, ByteOrder order=ByteOrder::native) {
+        return read_array(s.data(), s.size(), order);
+    }
+    template<typename T, size_t Extent>
+    std::int64_t write_array(std::span<T, Extent> s, ByteOrder order=ByteOrder::native) {
+        return write_array(static_cast<const T *>(s.data()), s.size(), order);
+    }
+#endif
+    // Reads up to n elements into storage which is never zero-filled; the result holds as many as were read.
+    template<typename T>
+    uninit_vector<T> read_vector(size_t n, ByteOrder order=ByteOrder::native) {
+        uninit_vector<T> ret(n);
+        const std::int64_t got = read_array(ret.data(), n, order);
+        ret.resize(got < 0 ? 0: got);
+        return ret;
+    }
     void open(const std::string &s, const char *mode="rb") {
         open(s.data(), mode);
     }
     int getc() {
-        CONST_IF(is_gz())
-            return gzgetc(as_gz());
-        else
-            return std::fgetc(as_fp());
+        if(lpos_ != lend_) {
+            const int c = static_cast<unsigned char>(lbuf_[lpos_++]);
+            lscan_ = std::max(lscan_, lpos_);
+            return c;
+        }
+        const int c = traits::getc(ptr_);
+        // Counted but not timed: reading the clock would cost more than the call.
+        detail::count(stats_.calls);
+        if(c >= 0) detail::count(stats_.bytes_read);
+        return c;
     }
     void open(const char *path, const char *mode="rb") {
+        open(path, mode, Options());
+    }
+    // Only the level applies to gzFile; std::FILE * ignores opts.
+    // "-" is standard input, or standard output when writing, for backends that can adopt a descriptor.
+    // It is duplicated, so close() leaves it open.
+    // Options::nonblocking then also applies to the shared file description.
+    void open(const char *path, const char *mode, const Options &opts) {
         if(ptr_) close();
-        CONST_IF(is_gz()) {
-            ptr_ = reinterpret_cast<PointerType>(gzopen(path, mode));
-        } else {
-            ptr_ = reinterpret_cast<PointerType>(fopen(path, mode));
+        stats_ = IoStats();
+        CONST_IF(can_dopen()) {
+            if(path && std::strcmp(path, "-") == 0) {
+                const bool write = detail::parse_mode(mode).write;
+                const int fd = ::fcntl(write ? STDOUT_FILENO: STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+                if(fd < 0) throw std::runtime_error(std::string("Could not duplicate standard ") + (write ? "output": "input"));
+                try {
+                    dopen(fd, mode, opts);
+                } catch(...) {
+                    ::close(fd);
+                    throw;
+                }
+                path_ = path;
+                return;
+            }
         }
+        ptr_ = traits::open(path, mode, opts);
         if(ptr_ == nullptr)
             throw std::runtime_error(std::string("Could not open file at ") + path + " with mode" + mode);
+        if(opts.auto_buffer) auto_buffer(-1, path, mode);
         if(path) path_ = path;
 #if VERBOSE_AF
         std::fprintf(stderr, "Opened file at path %s with mode '%s'\n", path, mode);
 #endif
     }
+    // Takes ownership of fd, as gzdopen and fdopen do; on failure it is left open and this throws.
+    void dopen(int fd, const char *mode, const Options &opts=Options()) {
+        if(ptr_) close();
+        stats_ = IoStats();
+        ptr_ = traits::dopen(fd, mode, opts);
+        if(ptr_ == nullptr)
+            throw std::runtime_error("Could not open file descriptor " + std::to_string(fd) + " with mode " + mode);
+        if(opts.auto_buffer) auto_buffer(fd, nullptr, mode);
+        path_ = "/dev/fd/" + std::to_string(fd);
+    }
+    // Switches to another file without releasing what open() would rebuild: CodecFile backends keep their
+    // codec context and buffers, and std::FILE * goes through freopen. Other backends, gzFile included,
+    // are closed and opened again; fp::GzipFile is the reusable gzip backend.
+    void reset(const char *path, const char *mode="rb", const Options &opts=Options()) {
+        CONST_IF(!traits::can_reopen) {
+            return open(path, mode, opts);
+        } else {
+            if(!ptr_ || std::strcmp(path, "-") == 0) return open(path, mode, opts);
+            discard_buffered();
+            CONST_IF(!traits::close_frees) close_backend();
+            finish_stats();
+            ptr_ = traits::reopen(ptr_, path, mode, opts);
+            path_.clear();
+            stats_ = IoStats();
+            if(ptr_ == nullptr)
+                throw std::runtime_error(std::string("Could not open file at ") + path + " with mode" + mode);
+            if(opts.auto_buffer) auto_buffer(-1, path, mode);
+            path_ = path;
+        }
+    }
+    // Reads from src, which must outlive the open file, instead of a path.
+    // Every CodecFile backend supports this; std::FILE * reads src uncompressed. gzFile cannot.
+    void open_memory(std::string_view src, const char *mode="rb", const Options &opts=Options()) {
+        static_assert(!is_gz(), "gzFile cannot read from memory; use FpWrapper<fp::GzipFile *>");
+        if(ptr_) close();
+        stats_ = IoStats();
+        ptr_ = traits::open_memory(src, mode, opts);
+        if(ptr_ == nullptr) throw std::runtime_error(std::string("Could not read from memory with mode ") + mode);
+    }
+    // Appends everything written, compressed for CodecFile backends, to *sink. Output is complete after close().
+    void open_memory(std::string *sink, const char *mode="wb", const Options &opts=Options()) {
+        static_assert(!is_gz(), "gzFile cannot write to memory; use FpWrapper<fp::GzipFile *>");
+        if(ptr_) close();
+        stats_ = IoStats();
+        ptr_ = traits::open_memory(sink, mode, opts);
+        if(ptr_ == nullptr) throw std::runtime_error(std::string("Could not write to memory with mode ") + mode);
+    }
     gzFile     as_gz() {return reinterpret_cast<gzFile>(ptr_);}
     std::FILE *as_fp() {return reinterpret_cast<std::FILE *>(ptr_);}
+    gzFile     as_gz() const {return reinterpret_cast<gzFile>(ptr_);}
+    std::FILE *as_fp() const {return reinterpret_cast<std::FILE *>(ptr_);}
     int vfprintf(const char *fmt, va_list ap) {
-        CONST_IF(is_gz())
-            return gzvprintf(as_gz(), fmt, ap);
-        else
-            return std::vfprintf(as_fp(), fmt, ap);
+        detail::StatTimer t(stats_.backend_ns);
+        detail::count(stats_.calls);
+        return tally(stats_.bytes_written, traits::vprintf(ptr_, fmt, ap));
     }
     int fprintf(const char *fmt, ...) {
         va_list va;
@@ -177,24 +5044,958 @@ public:
         va_end(va);
         return ret;
     }
+    int flush() {
+        detail::StatTimer t(stats_.backend_ns);
+        detail::count(stats_.calls);
+        return traits::flush(ptr_);
+    }
     bool is_open() const {return ptr_ != nullptr;}
-    auto eof() const {
-        CONST_IF(is_gz())
-            return gzeof(as_gz());
-        else
-            return std::feof(as_fp());
+    // Counters for the open file, or the last one closed, when FP_STATS is defined. The raw side comes from the
+    // backend: gzoffset for gzFile (so written totals miss what gzclose flushes), the byte counts themselves for
+    // std::FILE *, and stats() for backends that have one (CodecFile, SeekableZstdFile, BgzfFile, and
+    // ReadAheadFile/WriteBehindFile once closed).
+    IoStats stats() const {
+        IoStats ret = stats_;
+        CONST_IF(detail::STATS)
+            if(ptr_) traits::raw_stats(ptr_, ret);
+        return ret;
+    }
+    // Keeps this wrapper's counters out of GlobalStats, for wrappers nested in another that reports them.
+    void publish_stats(bool on) {publish_stats_ = on;}
+    bool eof() const {
+        if(lpos_ != lend_) return false;
+        return traits::eof(ptr_);
     }
+    // Accounts for data read ahead by getline()/lines().
     auto tell() const {
-        CONST_IF(is_gz()) return gztell(as_gz());
-        else              return std::ftell(as_fp());
+        const auto pos = traits::tell(ptr_);
+        return pos - decltype(pos)(lend_ - lpos_);
     }
     ~FpWrapper() {
         if(ptr_) close();
     }
+    // Zero-copy access, available for FpWrapper<MmapFile *>
+    std::string_view view(size_t offset, size_t len) const {return ptr_->view(offset, len);}
+    std::string_view next_span(size_t n) {return ptr_->next_span(n);}
+    // madvise for FpWrapper<MmapFile *>. Elsewhere, posix_fadvise on the file itself, so for compressed
+    // backends offsets refer to the compressed data; gzFile does not expose its descriptor.
+    int advise(Advice advice, size_t offset=0, size_t len=SIZE_MAX) {return traits::advise(ptr_, advice, offset, len);}
     auto       ptr()       {return ptr_;}
     const auto ptr() const {return ptr_;}
 }; // FpWrapper
 
+/*
+ * Runs an FpWrapper<PointerType> on a background thread which keeps a ring of decompressed buffers full,
+ * so decompression overlaps with the consumer's parsing. Read modes only.
+ * Options::buffers and Options::buffer_size set the ring depth (default 4) and buffer size (default 1 MiB).
+ */
+template<typename PointerType>
+class ReadAheadFile {
+    struct Chunk {
+        std::vector<char> data;
+        size_t size = 0;
+        bool error = false;
+    };
+    FpWrapper<PointerType> inner_;
+    detail::SpscRing<Chunk> ring_;
+    std::thread thread_;
+    std::atomic<bool> stop_{false}, failed_{false};
+    Chunk *cur_ = nullptr;
+    size_t cpos_ = 0;
+    std::uint64_t pos_ = 0;
+    const char *err_ = nullptr;
+    bool eof_ = false, done_ = false;
+
+    void produce() {
+        while(!stop_.load(std::memory_order_relaxed)) {
+            Chunk *c = ring_.acquire_empty();
+            if(!c) break;
+            const auto n = inner_.read(c->data.data(), c->data.size());
+            c->error = n < 0;
+            if(c->error) failed_.store(true);
+            c->size = n > 0 ? n: 0;
+            ring_.publish();
+            if(n <= 0) break;
+        }
+        ring_.close();
+    }
+    void start() {
+        stop_.store(false);
+        ring_.reset();
+        cur_ = nullptr;
+        cpos_ = 0;
+        eof_ = done_ = false;
+        thread_ = std::thread([this] {produce();});
+    }
+    void stop() {
+        if(!thread_.joinable()) return;
+        stop_.store(true);
+        ring_.close();
+        thread_.join();
+    }
+    bool next_chunk() {
+        if(cur_) {
+            ring_.release();
+            cur_ = nullptr;
+        }
+        if(done_) return false;
+        Chunk *c = ring_.acquire_full();
+        if(!c || !c->size) {
+            if(c && c->error) err_ = "read error in read-ahead thread";
+            done_ = eof_ = true;
+            if(c) ring_.release();
+            return false;
+        }
+        cur_ = c;
+        cpos_ = 0;
+        return true;
+    }
+public:
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 20;
+    static constexpr int DEFAULT_BUFFERS = 4;
+    static constexpr bool PARALLEL_READ = true;
+
+    ReadAheadFile(int nbufs=DEFAULT_BUFFERS, size_t bufsize=DEFAULT_BUFSIZE): ring_(std::max(nbufs, 2)) {
+        for(auto &c: ring_.slots()) c.data.resize(bufsize);
+    }
+    ReadAheadFile(const ReadAheadFile &) = delete;
+    ReadAheadFile &operator=(const ReadAheadFile &) = delete;
+
+    static ReadAheadFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        if(detail::parse_mode(mode).write) {
+            errno = EINVAL;
+            return nullptr;
+        }
+        auto ret = std::make_unique<ReadAheadFile>(opts.buffers > 0 ? opts.buffers: DEFAULT_BUFFERS,
+                                                   opts.buffer_size ? opts.buffer_size: DEFAULT_BUFSIZE);
+        ret->inner_.publish_stats(false);
+        try {
+            ret->inner_.open(path, mode, opts);
+        } catch(const std::runtime_error &) {
+            return nullptr;
+        }
+        ret->start();
+        return ret.release();
+    }
+    ssize_t read(void *dst, size_t nb) {
+        auto out = static_cast<char *>(dst);
+        size_t n = 0;
+        while(n < nb && ((cur_ && cpos_ < cur_->size) || next_chunk())) {
+            const size_t take = std::min(nb - n, cur_->size - cpos_);
+            std::memcpy(out + n, cur_->data.data() + cpos_, take);
+            cpos_ += take;
+            n += take;
+        }
+        pos_ += n;
+        return n || !err_ ? ssize_t(n): ssize_t(-1);
+    }
+    int getc() {
+        if((!cur_ || cpos_ == cur_->size) && !next_chunk()) return -1;
+        ++pos_;
+        return static_cast<unsigned char>(cur_->data[cpos_++]);
+    }
+    // The rest of the chunk the reader thread filled, waiting for the next one if it is used up.
+    std::string_view peek() {
+        if((!cur_ || cpos_ == cur_->size) && !next_chunk()) return std::string_view();
+        return std::string_view(cur_->data.data() + cpos_, cur_->size - cpos_);
+    }
+    void consume(size_t n) {
+        if(!cur_) return;
+        n = std::min(n, cur_->size - cpos_);
+        cpos_ += n;
+        pos_ += n;
+    }
+    ssize_t write(const void *, size_t) {return -1;}
+    int puts(const char *) {return -1;}
+    int vprintf(const char *, va_list) {return -1;}
+    // Stops the reader thread, repositions the underlying stream and restarts read-ahead from there.
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence != SEEK_SET) return -1;
+        if(off < 0) return -1;
+        stop();
+        inner_.seek(off, SEEK_SET);
+        pos_ = inner_.tell();
+        start();
+        return pos_;
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return eof_;}
+    int buffer(size_t) {return 0;}
+    int flush() {return 0;}
+    // Fails if the underlying stream's close does, or if the reader thread hit a read error, seen or not.
+    int close() {
+        stop();
+        int ret = inner_.is_open() ? inner_.close(): 0;
+        if(failed_.load()) {
+            if(!err_) err_ = "read error in read-ahead thread";
+            ret = -1;
+        }
+        cur_ = nullptr;
+        return ret;
+    }
+    const char *error() const {return err_;}
+    // The underlying stream's counters, which the reader thread updates; zero until close().
+    IoStats stats() const {return inner_.is_open() ? IoStats(): inner_.stats();}
+    FpWrapper<PointerType> &inner() {return inner_;}
+    ~ReadAheadFile() {close();}
+}; // ReadAheadFile
+
+template<typename PointerType>
+using ReadAheadWrapper = FpWrapper<ReadAheadFile<PointerType> *>;
+
+/*
+ * Mirror of ReadAheadFile for writing: the caller fills buffers and a background thread feeds them
+ * to an FpWrapper<PointerType>, so compression runs off the caller's thread. write() only blocks
+ * when every buffer is queued. flush() and close() wait for the queue to drain; a failure in the
+ * background thread fails subsequent writes and is reported by flush() and close().
+ */
+template<typename PointerType>
+class WriteBehindFile {
+    struct Chunk {
+        std::vector<char> data;
+        size_t size = 0;
+    };
+    FpWrapper<PointerType> inner_;
+    detail::SpscRing<Chunk> ring_;
+    std::thread thread_;
+    std::atomic<bool> failed_{false};
+    Chunk *cur_ = nullptr;
+    std::uint64_t pos_ = 0;
+    const char *err_ = nullptr;
+
+    void consume() {
+        while(Chunk *c = ring_.acquire_full()) {
+            if(!failed_.load(std::memory_order_relaxed)) {
+                const auto n = inner_.write(c->data.data(), c->size);
+                if(std::int64_t(n) != std::int64_t(c->size)) failed_.store(true);
+            }
+            c->size = 0;
+            ring_.release();
+        }
+    }
+    bool check() {
+        if(failed_.load() && !err_) err_ = "write error in write-behind thread";
+        return !err_;
+    }
+    bool submit() {
+        if(!cur_) return check();
+        if(cur_->size) {
+            ring_.publish();
+            cur_ = nullptr;
+        }
+        return check();
+    }
+    bool next_chunk() {
+        if(!submit()) return false;
+        if(!cur_ && (cur_ = ring_.acquire_empty()) == nullptr) return false;
+        return true;
+    }
+    bool drain() {
+        const bool ret = submit();
+        ring_.wait_drained();
+        return ret && check();
+    }
+public:
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 20;
+    static constexpr int DEFAULT_BUFFERS = 4;
+    static constexpr bool PARALLEL_WRITE = true;
+
+    WriteBehindFile(int nbufs=DEFAULT_BUFFERS, size_t bufsize=DEFAULT_BUFSIZE): ring_(std::max(nbufs, 2)) {
+        for(auto &c: ring_.slots()) c.data.resize(bufsize);
+    }
+    WriteBehindFile(const WriteBehindFile &) = delete;
+    WriteBehindFile &operator=(const WriteBehindFile &) = delete;
+
+    static WriteBehindFile *open(const char *path, const char *mode, const Options &opts=Options()) {
+        if(!detail::parse_mode(mode).write) {
+            errno = EINVAL;
+            return nullptr;
+        }
+        auto ret = std::make_unique<WriteBehindFile>(opts.buffers > 0 ? opts.buffers: DEFAULT_BUFFERS,
+                                                     opts.buffer_size ? opts.buffer_size: DEFAULT_BUFSIZE);
+        ret->inner_.publish_stats(false);
+        try {
+            ret->inner_.open(path, mode, opts);
+        } catch(const std::runtime_error &) {
+            return nullptr;
+        }
+        ret->thread_ = std::thread([p = ret.get()] {p->consume();});
+        return ret.release();
+    }
+    ssize_t read(void *, size_t) {return -1;}
+    int getc() {return -1;}
+    ssize_t write(const void *buf, size_t nb) {
+        if(!check()) return -1;
+        auto p = static_cast<const char *>(buf);
+        for(size_t left = nb; left;) {
+            if((!cur_ || cur_->size == cur_->data.size()) && !next_chunk()) return -1;
+            const size_t take = std::min(left, cur_->data.size() - cur_->size);
+            std::memcpy(cur_->data.data() + cur_->size, p, take);
+            cur_->size += take;
+            p += take;
+            left -= take;
+        }
+        pos_ += nb;
+        return nb;
+    }
+    int puts(const char *s) {
+        return write(s, std::strlen(s));
+    }
+    int vprintf(const char *fmt, va_list ap) {
+        if(!cur_ && !next_chunk()) return -1;
+        return detail::vprintf_staged(cur_->data.data() + cur_->size, cur_->data.size() - cur_->size, fmt, ap,
+                                      [this](size_t n) {cur_->size += n; pos_ += n;},
+                                      [this](const char *p, size_t n) {return write(p, n);});
+    }
+    // Waits until all queued data has been handed to the underlying stream, then flushes it.
+    int flush() {
+        if(!drain()) return -1;
+        if(inner_.flush() < 0) {
+            if(!err_) err_ = "flush failed in the underlying stream";
+            return -1;
+        }
+        return 0;
+    }
+    // Moves forward only; the underlying stream sees the seek once the queue has drained.
+    std::int64_t seek(std::int64_t off, int whence) {
+        if(whence == SEEK_CUR) off += pos_;
+        else if(whence != SEEK_SET) return -1;
+        if(off < 0 || !drain()) return -1;
+        inner_.seek(off, SEEK_SET);
+        return pos_ = inner_.tell();
+    }
+    std::int64_t tell() const {return pos_;}
+    bool eof() const {return false;}
+    int buffer(size_t) {return 0;}
+    int close() {
+        if(!thread_.joinable()) return -1;
+        bool ok = drain();
+        ring_.close();
+        thread_.join();
+        // The final close flushes what the underlying stream still buffers, so its failures count too.
+        if(inner_.is_open() && inner_.close()) {
+            if(!err_) err_ = "close failed in the underlying stream";
+            ok = false;
+        }
+        cur_ = nullptr;
+        return ok ? 0: -1;
+    }
+    const char *error() const {return err_;}
+    // The underlying stream's counters, which the writer thread updates; zero until close().
+    IoStats stats() const {return inner_.is_open() ? IoStats(): inner_.stats();}
+    FpWrapper<PointerType> &inner() {return inner_;}
+    ~WriteBehindFile() {
+        if(thread_.joinable()) close();
+    }
+}; // WriteBehindFile
+
+template<typename PointerType>
+using WriteBehindWrapper = FpWrapper<WriteBehindFile<PointerType> *>;
+
+/*
+ * Reads many files at once, e.g. the sorted runs of a k-way merge, with decompression spread over a thread pool.
+ * Each file is a Source with read(), getc(), next_line() and peek()/consume(); the consumer drains them from one
+ * thread in any order while workers keep refilling buffers. Buffers are shared: each file holds at most a few
+ * besides the one being read, so memory stays near max_memory however many files there are (at least two buffers
+ * per file; records split across buffers are copied out on top). Free buffers go first to the file the consumer
+ * is waiting on, then to the one with the least decoded data ahead of it.
+ * Options::threads sets the pool size (one per core by default) and Options::buffer_size the buffer size;
+ * Options::buffers caps the buffers queued per file (default 4). The other options apply to each file.
+ */
+template<typename PointerType>
+class MultiReader {
+public:
+    static constexpr size_t DEFAULT_MEMORY = size_t(256) << 20;
+    static constexpr size_t DEFAULT_BUFSIZE = 1 << 20;
+    static constexpr size_t MIN_BUFSIZE = 1 << 16;
+    static constexpr int DEFAULT_BUFFERS = 4;
+    class Source;
+private:
+    static constexpr size_t NONE = SIZE_MAX;
+    struct Stream {
+        FpWrapper<PointerType> in;
+        // Guarded by mtx_.
+        std::deque<size_t> ready;
+        size_t ready_bytes = 0;
+        bool busy = false;   // A worker is reading from in
+        bool done = false;   // in reached end of input or failed
+        bool failed = false;
+        // Consumer side.
+        size_t cur = NONE, cpos = 0;
+        std::uint64_t pos = 0;
+        bool ended = false, error = false;
+        std::string line;    // Records straddling buffers
+    };
+    std::vector<Stream> streams_;
+    std::vector<Source> sources_;
+    std::vector<uninit_vector<char>> bufs_;
+    std::vector<size_t> sizes_;
+    std::vector<size_t> free_;
+    size_t bufsize_, depth_;
+    size_t waiting_ = NONE; // Stream the consumer is blocked on
+    unsigned busy_ = 0;
+    bool stop_ = false;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::unique_ptr<detail::ThreadPool> pool_;
+
+    bool eligible(size_t i) const {
+        const Stream &s = streams_[i];
+        return !s.busy && !s.done && s.ready.size() < depth_;
+    }
+    // Called with mtx_ held. A file never holds more than depth_ buffers besides the consumer's, so there is
+    // always one left for the file being waited on.
+    void schedule() {
+        while(!stop_ && !free_.empty() && busy_ < pool_->size()) {
+            size_t best = waiting_ != NONE && eligible(waiting_) ? waiting_: NONE;
+            if(best == NONE)
+                for(size_t i = 0; i < streams_.size(); ++i)
+                    if(eligible(i) && (best == NONE || streams_[i].ready_bytes < streams_[best].ready_bytes)) best = i;
+            if(best == NONE) return;
+            streams_[best].busy = true;
+            ++busy_;
+            const size_t b = free_.back();
+            free_.pop_back();
+            pool_->submit([this, best, b] {fill(best, b);});
+        }
+    }
+    void fill(size_t i, size_t b) {
+        Stream &s = streams_[i];
+        std::int64_t n = -1;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if(stop_) n = 0;
+        }
+        if(n) {
+            if(bufs_[b].empty()) bufs_[b].resize(bufsize_);
+            n = s.in.read(bufs_[b].data(), bufsize_);
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        s.busy = false;
+        --busy_;
+        if(n > 0) {
+            sizes_[b] = n;
+            s.ready.push_back(b);
+            s.ready_bytes += n;
+        } else {
+            free_.push_back(b);
+            s.done = true;
+            s.failed = n < 0;
+        }
+        schedule();
+        cv_.notify_all();
+    }
+    // Hands the consumer's drained buffer back and waits for the file's next one. False at end of input.
+    bool next_buffer(size_t i) {
+        Stream &s = streams_[i];
+        if(s.ended) return false;
+        std::unique_lock<std::mutex> lock(mtx_);
+        if(s.cur != NONE) {
+            free_.push_back(s.cur);
+            s.cur = NONE;
+        }
+        while(s.ready.empty() && !s.done) {
+            waiting_ = i;
+            schedule();
+            cv_.wait(lock);
+        }
+        waiting_ = NONE;
+        if(s.ready.empty()) {
+            s.ended = true;
+            s.error = s.failed;
+        } else {
+            s.cur = s.ready.front();
+            s.ready.pop_front();
+            s.ready_bytes -= sizes_[s.cur];
+            s.cpos = 0;
+        }
+        schedule();
+        return !s.ended;
+    }
+public:
+    class Source {
+        MultiReader *m_;
+        size_t i_;
+        Stream &s() const {return m_->streams_[i_];}
+    public:
+        Source(MultiReader *m, size_t i): m_(m), i_(i) {}
+        // The rest of the current buffer, waiting for the next if it is used up; empty at end of input.
+        std::string_view peek() {
+            Stream &s = this->s();
+            if((s.cur == NONE || s.cpos == m_->sizes_[s.cur]) && !m_->next_buffer(i_)) return std::string_view();
+            return std::string_view(m_->bufs_[s.cur].data() + s.cpos, m_->sizes_[s.cur] - s.cpos);
+        }
+        void consume(size_t n) {
+            Stream &s = this->s();
+            if(s.cur == NONE) return;
+            n = std::min(n, m_->sizes_[s.cur] - s.cpos);
+            s.cpos += n;
+            s.pos += n;
+        }
+        std::int64_t read(void *dst, size_t nb) {
+            auto out = static_cast<char *>(dst);
+            size_t n = 0;
+            for(std::string_view v; n < nb && !(v = peek()).empty();) {
+                const size_t take = std::min(nb - n, v.size());
+                std::memcpy(out + n, v.data(), take);
+                consume(take);
+                n += take;
+            }
+            return n || !s().error ? std::int64_t(n): std::int64_t(-1);
+        }
+        int getc() {
+            const std::string_view v = peek();
+            if(v.empty()) return -1;
+            consume(1);
+            return static_cast<unsigned char>(v[0]);
+        }
+        // As FpWrapper::next_line(): the view is valid until the next call on this source, and a record cut short
+        // by a read error is not returned.
+        bool next_line(std::string_view &line, int delim='\n') {
+            std::string &carry = s().line;
+            carry.clear();
+            bool partial = false;
+            for(std::string_view v; !(v = peek()).empty();) {
+                if(auto q = static_cast<const char *>(std::memchr(v.data(), delim, v.size()))) {
+                    const size_t len = q - v.data();
+                    consume(len + 1);
+                    if(!partial) {
+                        line = v.substr(0, len);
+                        return true;
+                    }
+                    carry.append(v.data(), len);
+                    line = carry;
+                    return true;
+                }
+                carry.append(v.data(), v.size());
+                consume(v.size());
+                partial = true;
+            }
+            if(!partial || s().error) return false;
+            line = carry;
+            return true;
+        }
+        bool getline(std::string &line, int delim='\n') {
+            std::string_view v;
+            if(!next_line(v, delim)) {
+                line.clear();
+                return false;
+            }
+            line.assign(v.data(), v.size());
+            return true;
+        }
+        LineRange<Source> lines(int delim='\n') {return LineRange<Source>(this, delim);}
+        std::int64_t tell() const {return s().pos;}
+        // True once input is exhausted, which error() then tells apart from a failed read.
+        bool eof() const {return s().ended;}
+        bool error() const {return s().error;}
+        const std::string &path() const {return s().in.path();}
+    };
+
+    explicit MultiReader(const std::vector<std::string> &paths, const Options &opts=Options(), size_t max_memory=DEFAULT_MEMORY):
+        streams_(paths.size())
+    {
+        const size_t k = std::max<size_t>(paths.size(), 1);
+        bufsize_ = opts.buffer_size ? opts.buffer_size: std::clamp(max_memory / (2 * k), MIN_BUFSIZE, DEFAULT_BUFSIZE);
+        const size_t max_depth = opts.buffers > 0 ? opts.buffers: DEFAULT_BUFFERS;
+        depth_ = std::clamp<size_t>(max_memory / bufsize_ / k, 2, max_depth + 1) - 1;
+        // Nested pools would multiply threads by the number of files.
+        Options inner = opts;
+        inner.threads = -1;
+        for(size_t i = 0; i < paths.size(); ++i) {
+            streams_[i].in.open(paths[i].data(), "rb", inner);
+            sources_.emplace_back(this, i);
+        }
+        bufs_.resize(k * (depth_ + 1));
+        sizes_.resize(bufs_.size());
+        for(size_t b = bufs_.size(); b--; free_.push_back(b));
+        pool_ = std::make_unique<detail::ThreadPool>(detail::resolve_threads(opts.threads < 0 ? 0: opts.threads));
+        std::lock_guard<std::mutex> lock(mtx_);
+        schedule();
+    }
+    MultiReader(const MultiReader &) = delete;
+    MultiReader &operator=(const MultiReader &) = delete;
+    size_t size() const {return sources_.size();}
+    Source &operator[](size_t i) {return sources_[i];}
+    auto begin() {return sources_.begin();}
+    auto end() {return sources_.end();}
+    ~MultiReader() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        // Queued reads see stop_ and return at once.
+        pool_.reset();
+    }
+}; // MultiReader
+
+/*
+ * AnyFpWrapper selects a backend at open time: by magic bytes when reading, by extension
+ * (or an explicit Format) when writing. Calls dispatch through std::visit over the compiled-in
+ * FpWrapper alternatives, which is a jump table rather than a virtual call.
+ */
+class AnyFpWrapper {
+public:
+    using variant_type = std::variant<FpWrapper<std::FILE *>, FpWrapper<gzFile>, FpWrapper<BgzfFile *>, FpWrapper<GzipFile *>
+#if FP_USE_ZSTD
+        , FpWrapper<ZstdFile *>, FpWrapper<SeekableZstdFile *>
+#endif
+#if FP_USE_XZ
+        , FpWrapper<XzFile *>
+#endif
+#if FP_USE_BZ2
+        , FpWrapper<Bz2File *>
+#endif
+#if FP_USE_ISAL
+        , FpWrapper<IgzipFile *>
+#endif
+    >;
+private:
+    variant_type v_;
+    Format fmt_ = Format::plain;
+
+    template<typename PointerType>
+    void open_as(const char *path, const char *mode, const Options &opts) {
+        v_.template emplace<FpWrapper<PointerType>>(path, mode, opts);
+    }
+    // Src is std::string_view for reading and std::string * for writing.
+    template<typename PointerType, typename Src>
+    void memory_as(Src src, const char *mode, const Options &opts) {
+        v_.template emplace<FpWrapper<PointerType>>().open_memory(src, mode, opts);
+    }
+    template<typename Src>
+    void open_memory_as(Src src, Format fmt, const char *mode, const Options &opts) {
+        close();
+        switch(fmt) {
+            case Format::plain: memory_as<std::FILE *>(src, mode, opts); break;
+            case Format::bgzf:
+                // Every BGZF block is a gzip member, but writing BGZF needs BgzfFile.
+                if(std::is_pointer<Src>::value) throw std::runtime_error("BGZF cannot be written to memory");
+                [[fallthrough]];
+            case Format::gzip: memory_as<GzipFile *>(src, mode, opts); break;
+#if FP_USE_ZSTD
+            case Format::zstd: memory_as<ZstdFile *>(src, mode, opts); break;
+#endif
+#if FP_USE_XZ
+            case Format::xz: memory_as<XzFile *>(src, mode, opts); break;
+#endif
+#if FP_USE_BZ2
+            case Format::bzip2: memory_as<Bz2File *>(src, mode, opts); break;
+#endif
+            default:
+                throw std::runtime_error(std::string("Support for ") + format_name(fmt) + " was not compiled in");
+        }
+        fmt_ = fmt;
+    }
+#if FP_USE_ZSTD
+    static bool has_seek_table(const char *path) {
+        std::vector<SeekableZstdFile::Frame> frames;
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0) return false;
+        const bool ret = SeekableZstdFile::read_seek_table(fd, frames);
+        ::close(fd);
+        return ret;
+    }
+#endif
+public:
+    AnyFpWrapper() = default;
+    AnyFpWrapper(const char *path, const char *mode="rb") {this->open(path, mode);}
+    AnyFpWrapper(const std::string &path, const char *mode="rb"): AnyFpWrapper(path.data(), mode) {}
+    AnyFpWrapper(const char *path, const char *mode, Format fmt, const Options &opts=Options()) {this->open(path, mode, fmt, opts);}
+    AnyFpWrapper(const char *path, const char *mode, const Options &opts) {this->open(path, mode, opts);}
+    AnyFpWrapper(const AnyFpWrapper &) = delete;
+    AnyFpWrapper &operator=(const AnyFpWrapper &) = delete;
+    AnyFpWrapper(AnyFpWrapper &&) = default;
+    AnyFpWrapper &operator=(AnyFpWrapper &&) = default;
+
+    void open(const std::string &path, const char *mode="rb") {open(path.data(), mode);}
+    // Standard input ("-") cannot be peeked at, so it is read through gzFile, which passes plain data through.
+    void open(const char *path, const char *mode="rb", const Options &opts=Options()) {
+        const bool write = detail::parse_mode(mode).write;
+        const Format fmt = write ? format_from_extension(path): std::strcmp(path, "-") == 0 ? Format::gzip: detect_format(path);
+        open(path, mode, fmt, opts);
+    }
+    void open(const char *path, const char *mode, Format fmt, const Options &opts=Options()) {
+        close();
+        switch(fmt) {
+            case Format::plain: open_as<std::FILE *>(path, mode, opts); break;
+#if FP_USE_ISAL
+            // Reads get igzip's faster inflate; writes keep zlib's compression ratios.
+            case Format::gzip:
+                if(detail::parse_mode(mode).write || std::strcmp(path, "-") == 0) open_as<gzFile>(path, mode, opts);
+                else open_as<IgzipFile *>(path, mode, opts);
+                break;
+#else
+            case Format::gzip: open_as<gzFile>(path, mode, opts); break;
+#endif
+            case Format::bgzf: open_as<BgzfFile *>(path, mode, opts); break;
+#if FP_USE_ZSTD
+            case Format::zstd: {
+                // Written in the seekable format; read through the seek table when there is one.
+                const auto m = detail::parse_mode(mode);
+                if(m.write ? !m.append: has_seek_table(path)) open_as<SeekableZstdFile *>(path, mode, opts);
+                else open_as<ZstdFile *>(path, mode, opts);
+                break;
+            }
+#elif ZWRAP_USE_ZSTD
+            case Format::zstd: open_as<gzFile>(path, mode, opts); break; // zstd_zlibwrapper decodes zstd through gzFile
+#endif
+#if FP_USE_XZ
+            case Format::xz: open_as<XzFile *>(path, mode, opts); break;
+#endif
+#if FP_USE_BZ2
+            case Format::bzip2: open_as<Bz2File *>(path, mode, opts); break;
+#endif
+            default:
+                throw std::runtime_error(std::string("Support for ") + format_name(fmt) + " was not compiled in; could not open " + path);
+        }
+        fmt_ = fmt;
+    }
+    // Decodes a payload held in memory, detecting its format from the leading bytes.
+    void open_memory(std::string_view src, const char *mode="rb", const Options &opts=Options()) {
+        open_memory_as(src, detect_format(src.data(), src.size()), mode, opts);
+    }
+    void open_memory(std::string_view src, Format fmt, const char *mode="rb", const Options &opts=Options()) {
+        open_memory_as(src, fmt, mode, opts);
+    }
+    // Appends output in format fmt to *sink; it is complete after close().
+    void open_memory(std::string *sink, Format fmt, const char *mode="wb", const Options &opts=Options()) {
+        open_memory_as(sink, fmt, mode, opts);
+    }
+    Format format() const {return fmt_;}
+    template<typename Func>
+    decltype(auto) visit(Func &&func) {return std::visit(std::forward<Func>(func), v_);}
+    template<typename Func>
+    decltype(auto) visit(Func &&func) const {return std::visit(std::forward<Func>(func), v_);}
+
+    template<typename T>
+    std::int64_t read(T &val) {
+        return this->read(std::addressof(val), sizeof(T));
+    }
+    std::int64_t read(void *ptr, size_t nb) {
+        return visit([&](auto &w) -> std::int64_t {return w.read(ptr, nb);});
+    }
+    std::int64_t bulk_read(void *ptr, size_t nb) {
+        return visit([&](auto &w) -> std::int64_t {return w.bulk_read(ptr, nb);});
+    }
+    template<typename T>
+    std::int64_t read_array(T *data, size_t n, ByteOrder order=ByteOrder::native) {
+        return visit([&](auto &w) {return w.read_array(data, n, order);});
+    }
+    template<typename T>
+    std::int64_t write_array(const T *data, size_t n, ByteOrder order=ByteOrder::native) {
+        return visit([&](auto &w) {return w.write_array(data, n, order);});
+    }
+    template<typename T>
+    uninit_vector<T> read_vector(size_t n, ByteOrder order=ByteOrder::native) {
+        return visit([&](auto &w) {return w.template read_vector<T>(n, order);});
+    }
+    int getc() {
+        return visit([](auto &w) {return w.getc();});
+    }
+    bool next_line(std::string_view &line, int delim='\n') {
+        return visit([&](auto &w) {return w.next_line(line, delim);});
+    }
+    bool getline(std::string &line, int delim='\n') {
+        return visit([&](auto &w) {return w.getline(line, delim);});
+    }
+    LineRange<AnyFpWrapper> lines(int delim='\n') {return LineRange<AnyFpWrapper>(this, delim);}
+    std::int64_t write(const char *s) {return write(s, std::strlen(s));}
+    std::int64_t write(const void *buf, size_t nb) {
+        return visit([&](auto &w) -> std::int64_t {return w.write(buf, nb);});
+    }
+    std::int64_t writev(const struct iovec *iov, int iovcnt) {
+        return visit([&](auto &w) {return w.writev(iov, iovcnt);});
+    }
+    template<typename T, typename=std::enable_if_t<std::is_integral<T>::value>>
+    std::int64_t write_int(T v, int base=10) {
+        return visit([&](auto &w) {return w.write_int(v, base);});
+    }
+    std::int64_t write_double(double v) {
+        return visit([&](auto &w) {return w.write_double(v);});
+    }
+    std::int64_t write_double(double v, int precision, std::chars_format fmt=std::chars_format::fixed) {
+        return visit([&](auto &w) {return w.write_double(v, precision, fmt);});
+    }
+    std::int64_t readv(const struct iovec *iov, int iovcnt) {
+        return visit([&](auto &w) {return w.readv(iov, iovcnt);});
+    }
+    int vfprintf(const char *fmt, va_list ap) {
+        return visit([&](auto &w) {return w.vfprintf(fmt, ap);});
+    }
+    int fprintf(const char *fmt, ...) {
+        va_list va;
+        int ret;
+        va_start(va, fmt);
+        ret = this->vfprintf(fmt, va);
+        va_end(va);
+        return ret;
+    }
+    void seek(size_t pos, int mode=SEEK_SET) {
+        visit([&](auto &w) {w.seek(pos, mode);});
+    }
+    std::int64_t tell() const {
+        return visit([](const auto &w) -> std::int64_t {return w.tell();});
+    }
+    bool eof() const {
+        return visit([](const auto &w) -> bool {return w.eof();});
+    }
+    void resize_buffer(size_t newsz) {
+        visit([&](auto &w) {w.resize_buffer(newsz);});
+    }
+    bool is_open() const {
+        return visit([](const auto &w) {return w.is_open();});
+    }
+    IoStats stats() const {
+        return visit([](const auto &w) {return w.stats();});
+    }
+    std::string_view peek() {
+        return visit([](auto &w) {return w.peek();});
+    }
+    void consume(size_t n) {
+        visit([n](auto &w) {w.consume(n);});
+    }
+    const std::string &path() const {
+        return visit([](const auto &w) -> const std::string & {return w.path();});
+    }
+    void close() {
+        visit([](auto &w) {if(w.is_open()) w.close();});
+    }
+}; // AnyFpWrapper
+
+// Range [begin, end) of a file's decompressed data handed to one parallel_for_chunks() callback.
+struct Chunk {
+    size_t index;
+    std::uint64_t begin, end;
+    std::uint64_t size() const {return end - begin;}
+};
+
+namespace detail {
+
+// Chunks per worker, so uneven chunks still keep every worker busy.
+constexpr size_t CHUNKS_PER_THREAD = 4;
+
+// Groups consecutive units, given as (decompressed offset, size) pairs, into about nchunks chunks.
+template<typename Unit>
+inline std::vector<Chunk> group_units(const std::vector<Unit> &units, size_t nchunks) {
+    std::vector<Chunk> ret;
+    if(units.empty()) return ret;
+    const std::uint64_t total = units.back().first + units.back().second;
+    const std::uint64_t target = std::max<std::uint64_t>(1, total / nchunks);
+    for(size_t i = 0; i < units.size();) {
+        const std::uint64_t begin = units[i].first;
+        while(++i < units.size() && units[i].first - begin < target);
+        ret.push_back(Chunk{ret.size(), begin, i < units.size() ? units[i].first: total});
+    }
+    return ret;
+}
+
+template<typename Reader, typename Func, typename Position>
+inline void run_chunks(const char *path, const std::vector<Chunk> &chunks, unsigned nthreads, Func &fn, const Position &position) {
+    ThreadPool pool(std::min<size_t>(nthreads, chunks.size()));
+    std::vector<std::future<void>> results;
+    results.reserve(chunks.size());
+    for(const Chunk &c: chunks) {
+        results.push_back(pool.submit([path, c, &fn, &position] {
+            Reader r(path, "rb");
+            position(r, c);
+            fn(r, c);
+        }));
+    }
+    for(auto &f: results) f.get();
+}
+
+} // namespace detail
+
+/*
+ * Splits the file at path into chunks and calls fn(reader, chunk) for each on a pool of nthreads threads
+ * (0 for one per core). Each call gets its own reader positioned at chunk.begin, and should stop once
+ * reader.tell() reaches chunk.end.
+ * Plain files are read through FpWrapper<MmapFile *> and split after bytes for which is_boundary(c) holds.
+ * BGZF (FpWrapper<BgzfFile *>) and seekable zstd (FpWrapper<SeekableZstdFile *>) are split between
+ * blocks or frames, so records may straddle chunks. Other formats are handed whole to a single call with an
+ * AnyFpWrapper, with chunk.end set to UINT64_MAX.
+ * The first exception thrown by fn is rethrown once every chunk has finished.
+ */
+template<typename Func, typename Pred, typename=std::enable_if_t<std::is_invocable_r<bool, Pred, char>::value>>
+inline void parallel_for_chunks(const char *path, unsigned nthreads, Func &&fn, Pred is_boundary) {
+    if(!nthreads) nthreads = detail::resolve_threads(0);
+    const size_t nchunks = nthreads * detail::CHUNKS_PER_THREAD;
+    std::vector<Chunk> chunks;
+    switch(detect_format(path)) {
+        case Format::plain: {
+            MmapFile m;
+            if(!m.open_path(path)) throw std::runtime_error(std::string("Could not open file at ") + path);
+            const char *data = m.data();
+            const std::uint64_t size = m.size(), step = std::max<std::uint64_t>(1, size / nchunks);
+            for(std::uint64_t begin = 0; begin < size;) {
+                std::uint64_t end = size;
+                if(size - begin > step) {
+                    const char *q = std::find_if(data + begin + step, data + size, is_boundary);
+                    if(q != data + size) end = q - data + 1;
+                }
+                chunks.push_back(Chunk{chunks.size(), begin, end});
+                begin = end;
+            }
+            detail::run_chunks<FpWrapper<MmapFile *>>(path, chunks, nthreads, fn, [](auto &r, const Chunk &c) {r.seek(c.begin);});
+            return;
+        }
+        case Format::bgzf: {
+            std::vector<std::pair<std::uint64_t, std::uint64_t>> units; // Decompressed offset and size per block
+            std::vector<std::uint64_t> coffs;
+            bool ok = false;
+            if(const int fd = ::open(path, O_RDONLY | O_CLOEXEC); fd >= 0) {
+                struct stat st;
+                std::uint64_t uoff = 0;
+                ok = ::fstat(fd, &st) == 0 && detail::bgzf_walk(fd, st.st_size, [&](std::uint64_t coff, std::uint32_t isize) {
+                    units.emplace_back(uoff, isize);
+                    coffs.push_back(coff);
+                    uoff += isize;
+                });
+                ::close(fd);
+            }
+            if(!ok) break;
+            chunks = detail::group_units(units, nchunks);
+            // Map each chunk's start back to its block.
+            std::vector<std::uint64_t> starts(chunks.size());
+            for(size_t i = 0, j = 0; i < chunks.size(); ++i) {
+                while(units[j].first != chunks[i].begin) ++j;
+                starts[i] = coffs[j];
+            }
+            detail::run_chunks<FpWrapper<BgzfFile *>>(path, chunks, nthreads, fn, [&starts](auto &r, const Chunk &c) {
+                r.ptr()->seek_block(starts[c.index], c.begin);
+            });
+            return;
+        }
+#if FP_USE_ZSTD
+        case Format::zstd: {
+            std::vector<SeekableZstdFile::Frame> frames;
+            bool ok = false;
+            if(const int fd = ::open(path, O_RDONLY | O_CLOEXEC); fd >= 0) {
+                ok = SeekableZstdFile::read_seek_table(fd, frames);
+                ::close(fd);
+            }
+            if(!ok) break;
+            std::vector<std::pair<std::uint64_t, std::uint64_t>> units;
+            for(const auto &f: frames) units.emplace_back(f.doff, f.dsize);
+            chunks = detail::group_units(units, nchunks);
+            detail::run_chunks<FpWrapper<SeekableZstdFile *>>(path, chunks, nthreads, fn, [](auto &r, const Chunk &c) {r.seek(c.begin);});
+            return;
+        }
+#endif
+        default: break;
+    }
+    chunks.assign(1, Chunk{0, 0, UINT64_MAX});
+    detail::run_chunks<AnyFpWrapper>(path, chunks, 1, fn, [](auto &, const Chunk &) {});
+}
+
+// Splits plain files after delim.
+template<typename Func>
+inline void parallel_for_chunks(const char *path, unsigned nthreads, Func &&fn, int delim='\n') {
+    parallel_for_chunks(path, nthreads, std::forward<Func>(fn), [delim](char c) {return c == char(delim);});
+}
+
 } // namespace util
 
 #endif // FP_WRAP_H__
@@ -0,0 +1,70 @@
+#ifndef FP_TESTS_CHECK_H__
+#define FP_TESTS_CHECK_H__
+#include "fpwrap.h"
+#include <cstdio>
+#include <string>
+
+// Shared helpers for the tests. CHECK reports a failed condition and carries on; main() returns fptest::result().
+
+namespace fptest {
+
+inline int &failures() {
+    static int n = 0;
+    return n;
+}
+
+inline void check(bool ok, const char *expr, const char *file, int line) {
+    if(ok) return;
+    std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expr);
+    ++failures();
+}
+
+inline int result() {
+    if(failures()) std::fprintf(stderr, "%d check(s) failed\n", failures());
+    return failures() != 0;
+}
+
+// Tab-separated lines of numbers: compressible, but with no long exact repeats.
+inline std::string make_text(size_t n) {
+    std::string ret;
+    ret.reserve(n + 64);
+    char line[64];
+    for(unsigned row = 0; ret.size() < n; ++row)
+        ret.append(line, std::snprintf(line, sizeof(line), "%u\t%u\t%u\n", row, row * 7919 % 10007, row % 97));
+    ret.resize(n);
+    ret.back() = '\n';
+    return ret;
+}
+
+inline bool write_file(const char *path, const std::string &data) {
+    std::FILE *fp = std::fopen(path, "wb");
+    if(!fp) return false;
+    const bool ok = std::fwrite(data.data(), 1, data.size(), fp) == data.size();
+    return std::fclose(fp) == 0 && ok;
+}
+
+inline std::string read_file(const char *path) {
+    std::string ret;
+    if(std::FILE *fp = std::fopen(path, "rb")) {
+        char buf[1 << 16];
+        for(size_t n; (n = std::fread(buf, 1, sizeof(buf), fp)) > 0;) ret.append(buf, n);
+        std::fclose(fp);
+    }
+    return ret;
+}
+
+// Reads r to the end in chunk-sized calls. err is set if the last read failed.
+template<typename Reader>
+std::string read_all(Reader &r, bool *err=nullptr, size_t chunk=1 << 15) {
+    std::string ret, buf(chunk, '\0');
+    std::int64_t n;
+    while((n = std::int64_t(r.read(&buf[0], buf.size()))) > 0) ret.append(buf.data(), n);
+    if(err) *err = n < 0;
+    return ret;
+}
+
+} // namespace fptest
+
+#define CHECK(x) fptest::check(bool(x), #x, __FILE__, __LINE__)
+
+#endif // FP_TESTS_CHECK_H__
@@ -0,0 +1,47 @@
+// Compiled, never run, once per optional engine (FP_USE_ZSTD, FP_USE_LIBDEFLATE, FP_USE_ISAL) so those paths
+// keep building where the library itself is missing or not linked.
+#include "fpwrap.h"
+
+namespace {
+
+// The calls most code makes, which FpWrapper only instantiates on use.
+template<typename P>
+void use(const char *path) {
+    fp::FpWrapper<P> w(path, "wb");
+    w.write("abc", 3);
+    w.fprintf("%d", 1);
+    w.close();
+    fp::FpWrapper<P> r(path, "rb");
+    char buf[16];
+    r.read(buf, sizeof(buf));
+    r.getc();
+    std::string_view line;
+    r.next_line(line);
+    r.seek(1);
+    r.peek();
+    r.consume(1);
+    r.read_array(reinterpret_cast<std::uint32_t *>(buf), 4, fp::ByteOrder::big);
+}
+
+} // anonymous namespace
+
+void fp_compile_check() {
+    use<std::FILE *>("compile_check");
+    use<gzFile>("compile_check.gz");
+    use<fp::GzipFile *>("compile_check.gz");
+    use<fp::BgzfFile *>("compile_check.bgz");
+#if FP_USE_ZSTD
+    use<fp::ZstdFile *>("compile_check.zst");
+    use<fp::SeekableZstdFile *>("compile_check.zst");
+#endif
+#if FP_USE_ISAL
+    use<fp::IgzipFile *>("compile_check.gz");
+#endif
+    fp::FpWrapper<fp::IndexedGzFile *> indexed("compile_check.gz", "rb");
+    indexed.read(nullptr, 0);
+    std::string out;
+    fp::gzip_compress("abc", out);
+    fp::gzip_decompress(out, out);
+    fp::AnyFpWrapper any("compile_check.gz");
+    fp::parallel_for_chunks("compile_check.gz", 2, [](auto &r, const fp::Chunk &) {r.getc();});
+}
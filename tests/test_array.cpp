@@ -0,0 +1,110 @@
+// Typed bulk I/O: read_array/write_array/read_vector with byte order conversion.
+#include "check.h"
+#include <numeric>
+#include <stdexcept>
+
+using namespace fp;
+
+namespace {
+
+template<typename T>
+std::vector<T> iota_vector(size_t n) {
+    std::vector<T> ret(n);
+    for(size_t i = 0; i < n; ++i) ret[i] = T(i * 2654435761u);
+    return ret;
+}
+
+template<typename P, typename T>
+void roundtrip(const char *path, ByteOrder order) {
+    const std::vector<T> v = iota_vector<T>(300001);
+    {
+        FpWrapper<P> w(path, "wb");
+        CHECK(w.write_array(v, order) == std::int64_t(v.size()));
+    }
+    {
+        FpWrapper<P> r(path, "rb");
+        auto got = r.template read_vector<T>(v.size() + 10, order);
+        CHECK(got.size() == v.size());
+        CHECK(std::equal(got.begin(), got.end(), v.begin()));
+        CHECK(r.eof());
+    }
+    // Big-endian data as written holds the most significant byte first.
+    if(order == ByteOrder::big && sizeof(T) > 1) {
+        FpWrapper<P> r(path, "rb");
+        unsigned char first[sizeof(T)];
+        CHECK(std::int64_t(r.read(first, sizeof(T))) == std::int64_t(sizeof(T)));
+        const T one = v[1];
+        unsigned char be[sizeof(T)];
+        std::memcpy(be, &one, sizeof(T));
+        if(detail::needs_swap(ByteOrder::big)) std::reverse(be, be + sizeof(T));
+        r.seek(sizeof(T));
+        CHECK(std::int64_t(r.read(first, sizeof(T))) == std::int64_t(sizeof(T)));
+        CHECK(std::memcmp(first, be, sizeof(T)) == 0);
+    }
+    std::remove(path);
+}
+
+struct Pair {
+    std::uint32_t a, b;
+};
+
+// Conversions that cannot be done are refused before anything is read or written.
+template<typename P>
+void unswappable(const char *path) {
+    const std::vector<Pair> v(100, Pair{1, 2});
+    {
+        FpWrapper<P> w(path, "wb");
+        bool thrown = false;
+        try {
+            w.write_array(v.data(), v.size(), ByteOrder::big);
+        } catch(const std::invalid_argument &) {
+            thrown = true;
+        }
+        CHECK(thrown);
+        CHECK(w.tell() == 0);
+        CHECK(w.write_array(v.data(), v.size()) == std::int64_t(v.size()));
+    }
+    FpWrapper<P> r(path, "rb");
+    std::vector<Pair> got(v.size());
+    bool thrown = false;
+    try {
+        r.read_array(got.data(), got.size(), ByteOrder::big);
+    } catch(const std::invalid_argument &) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    CHECK(r.tell() == 0);
+    CHECK(r.read_array(got.data(), got.size()) == std::int64_t(got.size()));
+    CHECK(got[99].a == 1 && got[99].b == 2);
+    std::remove(path);
+}
+
+// A partial element at end of input is consumed but not counted.
+void partial_element() {
+    fptest::write_file("array.partial", std::string(4 * 10 + 3, 'x'));
+    FpWrapper<std::FILE *> r("array.partial", "rb");
+    std::uint32_t buf[20];
+    CHECK(r.read_array(buf, 20) == 10);
+    CHECK(r.read_array(buf, 20) == 0);
+    std::remove("array.partial");
+}
+
+} // anonymous namespace
+
+int main() {
+    for(ByteOrder order: {ByteOrder::native, ByteOrder::little, ByteOrder::big}) {
+        roundtrip<std::FILE *, std::uint16_t>("array.u16", order);
+        roundtrip<std::FILE *, std::uint32_t>("array.u32", order);
+        roundtrip<std::FILE *, double>("array.f64", order);
+        roundtrip<gzFile, std::int64_t>("array.i64.gz", order);
+        roundtrip<GzipFile *, std::uint32_t>("array.u32.gzf", order);
+#if FP_USE_ZSTD
+        roundtrip<ZstdFile *, float>("array.f32.zst", order);
+#endif
+    }
+    roundtrip<std::FILE *, std::uint8_t>("array.u8", ByteOrder::big);
+    unswappable<std::FILE *>("array.pair");
+    unswappable<GzipFile *>("array.pair.gz");
+    partial_element();
+    return fptest::result();
+}
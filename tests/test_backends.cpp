@@ -0,0 +1,239 @@
+// Round trip and seeks for each backend: write through W, read back through P.
+#include "check.h"
+
+using namespace fp;
+using fptest::make_text;
+using fptest::read_all;
+
+namespace {
+
+const std::string DATA = make_text(400000);
+
+template<typename W>
+void write_data(const char *path, const Options &opts) {
+    FpWrapper<W> w(path, "wb", opts);
+    CHECK(std::int64_t(w.write(DATA.data(), 1000)) == 1000);
+    CHECK(w.fprintf("%.*s", 500, DATA.data() + 1000) == 500);
+    const struct iovec iov[2] = {{const_cast<char *>(DATA.data() + 1500), 100}, {const_cast<char *>(DATA.data() + 1600), 400}};
+    CHECK(w.writev(iov, 2) == 500);
+    CHECK(std::int64_t(w.write(DATA.data() + 2000, DATA.size() - 2000)) == std::int64_t(DATA.size() - 2000));
+    CHECK(w.close() == 0);
+}
+
+template<typename P, typename W=P>
+void roundtrip(const char *path, const Options &opts=Options()) {
+    write_data<W>(path, opts);
+    {
+        FpWrapper<P> r(path, "rb", opts);
+        CHECK(read_all(r) == DATA);
+        CHECK(r.eof());
+        // Forward, backward and repeated seeks.
+        for(size_t off: {size_t(5), size_t(300000), size_t(17), DATA.size() - 1, size_t(0), size_t(123456)}) {
+            r.seek(off);
+            CHECK(std::uint64_t(r.tell()) == off);
+            CHECK(r.getc() == static_cast<unsigned char>(DATA[off]));
+            CHECK(std::uint64_t(r.tell()) == off + 1);
+        }
+    }
+    {
+        FpWrapper<P> r(path, "rb", opts);
+        size_t lines = 0, bytes = 0;
+        for(std::string_view line: r.lines()) bytes += line.size() + 1, ++lines;
+        CHECK(lines == size_t(std::count(DATA.begin(), DATA.end(), '\n')));
+        CHECK(bytes == DATA.size());
+    }
+    {
+        FpWrapper<P> r(path, "rb", opts);
+        std::string got;
+        for(std::string_view v; !(v = r.peek()).empty();) {
+            const size_t take = std::min<size_t>(v.size(), 4097);
+            got.append(v.data(), take);
+            r.consume(take);
+        }
+        CHECK(got == DATA);
+    }
+    CHECK(get_fsz<P>(path) == DATA.size());
+    std::remove(path);
+}
+
+// Backends that adopt a descriptor take ownership of it on success.
+template<typename P>
+void dopen_roundtrip(const char *path) {
+    {
+        const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        FpWrapper<P> w(fd, "wb");
+        CHECK(std::int64_t(w.write(DATA.data(), DATA.size())) == std::int64_t(DATA.size()));
+        CHECK(w.close() == 0);
+    }
+    const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    FpWrapper<P> r(fd, "rb");
+    CHECK(read_all(r) == DATA);
+    r.close();
+    std::remove(path);
+}
+
+template<typename P>
+void memory_roundtrip() {
+    std::string sink;
+    {
+        FpWrapper<P> w;
+        w.open_memory(&sink, "wb");
+        CHECK(std::int64_t(w.write(DATA.data(), DATA.size())) == std::int64_t(DATA.size()));
+        CHECK(w.close() == 0);
+    }
+    FpWrapper<P> r;
+    r.open_memory(std::string_view(sink), "rb");
+    CHECK(read_all(r) == DATA);
+}
+
+// reset() keeps the backend across files.
+template<typename P>
+void reset_roundtrip(const char *path) {
+    write_data<P>(path, Options());
+    FpWrapper<P> r(path, "rb");
+    for(int i = 0; i < 3; ++i) {
+        r.reset(path, "rb");
+        CHECK(read_all(r, nullptr, 1000) == DATA);
+    }
+    std::remove(path);
+}
+
+// Empty files read as empty, and reads past the end return 0.
+template<typename P, typename W=P>
+void empty_roundtrip(const char *path) {
+    {
+        FpWrapper<W> w(path, "wb");
+        CHECK(w.close() == 0);
+    }
+    FpWrapper<P> r(path, "rb");
+    char buf[16];
+    CHECK(std::int64_t(r.read(buf, sizeof(buf))) == 0);
+    CHECK(std::int64_t(r.read(buf, sizeof(buf))) == 0);
+    CHECK(r.getc() == EOF);
+    CHECK(r.peek().empty());
+    std::string_view line;
+    CHECK(!r.next_line(line));
+    CHECK(r.eof());
+    std::remove(path);
+}
+
+void any_roundtrip(const char *path, Format expected) {
+    {
+        AnyFpWrapper w(path, "wb");
+        CHECK(w.write(DATA.data(), DATA.size()) == std::int64_t(DATA.size()));
+    }
+    AnyFpWrapper r(path);
+    CHECK(r.format() == expected);
+    CHECK(read_all(r) == DATA);
+    r.seek(4321);
+    CHECK(r.getc() == static_cast<unsigned char>(DATA[4321]));
+    std::remove(path);
+}
+
+#if FP_USE_XZ
+// Contexts come back from the pool set up for whatever file used them last, here a smaller preset.
+void pooled_xz() {
+    const std::string big = make_text(4 << 20);
+    const char *paths[] = {"backends.pool1.xz", "backends.pool6.xz", "backends.pool0.xz"};
+    const int levels[] = {1, 6, 0};
+    for(int i = 0; i < 3; ++i) {
+        Options opts;
+        opts.level = levels[i];
+        opts.threads = i < 2 ? 4: -1;
+        FpWrapper<XzFile *> w(paths[i], "wb", opts);
+        CHECK(std::int64_t(w.write(big.data(), big.size())) == std::int64_t(big.size()));
+        CHECK(w.close() == 0);
+    }
+    for(const char *path: paths) {
+        FpWrapper<XzFile *> r(path, "rb");
+        CHECK(read_all(r) == big);
+        std::remove(path);
+    }
+}
+#endif
+
+// Capabilities follow what each backend really runs on worker threads.
+static_assert(BackendTraits<BgzfFile *>::parallel);
+static_assert(BackendTraits<ReadAheadFile<std::FILE *> *>::parallel_read);
+static_assert(!BackendTraits<ReadAheadFile<std::FILE *> *>::parallel_write);
+static_assert(BackendTraits<WriteBehindFile<std::FILE *> *>::parallel_write);
+static_assert(!BackendTraits<WriteBehindFile<std::FILE *> *>::parallel);
+static_assert(!BackendTraits<GzipFile *>::parallel_read && !BackendTraits<GzipFile *>::parallel_write);
+static_assert(!BackendTraits<gzFile>::parallel_write && !BackendTraits<std::FILE *>::parallel_write);
+#if FP_USE_ZSTD
+static_assert(BackendTraits<ZstdFile *>::parallel_write && !BackendTraits<ZstdFile *>::parallel_read);
+#endif
+#if FP_USE_XZ
+static_assert(BackendTraits<XzFile *>::parallel_write && !BackendTraits<XzFile *>::parallel_read);
+#endif
+
+} // anonymous namespace
+
+int main() {
+    Options mt;
+    mt.threads = 2;
+    roundtrip<std::FILE *>("backends.txt");
+    roundtrip<gzFile>("backends.gz");
+    roundtrip<GzipFile *>("backends.gzf.gz");
+    roundtrip<BgzfFile *>("backends.bgz");
+    roundtrip<BgzfFile *>("backends.mt.bgz", mt);
+    roundtrip<IndexedGzFile *, gzFile>("backends.igz.gz");
+    roundtrip<MmapFile *, std::FILE *>("backends.mm");
+    roundtrip<DirectFile *>("backends.dio");
+    roundtrip<ReadAheadFile<GzipFile *> *, GzipFile *>("backends.ra.gz");
+    roundtrip<GzipFile *, WriteBehindFile<GzipFile *> *>("backends.wb.gz");
+#if FP_USE_URING
+    roundtrip<UringFile *, std::FILE *>("backends.uring");
+#endif
+#if FP_USE_ZSTD
+    roundtrip<ZstdFile *>("backends.zst");
+    roundtrip<ZstdFile *>("backends.mt.zst", mt);
+    roundtrip<SeekableZstdFile *>("backends.seekable.zst");
+#endif
+#if FP_USE_XZ
+    roundtrip<XzFile *>("backends.xz");
+    roundtrip<XzFile *>("backends.mt.xz", mt);
+    pooled_xz();
+#endif
+#if FP_USE_BZ2
+    roundtrip<Bz2File *>("backends.bz2");
+#endif
+
+    dopen_roundtrip<std::FILE *>("backends.fd.txt");
+    dopen_roundtrip<gzFile>("backends.fd.gz");
+    dopen_roundtrip<GzipFile *>("backends.fd.gzf");
+    dopen_roundtrip<BgzfFile *>("backends.fd.bgz");
+
+    memory_roundtrip<GzipFile *>();
+#if FP_USE_ZSTD
+    memory_roundtrip<ZstdFile *>();
+#endif
+#if FP_USE_XZ
+    memory_roundtrip<XzFile *>();
+#endif
+#if FP_USE_BZ2
+    memory_roundtrip<Bz2File *>();
+#endif
+
+    empty_roundtrip<std::FILE *>("backends.empty.txt");
+    empty_roundtrip<MmapFile *, std::FILE *>("backends.empty.mm");
+    empty_roundtrip<GzipFile *>("backends.empty.gz");
+    empty_roundtrip<BgzfFile *>("backends.empty.bgz");
+    empty_roundtrip<DirectFile *>("backends.empty.dio");
+
+    reset_roundtrip<std::FILE *>("backends.reset.txt");
+    reset_roundtrip<GzipFile *>("backends.reset.gz");
+
+    any_roundtrip("backends.any.txt", Format::plain);
+    any_roundtrip("backends.any.gz", Format::gzip);
+#if FP_USE_ZSTD
+    any_roundtrip("backends.any.zst", Format::zstd);
+#endif
+#if FP_USE_XZ
+    any_roundtrip("backends.any.xz", Format::xz);
+#endif
+#if FP_USE_BZ2
+    any_roundtrip("backends.any.bz2", Format::bzip2);
+#endif
+    return fptest::result();
+}
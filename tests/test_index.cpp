@@ -0,0 +1,142 @@
+// Random access: IndexedGzFile access points and sidecars, BGZF blocks, seekable zstd frames and get_fsz.
+#include "check.h"
+#include <random>
+
+using namespace fp;
+using fptest::make_text;
+using fptest::read_all;
+
+namespace {
+
+const std::string DATA = make_text(3 << 20);
+
+template<typename W>
+void write_data(const char *path, const Options &opts=Options()) {
+    FpWrapper<W> w(path, "wb", opts);
+    CHECK(std::int64_t(w.write(DATA.data(), DATA.size())) == std::int64_t(DATA.size()));
+    CHECK(w.close() == 0);
+}
+
+// Reads 100 bytes at random offsets, then at offsets relative to the end.
+template<typename Reader>
+void random_reads(Reader &r) {
+    std::mt19937_64 rng(7);
+    char buf[100];
+    for(int i = 0; i < 40; ++i) {
+        const std::uint64_t off = rng() % DATA.size();
+        r.seek(off);
+        CHECK(std::uint64_t(r.tell()) == off);
+        const size_t want = std::min<size_t>(sizeof(buf), DATA.size() - off);
+        CHECK(std::int64_t(r.read(buf, sizeof(buf))) == std::int64_t(want));
+        CHECK(DATA.compare(off, want, buf, want) == 0);
+    }
+}
+
+void indexed_gzip() {
+    Options opts;
+    opts.index_span = 256 << 10;
+    write_data<gzFile>("index.gz");
+    {
+        FpWrapper<IndexedGzFile *> r("index.gz", "rb", opts);
+        random_reads(r);
+        CHECK(r.ptr()->build_index() == 0);
+        CHECK(r.ptr()->index().complete());
+        CHECK(r.ptr()->index().total_out() == DATA.size());
+        CHECK(r.ptr()->index().size() >= DATA.size() / opts.index_span / 2);
+        r.seek(-10, SEEK_END);
+        CHECK(r.tell() == std::int64_t(DATA.size() - 10));
+        CHECK(read_all(r) == DATA.substr(DATA.size() - 10));
+        CHECK(r.ptr()->save_index() == 0);
+    }
+    {
+        // The sidecar is picked up on open, so the size is known before reading anything.
+        FpWrapper<IndexedGzFile *> r("index.gz", "rb", opts);
+        CHECK(r.ptr()->index().complete());
+        CHECK(r.ptr()->index().total_out() == DATA.size());
+        random_reads(r);
+    }
+    CHECK(get_fsz<IndexedGzFile *>("index.gz") == DATA.size());
+    // A sidecar for a different file is ignored.
+    write_data<gzFile>("index.gz");
+    {
+        FpWrapper<IndexedGzFile *> r("index.gz", "rb", opts);
+        random_reads(r);
+    }
+    std::remove("index.gz.fpgzi");
+    std::remove("index.gz");
+}
+
+void bgzf() {
+    write_data<BgzfFile *>("index.bgz");
+    {
+        FpWrapper<BgzfFile *> r("index.bgz", "rb");
+        random_reads(r);
+    }
+    Options mt;
+    mt.threads = 2;
+    {
+        FpWrapper<BgzfFile *> r("index.bgz", "rb", mt);
+        random_reads(r);
+    }
+    CHECK(get_fsz<BgzfFile *>("index.bgz") == DATA.size());
+    CHECK(get_fsz<gzFile>("index.bgz") == DATA.size());
+    std::remove("index.bgz");
+}
+
+void sizes() {
+    write_data<gzFile>("index.fsz.gz");
+    CHECK(get_fsz<gzFile>("index.fsz.gz", FszMode::fast) == DATA.size());
+    CHECK(get_fsz<gzFile>("index.fsz.gz", FszMode::exact) == DATA.size());
+    CHECK(get_fsz<GzipFile *>("index.fsz.gz") == DATA.size());
+    std::remove("index.fsz.gz");
+    write_data<std::FILE *>("index.fsz.txt");
+    CHECK(get_fsz<std::FILE *>("index.fsz.txt") == DATA.size());
+    CHECK(get_fsz<gzFile>("index.fsz.txt") == DATA.size());
+    CHECK(get_fsz<MmapFile *>("index.fsz.txt") == DATA.size());
+    std::remove("index.fsz.txt");
+    // gzFile reads other compressed formats as they are, so their size is the file's.
+    const std::string zstd_magic("\x28\xb5\x2f\xfd", 4);
+    fptest::write_file("index.fsz.zst", zstd_magic + std::string(100, 'z'));
+    for(FszMode mode: {FszMode::fast, FszMode::exact}) {
+        CHECK(get_fsz<gzFile>("index.fsz.zst", mode) == 104);
+        FpWrapper<gzFile> r("index.fsz.zst", "rb");
+        CHECK(read_all(r).size() == 104);
+    }
+    std::remove("index.fsz.zst");
+}
+
+#if FP_USE_ZSTD
+void seekable_zstd() {
+    Options opts;
+    opts.index_span = 100 << 10;
+    write_data<SeekableZstdFile *>("index.szst", opts);
+    std::vector<SeekableZstdFile::Frame> frames;
+    const int fd = ::open("index.szst", O_RDONLY | O_CLOEXEC);
+    CHECK(SeekableZstdFile::read_seek_table(fd, frames));
+    ::close(fd);
+    CHECK(frames.size() >= DATA.size() / opts.index_span);
+    {
+        FpWrapper<SeekableZstdFile *> r("index.szst", "rb");
+        random_reads(r);
+    }
+    // Plain zstd readers see an ordinary multi-frame file.
+    {
+        FpWrapper<ZstdFile *> r("index.szst", "rb");
+        CHECK(read_all(r) == DATA);
+    }
+    CHECK(get_fsz<SeekableZstdFile *>("index.szst") == DATA.size());
+    std::remove("index.szst");
+}
+#endif
+
+} // anonymous namespace
+
+int main() {
+    indexed_gzip();
+    bgzf();
+    sizes();
+#if FP_USE_ZSTD
+    seekable_zstd();
+#endif
+    return fptest::result();
+}
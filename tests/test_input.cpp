@@ -0,0 +1,176 @@
+// Multi-member gzip, trailing garbage and truncated or corrupt input.
+#include "check.h"
+
+using namespace fp;
+using fptest::make_text;
+using fptest::read_all;
+
+namespace {
+
+const std::string DATA = make_text(60000);
+
+std::string gzip_member(const std::string &s) {
+    std::string ret;
+    CHECK(gzip_compress(s, ret));
+    return ret;
+}
+
+// gzread ends truncated input with a short read rather than -1, leaving Z_BUF_ERROR for gzerror().
+template<typename P>
+bool backend_error(FpWrapper<P> &) {return false;}
+bool backend_error(FpWrapper<gzFile> &r) {
+    int errnum = Z_OK;
+    gzerror(r.ptr(), &errnum);
+    return errnum != Z_OK;
+}
+
+// Reads path to the end through P; returns the bytes read and whether reading failed.
+template<typename P>
+std::string read_path(const char *path, bool &err) {
+    FpWrapper<P> r(path, "rb");
+    std::string ret = read_all(r, &err);
+    err = err || backend_error(r);
+    return ret;
+}
+
+template<typename P>
+void expect_clean(const char *path, const std::string &expected) {
+    bool err = true;
+    CHECK(read_path<P>(path, err) == expected);
+    CHECK(!err);
+}
+
+template<typename P>
+void expect_error(const char *path) {
+    bool err = false;
+    read_path<P>(path, err);
+    CHECK(err);
+}
+
+void multi_member() {
+    const std::string a = DATA.substr(0, 25000), b = DATA.substr(25000);
+    fptest::write_file("input.multi.gz", gzip_member(a) + gzip_member(b));
+    expect_clean<gzFile>("input.multi.gz", DATA);
+    expect_clean<GzipFile *>("input.multi.gz", DATA);
+    expect_clean<IndexedGzFile *>("input.multi.gz", DATA);
+    // An empty member in between changes nothing.
+    fptest::write_file("input.empty-member.gz", gzip_member(a) + gzip_member("") + gzip_member(b));
+    expect_clean<GzipFile *>("input.empty-member.gz", DATA);
+    expect_clean<IndexedGzFile *>("input.empty-member.gz", DATA);
+    AnyFpWrapper any("input.multi.gz");
+    CHECK(read_all(any) == DATA);
+    std::remove("input.multi.gz");
+    std::remove("input.empty-member.gz");
+}
+
+// Bytes after the last member that do not start another one are ignored, as gzread does.
+void trailing_garbage() {
+    const std::string member = gzip_member(DATA);
+    fptest::write_file("input.garbage.gz", member + "GARBAGE trailing\n");
+    fptest::write_file("input.one-byte.gz", member + "\x1f");
+    for(const char *path: {"input.garbage.gz", "input.one-byte.gz"}) {
+        expect_clean<gzFile>(path, DATA);
+        expect_clean<GzipFile *>(path, DATA);
+        expect_clean<IndexedGzFile *>(path, DATA);
+    }
+    // The check after a member must work when the next bytes straddle input buffers.
+    for(size_t bufsize = 1; bufsize <= 64; ++bufsize) {
+        std::unique_ptr<GzipFile> g(GzipFile::open("input.garbage.gz", "rb"));
+        CHECK(g && g->buffer(bufsize) == 0);
+        bool err = true;
+        CHECK(read_all(*g, &err, 777) == DATA);
+        CHECK(!err);
+    }
+    std::remove("input.garbage.gz");
+    std::remove("input.one-byte.gz");
+}
+
+// A gzip header followed by corrupt deflate data is an error, not the end of the file.
+void corrupt_member() {
+    std::string bad = gzip_member(DATA);
+    bad[10] = '\xff'; // First block header: reserved block type
+    fptest::write_file("input.corrupt.gz", gzip_member(DATA) + bad);
+    expect_error<gzFile>("input.corrupt.gz");
+    expect_error<GzipFile *>("input.corrupt.gz");
+    expect_error<IndexedGzFile *>("input.corrupt.gz");
+    for(size_t bufsize = 1; bufsize <= 32; ++bufsize) {
+        std::unique_ptr<GzipFile> g(GzipFile::open("input.corrupt.gz", "rb"));
+        CHECK(g && g->buffer(bufsize) == 0);
+        bool err = false;
+        read_all(*g, &err, 777);
+        CHECK(err);
+    }
+    std::remove("input.corrupt.gz");
+}
+
+template<typename P>
+void truncated(const char *path) {
+    {
+        FpWrapper<P> w(path, "wb");
+        w.write(DATA.data(), DATA.size());
+    }
+    const std::string whole = fptest::read_file(path);
+    CHECK(whole.size() > 64);
+    fptest::write_file(path, whole.substr(0, whole.size() / 2));
+    expect_error<P>(path);
+    // Losing only the end of the trailer is caught too.
+    fptest::write_file(path, whole.substr(0, whole.size() - 3));
+    expect_error<P>(path);
+    std::remove(path);
+}
+
+// Records before a read error come back whole; the one the error cuts short does not.
+template<typename Reader>
+void truncated_lines(Reader &r) {
+    size_t pos = 0;
+    for(std::string_view line; r.next_line(line); pos += line.size() + 1)
+        CHECK(DATA.compare(pos, line.size() + 1, std::string(line) + '\n') == 0);
+    CHECK(pos > 0 && pos < DATA.size());
+}
+
+void truncated_records() {
+    {
+        FpWrapper<GzipFile *> w("input.lines.gz", "wb");
+        w.write(DATA.data(), DATA.size());
+    }
+    const std::string whole = fptest::read_file("input.lines.gz");
+    fptest::write_file("input.lines.gz", whole.substr(0, whole.size() / 2));
+    {
+        FpWrapper<GzipFile *> r("input.lines.gz", "rb");
+        truncated_lines(r);
+    }
+    MultiReader<GzipFile *> m({"input.lines.gz"});
+    truncated_lines(m[0]);
+    CHECK(m[0].error());
+    std::remove("input.lines.gz");
+}
+
+} // anonymous namespace
+
+int main() {
+    multi_member();
+    trailing_garbage();
+    corrupt_member();
+    truncated_records();
+    truncated<gzFile>("input.trunc.gz");
+    truncated<GzipFile *>("input.trunc.gzf");
+    truncated<BgzfFile *>("input.trunc.bgz");
+#if FP_USE_ZSTD
+    truncated<ZstdFile *>("input.trunc.zst");
+#endif
+#if FP_USE_XZ
+    truncated<XzFile *>("input.trunc.xz");
+#endif
+#if FP_USE_BZ2
+    truncated<Bz2File *>("input.trunc.bz2");
+#endif
+    {
+        FpWrapper<gzFile> w("input.trunc.igz", "wb");
+        w.write(DATA.data(), DATA.size());
+    }
+    const std::string whole = fptest::read_file("input.trunc.igz");
+    fptest::write_file("input.trunc.igz", whole.substr(0, whole.size() / 2));
+    expect_error<IndexedGzFile *>("input.trunc.igz");
+    std::remove("input.trunc.igz");
+    return fptest::result();
+}
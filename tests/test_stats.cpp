@@ -0,0 +1,39 @@
+// I/O counters, built with FP_STATS.
+#define FP_STATS 1
+#include "check.h"
+
+using namespace fp;
+using fptest::make_text;
+
+namespace {
+
+const std::string DATA = make_text(500000);
+
+// bytes_read counts what the caller was given, however much more consume() asked for.
+template<typename P, typename W=P>
+void consumed(const char *path) {
+    {
+        FpWrapper<W> w(path, "wb");
+        w.write(DATA.data(), DATA.size());
+    }
+    FpWrapper<P> r(path, "rb");
+    size_t total = 0;
+    for(std::string_view v; !(v = r.peek()).empty(); total += v.size()) r.consume(v.size() + 12345);
+    CHECK(total == DATA.size());
+    CHECK(r.stats().bytes_read == DATA.size());
+    std::remove(path);
+}
+
+} // anonymous namespace
+
+int main() {
+    static_assert(FpWrapper<GzipFile *>::traits::zero_copy);
+    consumed<GzipFile *>("stats.gz");
+    consumed<BgzfFile *>("stats.bgz");
+    consumed<MmapFile *, std::FILE *>("stats.mm");
+    consumed<std::FILE *>("stats.txt");
+#if FP_USE_ZSTD
+    consumed<ZstdFile *>("stats.zst");
+#endif
+    return fptest::result();
+}
@@ -0,0 +1,211 @@
+// Background and parallel readers and writers: ThreadPool, SpscRing, ReadAheadFile, WriteBehindFile,
+// parallel_for_chunks and MultiReader.
+#include "check.h"
+
+using namespace fp;
+using fptest::make_text;
+using fptest::read_all;
+
+namespace {
+
+const std::string DATA = make_text(1 << 20);
+
+template<typename W>
+void write_data(const char *path, const std::string &data=DATA, const Options &opts=Options()) {
+    FpWrapper<W> w(path, "wb", opts);
+    CHECK(std::int64_t(w.write(data.data(), data.size())) == std::int64_t(data.size()));
+    CHECK(w.close() == 0);
+}
+
+void thread_pool() {
+    detail::ThreadPool pool(3);
+    CHECK(pool.size() == 3);
+    std::vector<std::future<size_t>> results;
+    for(size_t i = 0; i < 100; ++i) results.push_back(pool.submit([i] {return i * i;}));
+    for(size_t i = 0; i < results.size(); ++i) CHECK(results[i].get() == i * i);
+    auto thrown = pool.submit([]() -> int {throw std::runtime_error("task");});
+    bool caught = false;
+    try {
+        thrown.get();
+    } catch(const std::runtime_error &) {
+        caught = true;
+    }
+    CHECK(caught);
+}
+
+// Every item published before close() is still handed to the consumer.
+void spsc_ring() {
+    for(int round = 0; round < 200; ++round) {
+        detail::SpscRing<int> ring(2);
+        const int n = round % 7 + 1;
+        std::thread producer([&] {
+            for(int i = 0; i < n; ++i) {
+                int *slot = ring.acquire_empty();
+                if(!slot) return;
+                *slot = i;
+                ring.publish();
+            }
+            ring.close();
+        });
+        int expected = 0;
+        while(int *slot = ring.acquire_full()) {
+            CHECK(*slot == expected);
+            ++expected;
+            ring.release();
+        }
+        producer.join();
+        CHECK(expected == n);
+    }
+}
+
+void read_ahead() {
+    write_data<GzipFile *>("threads.ra.gz");
+    Options opts;
+    opts.buffers = 2;
+    opts.buffer_size = 4096;
+    // Small buffers keep the producer and consumer racing for the ring, including at end of input.
+    for(int i = 0; i < 50; ++i) {
+        FpWrapper<ReadAheadFile<GzipFile *> *> r("threads.ra.gz", "rb", opts);
+        bool err = true;
+        CHECK(read_all(r, &err, 1000 + 37 * i) == DATA);
+        CHECK(!err);
+        CHECK(r.eof());
+    }
+    {
+        FpWrapper<ReadAheadFile<GzipFile *> *> r("threads.ra.gz", "rb", opts);
+        std::string line;
+        size_t lines = 0;
+        while(r.getline(line)) ++lines;
+        CHECK(lines == size_t(std::count(DATA.begin(), DATA.end(), '\n')));
+        CHECK(r.close() == 0);
+    }
+    // A read error in the reader thread is reported again by close().
+    const std::string whole = fptest::read_file("threads.ra.gz");
+    fptest::write_file("threads.ra.gz", whole.substr(0, whole.size() / 2));
+    {
+        FpWrapper<ReadAheadFile<GzipFile *> *> r("threads.ra.gz", "rb", opts);
+        bool err = false;
+        read_all(r, &err);
+        CHECK(err);
+        CHECK(r.close() != 0);
+    }
+    std::remove("threads.ra.gz");
+}
+
+// Failures in the writer thread, or when the underlying stream flushes at close, reach the caller.
+template<typename P>
+void write_behind_full() {
+    FpWrapper<WriteBehindFile<P> *> w("/dev/full", "wb");
+    w.write(DATA.data(), DATA.size());
+    CHECK(w.close() != 0);
+}
+
+void write_behind() {
+    write_data<WriteBehindFile<std::FILE *> *>("threads.wb.txt");
+    CHECK(fptest::read_file("threads.wb.txt") == DATA);
+    std::remove("threads.wb.txt");
+    write_behind_full<std::FILE *>();
+    write_behind_full<gzFile>();
+    write_behind_full<GzipFile *>();
+    {
+        // Small writes that stay in the underlying stream's buffer only fail at close.
+        FpWrapper<WriteBehindFile<std::FILE *> *> w("/dev/full", "wb");
+        w.write("0123456789", 10);
+        CHECK(w.flush() != 0 || w.close() != 0);
+    }
+}
+
+template<typename Reader>
+void read_chunk(Reader &r, const Chunk &c, std::vector<std::string> &out) {
+    std::string &s = out.at(c.index);
+    char buf[4096];
+    while(std::uint64_t(r.tell()) < c.end) {
+        const std::int64_t n = r.read(buf, std::min<std::uint64_t>(sizeof(buf), c.end - r.tell()));
+        if(n <= 0) break;
+        s.append(buf, n);
+    }
+}
+
+template<typename W>
+void chunks(const char *path) {
+    write_data<W>(path);
+    std::vector<std::string> parts(64);
+    std::mutex mtx;
+    size_t calls = 0;
+    parallel_for_chunks(path, 3, [&](auto &r, const Chunk &c) {
+        read_chunk(r, c, parts);
+        std::lock_guard<std::mutex> lock(mtx);
+        ++calls;
+    });
+    std::string joined;
+    for(const auto &p: parts) joined += p;
+    CHECK(joined == DATA);
+    CHECK(calls > 0);
+    std::remove(path);
+}
+
+void plain_chunk_boundaries() {
+    write_data<std::FILE *>("threads.lines.txt");
+    std::atomic<bool> aligned{true};
+    parallel_for_chunks("threads.lines.txt", 4, [&](auto &, const Chunk &c) {
+        if(c.begin && DATA[c.begin - 1] != '\n') aligned = false;
+    });
+    CHECK(aligned);
+    std::remove("threads.lines.txt");
+}
+
+void multi_reader() {
+    std::vector<std::string> paths, contents;
+    for(int i = 0; i < 5; ++i) {
+        paths.push_back("threads.multi." + std::to_string(i) + ".gz");
+        contents.push_back(make_text(100000 * (i + 1)));
+        write_data<GzipFile *>(paths.back().data(), contents.back());
+    }
+    Options opts;
+    opts.threads = 2;
+    opts.buffer_size = 1 << 16;
+    {
+        MultiReader<GzipFile *> m(paths, opts, 1 << 20);
+        CHECK(m.size() == paths.size());
+        // Round-robin one line at a time across all files.
+        std::vector<std::string> got(m.size());
+        for(bool any = true; any;) {
+            any = false;
+            for(size_t i = 0; i < m.size(); ++i) {
+                std::string_view line;
+                if(m[i].next_line(line)) {
+                    got[i].append(line.data(), line.size()).push_back('\n');
+                    any = true;
+                }
+            }
+        }
+        for(size_t i = 0; i < m.size(); ++i) {
+            CHECK(got[i] == contents[i]);
+            CHECK(m[i].eof());
+            CHECK(!m[i].error());
+        }
+    }
+    {
+        MultiReader<GzipFile *> m(paths, opts);
+        for(size_t i = m.size(); i--;) CHECK(read_all(m[i], nullptr, 3000) == contents[i]);
+    }
+    for(const auto &p: paths) std::remove(p.data());
+}
+
+} // anonymous namespace
+
+int main() {
+    thread_pool();
+    spsc_ring();
+    read_ahead();
+    write_behind();
+    chunks<std::FILE *>("threads.chunks.txt");
+    chunks<BgzfFile *>("threads.chunks.bgz");
+    chunks<GzipFile *>("threads.chunks.gz");
+#if FP_USE_ZSTD
+    chunks<SeekableZstdFile *>("threads.chunks.szst");
+#endif
+    plain_chunk_boundaries();
+    multi_reader();
+    return fptest::result();
+}